@@ -3,37 +3,68 @@
 
 #pragma once
 
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <array>
 #include <atomic>
-#include <condition_variable>
+#include <chrono>
+#include <climits>
+#include <cstdint>
 #include <functional>
-#include <future>
-#include <memory>
-#include <mutex>
-#include <queue>
 #include <thread>
-#include <type_traits>
 #include <vector>
 
+// Runs the per-subframe jobs of the main loop on a set of realtime worker threads.
+//
+// Jobs are plain descriptors (a function pointer and its arguments) in a fixed size, lock-free
+// multi-producer / multi-consumer ring, so posting a job never allocates or takes a lock. Idle
+// workers sleep on a futex, which is only touched when a worker is actually sleeping.
+//
+// A job can carry a deadline. If a worker only gets to it after the deadline has passed, the job's
+// drop function is called instead of running it. Jobs are taken from the ring in the order they
+// were posted. This is only earliest deadline first if the caller posts them in deadline order.
 class thread_pool
 {
-	// Task function
-	using task_type = std::function<void()>;
-
 public:
-	explicit thread_pool(std::size_t thread_count = std::thread::hardware_concurrency(), int phy_prio = 10)
+	// A job: fn(job) is called on one of the workers
+	struct job
+	{
+		void (*fn)(const job &j);
+		void (*drop)(const job &j);  // called instead of fn once the deadline has passed, nullptr if the job must run
+		void *object;
+		void *context;
+		uint32_t tti;
+		uint32_t tag;  // free for the caller, e.g. the job's priority
+		int64_t deadline_ns;  // steady_clock, 0 for no deadline
+	};
+
+	// Called for every worker once it has been launched, e.g. to pin it to a CPU set
+	using launch_hook_type = std::function<void(std::thread &, std::size_t)>;
+
+	explicit thread_pool(std::size_t thread_count = std::thread::hardware_concurrency(), int phy_prio = 10,
+			launch_hook_type on_launch = nullptr)
 	{
+		for (std::size_t i{ 0 }; i < kCapacity; ++i) {
+			m_slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
 		struct sched_param thread_param; 
 		thread_param.sched_priority = phy_prio; 
 
 		for (std::size_t i{ 0 }; i < thread_count; ++i) {
 			spdlog::info("Launching phy thread with realtime scheduling priority {}", thread_param.sched_priority );
-			m_workers.emplace_back(std::bind(&thread_pool::thread_loop, this));
+			m_workers.emplace_back(&thread_pool::thread_loop, this);
 			
 			int error = pthread_setschedparam( m_workers.back().native_handle(), SCHED_RR, &thread_param );
 			if( error )
 			{
 				spdlog::error("Cannot set phy thread priority to realtime: {}. Thread will run at default priority.", strerror(error));
 			}
+			if (on_launch) {
+				on_launch(m_workers.back(), i);
+			}
 		}
 	}
 
@@ -45,40 +76,29 @@ public:
 	}
 
 	thread_pool(thread_pool const &) = delete;
-	thread_pool(thread_pool &&) = default;
-
 	thread_pool &operator=(thread_pool const &) = delete;
-	thread_pool &operator=(thread_pool &&) = default;
 
-	// Push a new task into the queue
-	template <class Func, class... Args>
-	auto push(Func &&fn, Args &&...args)
+	// Queue a job and wake up a worker for it. The ring holds far more jobs than there are frame
+	// processors, so it can't run full in normal operation. If it does, this spins until a slot is free.
+	void post(const job &j)
 	{
-		using return_type = typename std::result_of<Func(Args...)>::type;
-
-		auto task{ std::make_shared<std::packaged_task<return_type()>>(
-			std::bind(std::forward<Func>(fn), std::forward<Args>(args)...)
-		) };
-
-		auto future{ task->get_future() };
-		std::unique_lock<std::mutex> lock{ m_mutex };
-
-		m_tasks.emplace([task]() {
-			(*task)();
-		});
+		while (!try_enqueue(j)) {
+			std::this_thread::yield();
+		}
 
-		lock.unlock();
-		m_notifier.notify_one();
-		return future;
+		// Pairs with the fence in thread_loop: either we see the sleeping worker, or it sees the job
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_sleeping.load(std::memory_order_relaxed) > 0) {
+			m_wake_seq.fetch_add(1, std::memory_order_release);
+			futex(FUTEX_WAKE_PRIVATE, 1);
+		}
 	}
 
-	// Remove all pending tasks from the queue
+	// Remove all pending jobs from the queue
 	void clear()
 	{
-		std::unique_lock<std::mutex> lock{ m_mutex };
-
-		while (!m_tasks.empty()) {
-			m_tasks.pop();
+		job j;
+		while (try_dequeue(j)) {
 		}
 	}
 
@@ -86,7 +106,8 @@ public:
 	void join()
 	{
 		m_stop = true;
-		m_notifier.notify_all();
+		m_wake_seq.fetch_add(1, std::memory_order_release);
+		futex(FUTEX_WAKE_PRIVATE, INT_MAX);
 
 		for (auto &thread : m_workers) {
 			if (thread.joinable()) {
@@ -109,51 +130,130 @@ public:
 		return m_active;
 	}
 
+	// Get the number of jobs dropped because their deadline had passed
+	uint64_t late_count() const
+	{
+		return m_late;
+	}
+
+	// Current time on the clock used for the job deadlines
+	static int64_t now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
 private:
-	// Thread main loop
-	void thread_loop()
+	static constexpr std::size_t kCapacity = 64;  // power of two
+	static constexpr std::size_t kCacheLineSize = 64;
+
+	// Bounded MPMC queue after Dmitry Vyukov. The sequence number of a slot tells whether it is free
+	// for the producer at position pos (sequence == pos), or holds the job for the consumer at
+	// position pos (sequence == pos + 1).
+	struct alignas(kCacheLineSize) slot
 	{
-		while (true) {
-			// Wait for a new task
-			auto task{ next_task() };
+		std::atomic<std::size_t> sequence;
+		job j;
+	};
 
-			if (task) {
-				++m_active;
-				task();
-				--m_active;
-			}
-			else if (m_stop) {
-				// No more task + stop required
-				break;
+	bool try_enqueue(const job &j)
+	{
+		auto pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			auto &s = m_slots[pos & (kCapacity - 1)];
+			auto diff = static_cast<intptr_t>(s.sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos);
+			if (diff == 0) {
+				if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					s.j = j;
+					s.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;  // full
+			} else {
+				pos = m_enqueue_pos.load(std::memory_order_relaxed);
 			}
 		}
 	}
 
-	// Get the next pending task
-	task_type next_task()
+	bool try_dequeue(job &j)
 	{
-		std::unique_lock<std::mutex> lock{ m_mutex };
+		auto pos = m_dequeue_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			auto &s = m_slots[pos & (kCapacity - 1)];
+			auto diff = static_cast<intptr_t>(s.sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos + 1);
+			if (diff == 0) {
+				if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					j = s.j;
+					s.sequence.store(pos + kCapacity, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;  // empty
+			} else {
+				pos = m_dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
 
-		m_notifier.wait(lock, [this]() {
-			return !m_tasks.empty() || m_stop;
-		});
+	long futex(int op, uint32_t val)
+	{
+		return syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_wake_seq), op, val, nullptr, nullptr, 0);
+	}
 
-		if (m_tasks.empty()) {
-			// No pending task
-			return {};
+	void run(const job &j)
+	{
+		++m_active;
+		if (j.drop != nullptr && j.deadline_ns > 0 && now_ns() > j.deadline_ns) {
+			++m_late;
+			j.drop(j);
+		} else {
+			j.fn(j);
 		}
+		--m_active;
+	}
+
+	// Thread main loop
+	void thread_loop()
+	{
+		job j;
+		while (true) {
+			if (try_dequeue(j)) {
+				run(j);
+				continue;
+			}
+			if (m_stop) {
+				// No more jobs + stop required
+				break;
+			}
 
-		auto task{ m_tasks.front() };
-		m_tasks.pop();
-		return task;
+			// Announce that we're going to sleep, then check the queue once more before actually
+			// sleeping. A job posted after the check bumps the futex word, so the wait returns at once.
+			auto seq = m_wake_seq.load(std::memory_order_acquire);
+			m_sleeping.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!try_dequeue(j)) {
+				if (!m_stop) {
+					futex(FUTEX_WAIT_PRIVATE, seq);
+				}
+				m_sleeping.fetch_sub(1, std::memory_order_relaxed);
+				continue;
+			}
+			m_sleeping.fetch_sub(1, std::memory_order_relaxed);
+			run(j);
+		}
 	}
 
+	std::array<slot, kCapacity> m_slots;
+	alignas(kCacheLineSize) std::atomic<std::size_t> m_enqueue_pos{ 0 };
+	alignas(kCacheLineSize) std::atomic<std::size_t> m_dequeue_pos{ 0 };
+
+	alignas(kCacheLineSize) std::atomic<uint32_t> m_wake_seq{ 0 };  // futex word
+	std::atomic<uint32_t> m_sleeping{ 0 };
+
 	std::atomic<bool> m_stop{ false };
 	std::atomic<std::size_t> m_active{ 0 };
-
-	std::condition_variable m_notifier;
-	std::mutex m_mutex;
+	std::atomic<uint64_t> m_late{ 0 };
 
 	std::vector<std::thread> m_workers;
-	std::queue<task_type> m_tasks;
 };
@@ -26,12 +26,17 @@ auto CasFrameProcessor::init() -> bool {
 
   for (auto ch = 0; ch < _rx_channels; ch++) {
     _signal_buffer_rx[ch] = srsran_vec_cf_malloc(_signal_buffer_max_samples);
-    if (!_signal_buffer_rx[ch]) {
+    auto capture_buffer = srsran_vec_cf_malloc(max_rx_history() + _signal_buffer_max_samples);
+    if (!_signal_buffer_rx[ch] || !capture_buffer) {
       spdlog::error("Could not allocate regular DL signal buffer\n");
       return false;
     }
+    srsran_vec_cf_zero(capture_buffer, max_rx_history());
+    _capture_buffer_rx[ch] = capture_buffer + max_rx_history();
   }
 
+  _cfg.lookupValue("modem.phy.cas_decimation", _decimation_enabled);
+
   if (srsran_ue_dl_init(&_ue_dl, _signal_buffer_rx, MAX_PRB, _rx_channels)) {
     spdlog::error("Could not init ue_dl\n");
     return false;;
@@ -77,6 +82,12 @@ CasFrameProcessor::~CasFrameProcessor() {
       free(i);
     }
   }
+  for (auto ch = 0; ch < _rx_channels; ch++) {
+    free(_signal_buffer_rx[ch]);
+    if (_capture_buffer_rx[ch] != nullptr) {
+      free(_capture_buffer_rx[ch] - max_rx_history());
+    }
+  }
   srsran_softbuffer_rx_free(&_softbuffer);
   srsran_ue_dl_free(&_ue_dl);
 }
@@ -84,6 +95,20 @@ CasFrameProcessor::~CasFrameProcessor() {
 void CasFrameProcessor::set_cell(srsran_cell_t cell) {
   _cell = cell;
   spdlog::debug("CAS processor setting cell ({} PRB / {} MBSFN PRB).", cell.nof_prb, cell.mbsfn_prb);
+
+  // Subframes arrive at the sample rate of the (wider) MBSFN bandwidth. Instead of decoding the CAS at
+  // that rate, decimate them to the CAS rate first, if the rates are an integer multiple of each other.
+  unsigned decimation = 1;
+  auto capture_sz = srsran_symbol_sz(cell.mbsfn_prb);
+  auto cas_sz = srsran_symbol_sz(cell.nof_prb);
+  if (_decimation_enabled && cell.mbsfn_prb > cell.nof_prb && cas_sz > 0 && capture_sz > cas_sz &&
+      capture_sz % cas_sz == 0 && capture_sz / cas_sz <= Resampler::kMaxDecimation) {
+    decimation = capture_sz / cas_sz;
+    cell.mbsfn_prb = cell.nof_prb;
+    spdlog::info("CAS processor decimating subframes by {} to {} PRB", decimation, cell.nof_prb);
+  }
+  _resampler.set_decimation(decimation);
+
   srsran_ue_dl_set_cell(&_ue_dl, cell);
   _started = true;
 }
@@ -93,11 +118,16 @@ auto CasFrameProcessor::process(uint32_t tti) -> bool {
 
   _rest._pdsch.total++;
 
+  if (_buffer_decimation > 1) {
+    for (auto ch = 0; ch < _rx_channels; ch++) {
+      _resampler.decimate(_capture_buffer_rx[ch], _signal_buffer_rx[ch], SRSRAN_SF_LEN_PRB(_cell.nof_prb));
+    }
+  }
+
   // Run the FFT and do channel estimation
   if (srsran_ue_dl_decode_fft_estimate(&_ue_dl, &_sf_cfg, &_ue_dl_cfg) < 0) {
     _rest._pdsch.errors++;
     spdlog::error("Getting PDCCH FFT estimate\n");
-    _mutex.unlock();
     return false;
   }
 
@@ -115,7 +145,6 @@ auto CasFrameProcessor::process(uint32_t tti) -> bool {
 
     if (srsran_ue_dl_dci_to_pdsch_grant(&_ue_dl, &_sf_cfg, &_ue_dl_cfg, &dci[k], &_ue_dl_cfg.cfg.pdsch.grant)) {
       spdlog::error("Converting DCI message to DL dci\n");
-    _mutex.unlock();
       return false;
     }
 
@@ -156,7 +185,6 @@ auto CasFrameProcessor::process(uint32_t tti) -> bool {
       }
     }
   }
-    _mutex.unlock();
   return true;
 }
 
@@ -26,6 +26,7 @@
 #include "srsran/srsran.h"
 #include "srsran/rlc/rlc.h"
 #include "Phy.h"
+#include "Resampler.h"
 #include "RestHandler.h"
 #include <libconfig.h++>
 
@@ -79,23 +80,31 @@ class CasFrameProcessor {
    void set_cell(srsran_cell_t cell);
 
    /**
-    *  Get a handle of the signal buffer to store samples for processing in
+    *  Get the buffer for the next subframe. If the cell's MBSFN bandwidth is wider than the CAS, this
+    *  buffer takes the subframe at the MBSFN sample rate, and it is decimated to the CAS rate before decoding.
+    *
+    *  Only to be called by the owner of the processor's slot in the ProcessorPool.
     */
-   cf_t** get_rx_buffer_and_lock() {  _mutex.lock(); return _signal_buffer_rx; }
+   cf_t** get_rx_buffer() {
+     _buffer_decimation = _resampler.decimation();
+     return _buffer_decimation > 1 ? _capture_buffer_rx : _signal_buffer_rx;
+   }
 
    /**
-    *  Size of the signal buffer
+    *  Number of samples that precede the subframe in the stream, and must be written in front of the buffers
+    *  returned by get_rx_buffer() for the decimation filter. Only valid after get_rx_buffer().
     */
-   uint32_t rx_buffer_size() { return _signal_buffer_max_samples; }
+   uint32_t rx_history() const { return _buffer_decimation > 1 ? _resampler.history() : 0; }
 
-    /**
-     *  Unlock the processor
-     *
-     *  @see get_rx_buffer_and_lock() 
-     */
-    void unlock() { _mutex.unlock(); }
+   /**
+    *  Largest rx_history() for any cell
+    */
+   uint32_t max_rx_history() const { return _resampler.max_history(); }
 
-    void lock() { _mutex.lock(); }
+   /**
+    *  Size of the signal buffer
+    */
+   uint32_t rx_buffer_size() { return _signal_buffer_max_samples; }
 
    /**
     *  Get the CE values (time domain) for displaying the spectrum
@@ -178,6 +187,7 @@ class CasFrameProcessor {
     RestHandler& _rest;
 
     cf_t*    _signal_buffer_rx[SRSRAN_MAX_PORTS] = {};
+    cf_t*    _capture_buffer_rx[SRSRAN_MAX_PORTS] = {};  // subframe at the MBSFN rate, if decimating, after max_rx_history() samples
     uint32_t _signal_buffer_max_samples          = 0;
 
     srsran_softbuffer_rx_t _softbuffer;
@@ -188,7 +198,9 @@ class CasFrameProcessor {
     srsran_dl_sf_cfg_t _sf_cfg = {};
 
     srsran_cell_t _cell;
-    std::mutex _mutex;
+    bool _decimation_enabled = true;
+    Resampler _resampler;
+    unsigned _buffer_decimation = 1;
     unsigned _rx_channels;
 
     bool _started = 0;
@@ -0,0 +1,259 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "Channelizer.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <complex>
+#include "spdlog/spdlog.h"
+
+Channelizer::Channelizer(const libconfig::Config& cfg, get_samples_t source, unsigned rx_channels)
+  : _cfg(cfg)
+  , _source(std::move(source))
+  , _rx_channels(rx_channels)
+{
+}
+
+Channelizer::~Channelizer() {
+  for (auto buffer : _input) {
+    free(buffer);
+  }
+  for (auto& carrier : _carriers) {
+    for (auto buffer : carrier.ring) {
+      free(buffer);
+    }
+  }
+}
+
+auto Channelizer::init() -> bool {
+  _cfg.lookupValue("modem.channelizer.decimation", _decimation);
+  _cfg.lookupValue("modem.channelizer.taps_per_branch", _taps_per_branch);
+  _cfg.lookupValue("modem.channelizer.cutoff", _cutoff);
+  _cfg.lookupValue("modem.channelizer.max_queued_ms", _max_queued_ms);
+
+  if (_decimation < 1 || _taps_per_branch < 1 || _cutoff <= 0 || _cutoff > 1) {
+    spdlog::error("Invalid channelizer configuration: decimation {}, taps per branch {}, cutoff {}",
+        _decimation, _taps_per_branch, _cutoff);
+    return false;
+  }
+
+  if (!_cfg.exists("modem.channelizer.carriers")) {
+    spdlog::error("No carriers configured for the channelizer");
+    return false;
+  }
+
+  const libconfig::Setting& carriers = _cfg.lookup("modem.channelizer.carriers");
+  for (int i = 0; i < carriers.getLength(); i++) {
+    double offset = 0;
+    if (!carriers[i].lookupValue("offset_hz", offset)) {
+      spdlog::error("Channelizer carrier {} has no offset_hz", i);
+      return false;
+    }
+    _carriers.push_back({offset});
+  }
+
+  if (_carriers.empty()) {
+    spdlog::error("No carriers configured for the channelizer");
+    return false;
+  }
+
+  spdlog::info("Channelizer: {} carrier(s), decimation {}, {} taps", _carriers.size(), _decimation,
+      _decimation * _taps_per_branch);
+  return true;
+}
+
+void Channelizer::configure(double input_rate) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _input_rate = input_rate;
+  auto output_rate = input_rate / _decimation;
+
+  // Lowpass prototype: Blackman windowed sinc, cut off at a fraction of the output Nyquist frequency
+  auto nof_taps = _decimation * _taps_per_branch;
+  auto fc = _cutoff * 0.5 / _decimation;
+  std::vector<double> prototype(nof_taps);
+  double sum = 0;
+  for (unsigned i = 0; i < nof_taps; i++) {
+    double n = i - (nof_taps - 1) / 2.0;
+    double sinc = n == 0 ? 2 * fc : sin(2 * M_PI * fc * n) / (M_PI * n);
+    double window = 0.42 - 0.5 * cos(2 * M_PI * i / (nof_taps - 1)) + 0.08 * cos(4 * M_PI * i / (nof_taps - 1));
+    prototype[i] = sinc * window;
+    sum += prototype[i];
+  }
+
+  for (auto& carrier : _carriers) {
+    if (fabs(carrier.offset) + _cutoff * output_rate / 2 > input_rate / 2) {
+      spdlog::warn("Channelizer carrier at {} MHz offset does not fit into the captured {} MHz",
+          carrier.offset / 1000000.0, input_rate / 1000000.0);
+    }
+
+    // Shift the prototype to the carrier. Tap i multiplies the input sample i samples before the output
+    // sample, so after the sum the output still has to be shifted by the phase of the output sample itself.
+    carrier.taps.resize(nof_taps);
+    auto w = 2 * M_PI * carrier.offset / input_rate;
+    for (unsigned i = 0; i < nof_taps; i++) {
+      carrier.taps[nof_taps - 1 - i] = std::polar(static_cast<float>(prototype[i] / sum), static_cast<float>(w * i));
+    }
+    carrier.phase_increment = -w * _decimation;
+  }
+
+  for (auto buffer : _input) {
+    free(buffer);
+  }
+  _input.clear();
+  _history = nof_taps - 1;
+  _block = static_cast<size_t>(ceil(output_rate / 1000.0)) * _decimation;
+  for (unsigned ch = 0; ch < _rx_channels; ch++) {
+    _input.push_back(srsran_vec_cf_malloc(_history + _block));
+  }
+
+  // Room for max_queued_ms of output, plus the block being written. Blocks never wrap around the end.
+  auto output_samples = _block / _decimation;
+  _max_queued = std::max(static_cast<size_t>(_max_queued_ms * output_rate / 1000.0), output_samples);
+  _ring_size = (_max_queued / output_samples + 2) * output_samples;
+  for (auto& carrier : _carriers) {
+    for (auto buffer : carrier.ring) {
+      free(buffer);
+    }
+    carrier.ring.clear();
+    for (unsigned ch = 0; ch < _rx_channels; ch++) {
+      carrier.ring.push_back(srsran_vec_cf_malloc(_ring_size));
+    }
+  }
+
+  spdlog::info("Channelizer: {} MHz input, {} MHz per carrier", input_rate / 1000000.0, output_rate / 1000000.0);
+
+  for (unsigned i = 0; i < _carriers.size(); i++) {
+    spdlog::info("Channelizer: carrier {} at {} MHz offset", i, _carriers[i].offset / 1000000.0);
+  }
+
+  reset_state();
+}
+
+void Channelizer::reset() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  reset_state();
+}
+
+void Channelizer::reset_state() {
+  for (auto buffer : _input) {
+    srsran_vec_cf_zero(buffer, _history);
+  }
+  for (auto& carrier : _carriers) {
+    carrier.phase = 0;
+    carrier.written = 0;
+    carrier.read = 0;
+    carrier.head_time_ns = -1;
+  }
+}
+
+auto Channelizer::process_block() -> bool {
+  std::array<cf_t*, SRSRAN_MAX_CHANNELS> block = { nullptr };
+  for (unsigned ch = 0; ch < _rx_channels; ch++) {
+    block[ch] = _input[ch] + _history;
+  }
+
+  srsran_timestamp_t rx_time = {};
+  rx_time.full_secs = -1;
+  if (_source(block.data(), _block, &rx_time) < 0) {
+    return false;
+  }
+  long long time_ns = rx_time.full_secs < 0 ? -1 :
+    static_cast<long long>(rx_time.full_secs) * 1000000000 + llround(rx_time.frac_secs * 1e9);
+
+  auto output_samples = _block / _decimation;
+  for (auto& carrier : _carriers) {
+    if (!carrier.active) {
+      continue;
+    }
+    auto nof_taps = carrier.taps.size();
+    auto offset = carrier.written % _ring_size;
+    auto start = std::polar(1.0f, static_cast<float>(carrier.phase));
+    auto cfo = static_cast<float>(carrier.phase_increment / (2 * M_PI));
+    for (unsigned ch = 0; ch < _rx_channels; ch++) {
+      auto out = carrier.ring[ch] + offset;
+      for (size_t m = 0; m < output_samples; m++) {
+        // Output m is aligned with the last input sample of its group of decimation() samples
+        out[m] = srsran_vec_dot_prod_ccc(_input[ch] + m * _decimation + _decimation - 1, carrier.taps.data(), nof_taps);
+      }
+
+      // Shift the whole block to baseband: a rotation starting at 0, turned to the carrier's phase
+      srsran_vec_apply_cfo(out, cfo, out, output_samples);
+      srsran_vec_sc_prod_ccc(out, start, out, output_samples);
+    }
+    carrier.phase = fmod(carrier.phase + output_samples * carrier.phase_increment, 2 * M_PI);
+    carrier.written += output_samples;
+
+    if (carrier.written - carrier.read == output_samples) {
+      carrier.head_time_ns = time_ns;
+    }
+
+    // Drop the oldest samples if the carrier is not read in time
+    auto queued = carrier.written - carrier.read;
+    if (queued > _max_queued) {
+      auto drop = queued - _max_queued;
+      carrier.read += drop;
+      carrier.dropped += drop;
+      if (carrier.head_time_ns >= 0) {
+        carrier.head_time_ns += static_cast<long long>(drop * 1e9 * _decimation / _input_rate);
+      }
+    }
+  }
+
+  for (unsigned ch = 0; ch < _rx_channels; ch++) {
+    srsran_vec_cf_copy(_input[ch], _input[ch] + _block, _history);
+  }
+  return true;
+}
+
+auto Channelizer::get_samples(unsigned carrier, cf_t* data[SRSRAN_MAX_CHANNELS], uint32_t nsamples,  // NOLINT
+    srsran_timestamp_t* rx_time) -> int {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto& c = _carriers[carrier];
+  if (nsamples > _max_queued) {
+    spdlog::error("Channelizer: {} samples requested, only {} can be queued", nsamples, _max_queued);
+    return SRSRAN_ERROR;
+  }
+  if (!c.active) {
+    spdlog::info("Channelizer: filtering carrier {}", carrier);
+    c.active = true;
+  }
+  while (c.written - c.read < nsamples) {
+    if (!process_block()) {
+      return SRSRAN_ERROR;
+    }
+  }
+
+  // Copy out of the ring, in two parts if the samples wrap around its end
+  auto offset = c.read % _ring_size;
+  auto first = std::min(static_cast<size_t>(nsamples), _ring_size - offset);
+  for (unsigned ch = 0; ch < _rx_channels; ch++) {
+    srsran_vec_cf_copy(data[ch], c.ring[ch] + offset, first);
+    srsran_vec_cf_copy(data[ch] + first, c.ring[ch], nsamples - first);
+  }
+  if (rx_time != nullptr && c.head_time_ns >= 0) {
+    srsran_timestamp_init(rx_time, c.head_time_ns / 1000000000, (c.head_time_ns % 1000000000) / 1e9);
+  }
+  c.read += nsamples;
+  if (c.head_time_ns >= 0) {
+    c.head_time_ns += static_cast<long long>(nsamples * 1e9 * _decimation / _input_rate);
+  }
+  return 0;
+}
@@ -0,0 +1,149 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <libconfig.h++>
+#include "srsran/srsran.h"
+
+/**
+ *  Splits a wideband capture into several decimated carriers.
+ *
+ *  The SDR is tuned to a center frequency and a sample rate of decimation() times the rate of a
+ *  single carrier. Each carrier is configured with its offset from the center frequency, and is
+ *  filtered with a bandpass version of a common lowpass prototype and decimated in polyphase form:
+ *  the filter is only evaluated for the samples that are kept, one dot product of all
+ *  decimation() branches per output sample. The frequency shift to baseband is applied after
+ *  decimation, at the output rate, to a whole block at once.
+ *
+ *  The wideband samples are pulled from the source (normally SdrReader::get_samples) one block at
+ *  a time, and the output of every carrier is queued in a fixed ring until it is read with
+ *  get_samples(). Only the carriers that are read are filtered: a carrier is filtered from its first
+ *  get_samples() call on. If such a carrier is not read in time, its oldest samples are dropped once
+ *  its ring is full.
+ *
+ *  Not used by the modem yet: decoding more than one carrier needs a receiver chain (Phy, frame
+ *  processors and main loop state) per carrier, and for a single carrier the SDR can be tuned to it
+ *  directly at a fraction of the cost.
+ */
+class Channelizer {
+  public:
+    typedef std::function<int(cf_t* data[SRSRAN_MAX_CHANNELS], uint32_t nsamples, srsran_timestamp_t* rx_time)> get_samples_t;
+
+    /**
+     *  Default constructor.
+     *
+     *  @param cfg Config singleton reference
+     *  @param source Callback to read the wideband samples from
+     *  @param rx_channels Number of RX channels
+     */
+    Channelizer(const libconfig::Config& cfg, get_samples_t source, unsigned rx_channels);
+
+    /**
+     *  Default destructor.
+     */
+    virtual ~Channelizer();
+
+    /**
+     *  Read the decimation factor and the carrier offsets from the config
+     */
+    bool init();
+
+    /**
+     *  Design the filters for a wideband input rate, and reset all state.
+     *
+     *  @param input_rate Sample rate of the source, in Hz
+     */
+    void configure(double input_rate);
+
+    /**
+     *  Discard all queued samples and the filter history, e.g. after the SDR has been restarted.
+     */
+    void reset();
+
+    /**
+     *  Read samples of one carrier, at the decimated rate. Blocks until the source has delivered
+     *  enough wideband samples.
+     *
+     *  @return 0 on success, SRSRAN_ERROR if the source failed or more than max_queued_ms of samples were requested
+     */
+    int get_samples(unsigned carrier, cf_t* data[SRSRAN_MAX_CHANNELS], uint32_t nsamples, srsran_timestamp_t* rx_time);
+
+    /**
+     *  Decimation factor between the SDR rate and the carrier rate
+     */
+    unsigned decimation() const { return _decimation; }
+
+    /**
+     *  Number of configured carriers
+     */
+    unsigned nof_carriers() const { return _carriers.size(); }
+
+    /**
+     *  Offset of a carrier from the SDR center frequency, in Hz
+     */
+    double carrier_offset(unsigned carrier) const { return _carriers[carrier].offset; }
+
+    /**
+     *  Number of samples dropped from a carrier's queue because it was not read in time
+     */
+    uint64_t dropped(unsigned carrier) const { return _carriers[carrier].dropped; }
+
+  private:
+    struct Carrier {
+      double offset;
+      bool active = false;  // filtered, because it is being read
+      std::vector<cf_t> taps = {};  // bandpass taps, in reverse order
+      double phase = 0;
+      double phase_increment = 0;
+      std::vector<cf_t*> ring = {};  // one per RX channel, _ring_size samples each
+      uint64_t written = 0;  // samples written to / read from the ring since the last reset
+      uint64_t read = 0;
+      long long head_time_ns = -1;  // time of the sample at read, -1 if unknown
+      uint64_t dropped = 0;
+    };
+
+    void reset_state();
+    bool process_block();
+
+    const libconfig::Config& _cfg;
+    get_samples_t _source;
+    unsigned _rx_channels;
+
+    unsigned _decimation = 1;
+    unsigned _taps_per_branch = 16;
+    double _cutoff = 0.8;
+    double _input_rate = 0;
+    unsigned _max_queued_ms = 100;
+
+    std::vector<Carrier> _carriers;
+    size_t _ring_size = 0;  // a whole number of blocks of output samples
+    size_t _max_queued = 0;  // output samples
+
+    // Wideband input: the last (taps - 1) samples of the previous block, followed by the current block
+    std::vector<cf_t*> _input;
+    size_t _history = 0;
+    size_t _block = 0;  // input samples per block, a multiple of the decimation
+
+    std::mutex _mutex;
+};
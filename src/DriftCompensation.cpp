@@ -0,0 +1,40 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "DriftCompensation.h"
+
+#include <algorithm>
+
+DriftCompensation::DriftCompensation(const libconfig::Config& cfg)
+  : _cfg(cfg)
+{
+}
+
+void DriftCompensation::init() {
+  _cfg.lookupValue("modem.sdr.drift_max_ppm", _max_ppm);
+}
+
+auto DriftCompensation::update(uint32_t tti, float sfo, double sample_rate) -> bool {
+  if (tti % kUpdateInterval != 0) {
+    return false;
+  }
+  _residual_ppm = sfo / sample_rate * 1e6;
+  _correction_ppm = std::min(std::max(_correction_ppm + kLoopGain * _residual_ppm, -_max_ppm), _max_ppm);
+  return true;
+}
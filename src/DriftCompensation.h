@@ -0,0 +1,76 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <libconfig.h++>
+
+/**
+ *  Closed loop that keeps the subframe timing locked to the transmitter's sample clock.
+ *
+ *  The PHY tracks the sample frequency offset (SFO) of the received signal against its own subframe
+ *  timing. Every kUpdateInterval subframes, a part of this residual offset is integrated into a rate
+ *  correction for the SDR's resampler, so the residual goes to zero instead of the timing drifting
+ *  until sync is lost. The correction is limited to modem.sdr.drift_max_ppm.
+ */
+class DriftCompensation {
+ public:
+    static const unsigned kUpdateInterval = 100;  /**< Subframes between updates of the correction */
+    static constexpr double kLoopGain = 0.2;      /**< Part of the residual SFO corrected per update */
+
+    /**
+     *  Default constructor.
+     *
+     *  @param cfg Config singleton reference
+     */
+    explicit DriftCompensation(const libconfig::Config& cfg);
+
+    /**
+     *  Read the correction limit from the config
+     */
+    void init();
+
+    /**
+     *  Feed the SFO tracked by the PHY in a subframe.
+     *
+     *  @param tti TTI of the subframe
+     *  @param sfo Sample frequency offset, in Hz
+     *  @param sample_rate Sample rate the offset refers to
+     *  @return true if the correction has been updated, and has to be passed to the SDR
+     */
+    bool update(uint32_t tti, float sfo, double sample_rate);
+
+    /**
+     *  Rate correction for the SDR's resampler, in ppm
+     */
+    double correction_ppm() const { return _correction_ppm; }
+
+    /**
+     *  Residual offset at the last update, in ppm
+     */
+    double residual_ppm() const { return _residual_ppm; }
+
+ private:
+    const libconfig::Config& _cfg;
+
+    double _max_ppm = 50.0;
+    double _correction_ppm = 0;
+    double _residual_ppm = 0;
+};
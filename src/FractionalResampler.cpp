@@ -0,0 +1,133 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "FractionalResampler.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+FractionalResampler::FractionalResampler(unsigned channels)
+  : _channels(channels)
+  , _buffers(channels, nullptr)
+{
+  set_ratio(1.0);
+}
+
+FractionalResampler::~FractionalResampler() {
+  for (auto buffer : _buffers) {
+    free(buffer);
+  }
+}
+
+void FractionalResampler::set_ratio(double ratio) {
+  _ratio = ratio;
+
+  // Windowed sinc over kTapsPerPhase input samples, sampled at kPhases points per input sample. When
+  // decimating, the cut off moves down to the output Nyquist frequency.
+  auto length = kTapsPerPhase * kPhases + 1;
+  auto fc = 0.5 * std::min(1.0, 1.0 / ratio);
+  std::vector<double> kernel(length);
+  for (unsigned i = 0; i < length; i++) {
+    double t = static_cast<double>(i) / kPhases - kTapsPerPhase / 2.0;
+    double sinc = t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+    double window = 0.42 - 0.5 * cos(2 * M_PI * i / (length - 1)) + 0.08 * cos(4 * M_PI * i / (length - 1));
+    kernel[i] = sinc * window;
+  }
+
+  // Tap k of a sub-filter multiplies the input sample k positions before the last one in its window.
+  // Normalize every sub-filter to unity gain at DC.
+  _phases.assign(kPhases + 1, std::vector<float>(kTapsPerPhase));
+  for (unsigned p = 0; p <= kPhases; p++) {
+    double sum = 0;
+    for (unsigned k = 0; k < kTapsPerPhase; k++) {
+      sum += kernel[k * kPhases + p];
+    }
+    for (unsigned k = 0; k < kTapsPerPhase; k++) {
+      _phases[p][kTapsPerPhase - 1 - k] = static_cast<float>(kernel[k * kPhases + p] / sum);
+    }
+  }
+
+  reset();
+}
+
+void FractionalResampler::reset() {
+  for (auto buffer : _buffers) {
+    if (buffer != nullptr) {
+      srsran_vec_cf_zero(buffer, kTapsPerPhase);
+    }
+  }
+  _buffered = kTapsPerPhase - 1;
+  _position = kTapsPerPhase / 2 - 1;
+}
+
+auto FractionalResampler::resample(const void* const* in, size_t nof_in, void* const* out) -> size_t {
+  auto start = std::chrono::steady_clock::now();
+
+  if (_buffer_size < _buffered + nof_in) {
+    _buffer_size = _buffered + nof_in;
+    for (unsigned ch = 0; ch < _channels; ch++) {
+      auto buffer = srsran_vec_cf_malloc(_buffer_size);
+      if (_buffers[ch] != nullptr) {
+        srsran_vec_cf_copy(buffer, _buffers[ch], _buffered);
+        free(_buffers[ch]);
+      } else {
+        srsran_vec_cf_zero(buffer, _buffered);
+      }
+      _buffers[ch] = buffer;
+    }
+  }
+  for (unsigned ch = 0; ch < _channels; ch++) {
+    srsran_vec_cf_copy(_buffers[ch] + _buffered, static_cast<const cf_t*>(in[ch]), nof_in);
+  }
+  _buffered += nof_in;
+
+  // Output sample at input position n + mu uses the inputs n - kTapsPerPhase/2 + 1 .. n + kTapsPerPhase/2
+  const long half = kTapsPerPhase / 2;
+  size_t produced = 0;
+  auto position = _position;
+  while (static_cast<long>(position) + half < static_cast<long>(_buffered)) {
+    auto n = static_cast<long>(position);
+    auto& taps = _phases[lround((position - n) * kPhases)];
+    for (unsigned ch = 0; ch < _channels; ch++) {
+      static_cast<cf_t*>(out[ch])[produced] = srsran_vec_dot_prod_cfc(_buffers[ch] + n - half + 1, taps.data(), kTapsPerPhase);
+    }
+    produced++;
+    position += _ratio;
+  }
+
+  // Keep the history needed for the next output sample
+  auto keep_from = static_cast<size_t>(static_cast<long>(position) - half + 1);
+  keep_from = std::min(keep_from, _buffered);
+  for (unsigned ch = 0; ch < _channels; ch++) {
+    memmove(_buffers[ch], _buffers[ch] + keep_from, (_buffered - keep_from) * sizeof(cf_t));
+  }
+  _buffered -= keep_from;
+  _position = position - keep_from;
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+  _processing_ns += elapsed.count();
+  _processed_samples += produced * _channels;
+  return produced;
+}
+
+auto FractionalResampler::ns_per_sample() const -> double {
+  auto samples = _processed_samples.load();
+  return samples > 0 ? static_cast<double>(_processing_ns.load()) / samples : 0.0;
+}
@@ -0,0 +1,111 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "srsran/srsran.h"
+
+/**
+ *  Converts a continuous sample stream between two arbitrary sample rates.
+ *
+ *  Used when the SDR can't deliver the exact LTE sample rate that has been requested. Every output
+ *  sample is interpolated from the input with a windowed sinc kernel. The kernel is stored as a
+ *  polyphase bank of kPhases sub-filters of kTapsPerPhase taps. For each output sample, the
+ *  sub-filter closest to the fractional input position is applied with a SIMD dot product.
+ *
+ *  The filter history and the fractional position are kept between calls, so the stream can be
+ *  passed in blocks of any size. All channels are resampled in lockstep.
+ */
+class FractionalResampler {
+ public:
+    /**
+     *  Default constructor.
+     *
+     *  @param channels Number of channels to resample
+     */
+    explicit FractionalResampler(unsigned channels);
+
+    /**
+     *  Default destructor.
+     */
+    virtual ~FractionalResampler();
+
+    /**
+     *  Set the ratio of the input to the output sample rate, design the filter and reset the state.
+     */
+    void set_ratio(double ratio);
+
+    /**
+     *  Change the ratio slightly, e.g. to follow a drifting clock, without redesigning the filter or
+     *  interrupting the stream.
+     */
+    void adjust_ratio(double ratio) { _ratio = ratio; }
+
+    /**
+     *  Ratio of the input to the output sample rate
+     */
+    double ratio() const { return _ratio; }
+
+    /**
+     *  Discard the filter history, e.g. when the stream is restarted
+     */
+    void reset();
+
+    /**
+     *  Maximum number of output samples produced from nof_in input samples
+     */
+    size_t max_output(size_t nof_in) const { return static_cast<size_t>(nof_in / _ratio) + 2; }
+
+    /**
+     *  Resample a block of input samples. All input samples are consumed.
+     *
+     *  @param in  Input buffers (cf_t), one per channel
+     *  @param nof_in Number of input samples per channel
+     *  @param out Output buffers, one per channel, with room for max_output(nof_in) samples
+     *  @return Number of output samples written per channel
+     */
+    size_t resample(const void* const* in, size_t nof_in, void* const* out);
+
+    /**
+     *  Average processing time per output sample (and channel), in nanoseconds
+     */
+    double ns_per_sample() const;
+
+ private:
+    static const unsigned kPhases = 256;
+    static const unsigned kTapsPerPhase = 16;
+
+    unsigned _channels;
+    double _ratio = 1.0;
+
+    // Sub-filter p holds the taps for a fractional position of p / kPhases, in reverse order
+    std::vector<std::vector<float>> _phases;
+
+    // Filter history followed by the current input block, per channel
+    std::vector<cf_t*> _buffers;
+    size_t _buffer_size = 0;
+    size_t _buffered = 0;
+    double _position = 0;  // input position of the next output sample, in _buffers
+
+    std::atomic<uint64_t> _processing_ns = { 0 };
+    std::atomic<uint64_t> _processed_samples = { 0 };
+};
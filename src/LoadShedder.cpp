@@ -0,0 +1,115 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "LoadShedder.h"
+
+#include <algorithm>
+#include <chrono>
+#include "spdlog/spdlog.h"
+
+LoadShedder::LoadShedder(const libconfig::Config& cfg)
+  : _cfg(cfg)
+{
+}
+
+void LoadShedder::init() {
+  _cfg.lookupValue("modem.shedding.enabled", _enabled);
+  _cfg.lookupValue("modem.shedding.reserve", _reserve);
+  _cfg.lookupValue("modem.shedding.mch_wait_us", _mch_wait_us);
+  _cfg.lookupValue("modem.shedding.deadline_us", _deadline_us);
+
+  if (_cfg.exists("modem.shedding.mchs")) {
+    const libconfig::Setting& mchs = _cfg.lookup("modem.shedding.mchs");
+    for (int i = 0; i < mchs.getLength(); i++) {
+      _mchs.insert(static_cast<unsigned>(static_cast<int>(mchs[i])));
+    }
+  }
+
+  if (_enabled) {
+    spdlog::info("Load shedding: deadline {} us, MCH wait {} us, {} processor(s) reserved, {} MCH(s) selected",
+        _deadline_us, _mch_wait_us, _reserve, _mchs.empty() ? std::string("all") : std::to_string(_mchs.size()));
+  } else {
+    spdlog::info("Load shedding disabled");
+  }
+}
+
+auto LoadShedder::classify(Phy& phy, uint32_t tti, unsigned& mch_idx) -> Priority {
+  mch_idx = 0;
+  if (!phy.mcch_configured() || !phy.is_mbsfn_subframe(tti)) {
+    return Priority::Padding;
+  }
+
+  auto mbsfn_cfg = phy.mbsfn_config_for_tti(tti, mch_idx);
+  if (!mbsfn_cfg.enable) {
+    return Priority::Padding;
+  }
+  if (mbsfn_cfg.is_mcch) {
+    return Priority::Mcch;
+  }
+  return _mchs.empty() || _mchs.count(mch_idx) > 0 ? Priority::Mch : Priority::UnselectedMch;
+}
+
+auto LoadShedder::admit(ProcessorPool<MbsfnFrameProcessor>& pool, Priority priority)
+    -> ProcessorPool<MbsfnFrameProcessor>::Slot* {
+  if (!_enabled) {
+    return pool.acquire();
+  }
+
+  switch (priority) {
+    case Priority::Padding:
+    case Priority::UnselectedMch:
+      // Leave at least one processor for the selected data, however small the pool
+      if (pool.idle() <= std::min(_reserve, pool.size() - 1)) {
+        return nullptr;
+      }
+      return pool.try_acquire();
+    case Priority::Mch:
+      return pool.acquire_until(std::chrono::steady_clock::now() + std::chrono::microseconds(_mch_wait_us));
+    case Priority::Mcch:
+    default:
+      return pool.acquire();
+  }
+}
+
+auto LoadShedder::deadline_ns(Priority priority, int64_t received_ns) const -> int64_t {
+  if (!_enabled || priority == Priority::Mcch) {
+    return 0;
+  }
+  return received_ns + std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::microseconds(_deadline_us)).count();
+}
+
+auto LoadShedder::dropped() const -> uint64_t {
+  uint64_t total = 0;
+  for (unsigned i = 0; i < kPriorities; i++) {
+    total += _shed[i] + _late[i];
+  }
+  return total;
+}
+
+auto LoadShedder::priority_name(Priority priority) -> const char* {
+  switch (priority) {
+    case Priority::Padding: return "padding";
+    case Priority::UnselectedMch: return "unselected_mch";
+    case Priority::Mch: return "mch";
+    case Priority::Mcch: return "mcch";
+  }
+  return "unknown";
+}
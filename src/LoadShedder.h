@@ -0,0 +1,141 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <set>
+#include <libconfig.h++>
+#include "Phy.h"
+#include "ProcessorPool.h"
+
+class MbsfnFrameProcessor;
+
+/**
+ *  Decides which MBSFN subframes are dropped when the frame processors can't keep up.
+ *
+ *  Every subframe gets a priority from what it carries. Losing sync costs far more than losing a
+ *  subframe, so the main loop never waits long for a processor. The low priorities are dropped first:
+ *
+ *    Padding        subframes without MCCH or MCH data: only decoded if a processor is idle, and
+ *                   more than the configured reserve of processors is left for the other subframes
+ *    UnselectedMch  MCHs not listed in modem.shedding.mchs: same as padding
+ *    Mch            the selected MCHs: waits up to mch_wait_us for a processor
+ *    Mcch           never dropped, waits for a processor as long as it takes
+ *
+ *  Every subframe handed to a processor gets a deadline of deadline_us after the sync thread has
+ *  received it, so the time it spent in the sync queue counts against it. A worker that only gets to
+ *  a subframe after its deadline drops it, unless it is MCCH. The samples of a dropped subframe are
+ *  still read, so the subframe timing is kept.
+ *
+ *  There is no separate earliest-deadline-first queue. Subframes are received and posted in TTI
+ *  order, and all of them get the same budget, so their deadlines rise in posting order. The FIFO
+ *  job ring of thread_pool therefore hands them to the workers in deadline order. A budget that
+ *  depended on the priority would break this.
+ *
+ *  CAS subframes have a processor of their own and are never dropped.
+ */
+class LoadShedder {
+ public:
+    enum class Priority : unsigned {
+      Padding,
+      UnselectedMch,
+      Mch,
+      Mcch,
+    };
+    static const unsigned kPriorities = 4;
+
+    /**
+     *  Default constructor.
+     *
+     *  @param cfg Config singleton reference
+     */
+    explicit LoadShedder(const libconfig::Config& cfg);
+
+    /**
+     *  Read the settings from modem.shedding
+     */
+    void init();
+
+    /**
+     *  Priority of the MBSFN subframe in a TTI
+     *
+     *  @param mch_idx Set to the index of the MCH the subframe belongs to
+     */
+    Priority classify(Phy& phy, uint32_t tti, unsigned& mch_idx);
+
+    /**
+     *  Get a processor for a subframe of the given priority, according to the shedding policy.
+     *
+     *  @return The processor's slot, or nullptr if the subframe is to be dropped
+     */
+    ProcessorPool<MbsfnFrameProcessor>::Slot* admit(ProcessorPool<MbsfnFrameProcessor>& pool, Priority priority);
+
+    /**
+     *  Deadline for a subframe, for thread_pool::job. 0 if the subframe must not be dropped.
+     *
+     *  @param received_ns Time the subframe was received, see SyncStage::Subframe
+     */
+    int64_t deadline_ns(Priority priority, int64_t received_ns) const;
+
+    /**
+     *  Count a subframe that was dropped without getting a processor
+     */
+    void count_shed(Priority priority) { _shed[static_cast<unsigned>(priority)]++; }
+
+    /**
+     *  Count a subframe that was dropped by a worker because it was past its deadline
+     */
+    void count_late(Priority priority) { _late[static_cast<unsigned>(priority)]++; }
+
+    /**
+     *  Number of subframes of a priority dropped without getting a processor
+     */
+    uint64_t shed(Priority priority) const { return _shed[static_cast<unsigned>(priority)]; }
+
+    /**
+     *  Number of subframes of a priority dropped past their deadline
+     */
+    uint64_t late(Priority priority) const { return _late[static_cast<unsigned>(priority)]; }
+
+    /**
+     *  Total number of dropped subframes
+     */
+    uint64_t dropped() const;
+
+    /**
+     *  Name of a priority, for logging and the REST API
+     */
+    static const char* priority_name(Priority priority);
+
+ private:
+    const libconfig::Config& _cfg;
+
+    bool _enabled = true;
+    unsigned _reserve = 1;
+    unsigned _mch_wait_us = 1000;
+    unsigned _deadline_us = 8000;
+    std::set<unsigned> _mchs;  // empty: all MCHs are selected
+
+    std::array<std::atomic<uint64_t>, kPriorities> _shed = {};
+    std::array<std::atomic<uint64_t>, kPriorities> _late = {};
+};
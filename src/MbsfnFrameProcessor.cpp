@@ -20,11 +20,6 @@
 #include "MbsfnFrameProcessor.h"
 #include "spdlog/spdlog.h"
 
-std::map<uint8_t, uint16_t> MbsfnFrameProcessor::_sched_stops;
-
-std::mutex MbsfnFrameProcessor::_sched_stop_mutex;
-std::mutex MbsfnFrameProcessor::_rlc_mutex;
-
 auto MbsfnFrameProcessor::init() -> bool {
   _signal_buffer_max_samples = 3 * SRSRAN_SF_LEN_PRB(MAX_PRB);
 
@@ -83,8 +78,9 @@ void MbsfnFrameProcessor::set_cell(srsran_cell_t cell) {
 auto MbsfnFrameProcessor::process(uint32_t tti) -> int {
   spdlog::trace("Processing MBSFN TTI {}", tti);
 
-  uint32_t sfn = tti / 10;
-  uint8_t sf = tti % 10;
+  // Whatever happens, the reorder entry must either be filled or cancelled
+  auto entry = _reorder_entry;
+  _reorder_entry = nullptr;
 
   unsigned mch_idx = 0;
   _sf_cfg.tti = tti;
@@ -99,7 +95,7 @@ auto MbsfnFrameProcessor::process(uint32_t tti) -> int {
 
   if (!mbsfn_cfg.enable) {
     spdlog::trace("PMCH: tti {}: neither MCCH nor MCH enabled. Skipping subframe");
-    _mutex.unlock();
+    _reorder.cancel(entry);
     return -1;
   }
 
@@ -116,7 +112,7 @@ auto MbsfnFrameProcessor::process(uint32_t tti) -> int {
       _rest._mch[mch_idx].errors++;
     }
     spdlog::error("Getting PDCCH FFT estimate");
-    _mutex.unlock();
+    _reorder.cancel(entry);
     return -1;
   }
 
@@ -139,7 +135,7 @@ auto MbsfnFrameProcessor::process(uint32_t tti) -> int {
       _rest._mch[mch_idx].errors++;
     }
     spdlog::warn("Error decoding PMCH");
-    _mutex.unlock();
+    _reorder.cancel(entry);
     return -1;
   }
 
@@ -162,41 +158,9 @@ auto MbsfnFrameProcessor::process(uint32_t tti) -> int {
   }
 
   if (pmch_dec.crc) {
-    mch_mac_msg.init_rx(
-        static_cast<uint32_t>(_pmch_cfg.pdsch_cfg.grant.tb[0].tbs) / 8);
-    mch_mac_msg.parse_packet(_payload_buffer);
-
-    while (mch_mac_msg.next()) {
-      if (srsran::mch_lcid::MCH_SCHED_INFO == mch_mac_msg.get()->mch_ce_type()) {
-        uint16_t stop = 0;
-        uint8_t lcid = 0;
-        while (mch_mac_msg.get()->get_next_mch_sched_info(&lcid, &stop)) {
-          const std::lock_guard<std::mutex> lock(_sched_stop_mutex);
-          spdlog::debug("Scheduling stop for LCID {} in sf {}", lcid, stop);
-          _sched_stops[ lcid ] = stop;
-        }
-      } else if (mch_mac_msg.get()->is_sdu()) {
-        uint32_t lcid = mch_mac_msg.get()->get_sdu_lcid();
-        spdlog::trace("Processing MAC MCH PDU entered, lcid {}", lcid);
-
-        if (lcid >= SRSRAN_N_MCH_LCIDS) {
-          spdlog::warn("Radio bearer id must be in [0:%d] - %d", SRSRAN_N_MCH_LCIDS, lcid);
-          if (mbsfn_cfg.is_mcch) {
-            _rest._mcch.errors++;
-          } else {
-            _rest._mch[mch_idx].errors++;
-          }
-          _mutex.unlock();
-          return -1;
-        }
-
-        {
-          _phy._mcs = mbsfn_cfg.mbsfn_mcs;
-          const std::lock_guard<std::mutex> lock(_rlc_mutex);
-          _rlc.write_pdu_mch(mch_idx, lcid, mch_mac_msg.get()->get_sdu_ptr(), mch_mac_msg.get()->get_payload_size());
-        }
-      }
-    }
+    // MAC PDU parsing and delivery to RLC happen in TTI order on the reorder buffer's thread
+    _reorder.deposit(entry, mch_idx, mbsfn_cfg.is_mcch, mbsfn_cfg.mbsfn_mcs,
+        _payload_buffer, static_cast<uint32_t>(_pmch_cfg.pdsch_cfg.grant.tb[0].tbs) / 8);
   } else {
     if (mbsfn_cfg.is_mcch) {
       _rest._mcch.errors++;
@@ -205,42 +169,18 @@ auto MbsfnFrameProcessor::process(uint32_t tti) -> int {
     }
 
     spdlog::trace("PMCH in TTI {} failed with CRC error", tti);
-    _mutex.unlock();
+    _reorder.cancel(entry);
     return -1;
   }
 
-  if (!mbsfn_cfg.is_mcch) {
-    for (uint32_t i = 0; i < _phy.mcch().nof_pmch_info; i++) {
-      unsigned fn_in_scheduling_period =  sfn % srsran::enum_to_number(_phy.mcch().pmch_info_list[i].mch_sched_period);
-      unsigned sf_idx;
-      if (_cell.mbms_dedicated) {
-        sf_idx = fn_in_scheduling_period * 10 + sf - (fn_in_scheduling_period / 4) - 1;
-      } else {
-        sf_idx = fn_in_scheduling_period * 6 + (sf < 6 ? sf - 1 : sf - 3);
-      }
-          spdlog::debug("tti{}, sfn {}, sf {}, fn_in_scheduling_period {}, sf_idf {}", tti, sfn, sf, fn_in_scheduling_period, sf_idx);
-
-      const std::lock_guard<std::mutex> lock(_sched_stop_mutex);
-      for (auto itr = _sched_stops.cbegin() ; itr != _sched_stops.cend() ;) {
-        if ( sf_idx >= itr->second ) {
-          spdlog::debug("Stopping LCID {} in tti {} (idx in rf {})", itr->first, tti, sf_idx);
-          const std::lock_guard<std::mutex> lock(_rlc_mutex);
-          _rlc.stop_mch(i, itr->first);
-          itr = _sched_stops.erase(itr);
-        } else {
-          itr = std::next(itr);
-        }
-      }
-    }
-  } else {
-    const std::lock_guard<std::mutex> lock(_rlc_mutex);
-    _rlc.stop_mch(0, 0);
-    _rest._mcch.present = true;
-  }
-  _mutex.unlock();
   return mbsfn_cfg.is_mcch ? 0 : 1;
 }
 
+void MbsfnFrameProcessor::discard() {
+  _reorder.cancel(_reorder_entry);
+  _reorder_entry = nullptr;
+}
+
 void MbsfnFrameProcessor::configure_mbsfn(uint8_t area_id, srsran_scs_t subcarrier_spacing) {
   _sf_cfg.subcarrier_spacing = subcarrier_spacing;
   srsran_ue_dl_set_mbsfn_subcarrier_spacing(&_ue_dl, subcarrier_spacing);
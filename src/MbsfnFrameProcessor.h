@@ -25,16 +25,15 @@
 #include <vector>
 #include <map>
 #include "srsran/srsran.h"
-#include "srsran/rlc/rlc.h"
-#include "srsran/upper/pdcp.h"
-#include "srsran/mac/pdu.h"
 #include <libconfig.h++>
+#include "MchReorderBuffer.h"
 #include "Phy.h"
 #include "RestHandler.h"
 
 /**
  *  Frame processor for MBSFN subframes. Handles the complete processing chain for
- *  a CAS subframe: calls FFT and channel estimation, decodes PDSCH and passes received PDUs to RLC.
+ *  a CAS subframe: calls FFT and channel estimation, decodes PDSCH and passes received transport blocks
+ *  on to the MchReorderBuffer, which delivers them to RLC in order.
  */
 class MbsfnFrameProcessor {
   public:
@@ -42,17 +41,15 @@ class MbsfnFrameProcessor {
      *  Default constructor.
      *
      *  @param cfg Config singleton reference
+     *  @param reorder Reorder buffer for the decoded transport blocks
      *  @param phy PHY reference
-     *  @param rlc RLC reference
-     *  @param log_h srsLTE log handle for the MCH MAC msg decoder
      *  @param rest RESTful API handler reference
      */
-    MbsfnFrameProcessor(const libconfig::Config& cfg, srsran::rlc& rlc, Phy& phy, srslog::basic_logger& log_h, RestHandler& rest, unsigned rx_channels )
+    MbsfnFrameProcessor(const libconfig::Config& cfg, MchReorderBuffer& reorder, Phy& phy, RestHandler& rest, unsigned rx_channels )
       : _cfg(cfg)
-      , _rlc(rlc)
+      , _reorder(reorder)
       , _phy(phy)
       , _rest(rest)
-      , mch_mac_msg(20, log_h)
       , _rx_channels(rx_channels)
       {}
 
@@ -75,6 +72,16 @@ class MbsfnFrameProcessor {
      */
     int process(uint32_t tti);
 
+    /**
+     *  Set the reorder entry the transport block of the next subframe goes to
+     */
+    void set_reorder_entry(MchReorderBuffer::Entry* entry) { _reorder_entry = entry; }
+
+    /**
+     *  Drop the subframe in the signal buffer without processing it
+     */
+    void discard();
+
     /**
      *  Set the parameters for the cell (Nof PRB, etc).
      * 
@@ -83,14 +90,11 @@ class MbsfnFrameProcessor {
     void set_cell(srsran_cell_t cell);
 
     /**
-     *  Get a handle of the signal buffer to store samples for processing in, 
-     *  and lock this processor.
+     *  Get a handle of the signal buffer to store samples for processing in.
      *
-     *  The processor unlocks itself after (failed or successful) frame processing in process().
-     *  If process() is not called by the application after calling this method, it must unlock the 
-     *  processor itself by calling unlock()
+     *  Only to be called by the owner of the processor's slot in the ProcessorPool.
      */
-    cf_t** get_rx_buffer_and_lock() { _mutex.lock(); return _signal_buffer_rx; }
+    cf_t** get_rx_buffer() { return _signal_buffer_rx; }
 
     /**
      *  Size of the signal buffer
@@ -107,20 +111,6 @@ class MbsfnFrameProcessor {
      */
     bool mbsfn_configured() { return _mbsfn_configured; }
 
-    /**
-     *  Unlock the processor
-     *
-     *  @see get_rx_buffer_and_lock() 
-     */
-    void unlock() { _mutex.unlock(); }
-
-    /**
-     *  Lock the processor
-     *
-     *  Used when getting the BLER values.
-     */
-    void lock() { _mutex.lock(); }
-
     /**
      *  Get the constellation diagram data (I/Q data of the subcarriers after CE)
      */
@@ -133,7 +123,8 @@ class MbsfnFrameProcessor {
 
   private:
     const libconfig::Config& _cfg;
-    srsran::rlc& _rlc;
+    MchReorderBuffer& _reorder;
+    MchReorderBuffer::Entry* _reorder_entry = nullptr;
     Phy& _phy;
 
     srsran_cell_t _cell;
@@ -153,16 +144,9 @@ class MbsfnFrameProcessor {
     uint8_t _area_id = 1;
     bool _mbsfn_configured = false;
 
-    srsran::mch_pdu mch_mac_msg;
-    std::mutex _mutex;
-
     RestHandler& _rest;
 
     unsigned _rx_channels;
 
-    static std::mutex _sched_stop_mutex;
-    static std::map<uint8_t, uint16_t> _sched_stops;
-
-    static std::mutex _rlc_mutex;
     static int _current_mcs;
 };
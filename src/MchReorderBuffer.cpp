@@ -0,0 +1,271 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "MchReorderBuffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include "spdlog/spdlog.h"
+
+MchReorderBuffer::MchReorderBuffer(const libconfig::Config& cfg, srsran::rlc& rlc, Phy& phy,
+    srslog::basic_logger& log_h, RestHandler& rest)
+  : _cfg(cfg)
+  , _rlc(rlc)
+  , _phy(phy)
+  , _rest(rest)
+  , _hold(10)
+  , _mch_mac_msg(20, log_h)
+{
+  unsigned hold_ms = _hold.count();
+  _cfg.lookupValue("modem.phy.mch_reorder_hold_ms", hold_ms);
+  _hold = std::chrono::milliseconds(hold_ms);
+  _cfg.lookupValue("modem.phy.mch_deliver_late", _deliver_late);
+
+  // The decode workers copy into these, so depositing a transport block never allocates
+  for (auto& queue : _queues) {
+    for (auto& entry : queue.entries) {
+      entry.payload.resize(kMaxPayload);
+    }
+  }
+}
+
+MchReorderBuffer::~MchReorderBuffer() {
+  {
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _quit.store(true, std::memory_order_release);
+  }
+  _cv.notify_all();
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+}
+
+void MchReorderBuffer::launch(ThreadPlacement* placement) {
+  _thread = std::thread{&MchReorderBuffer::run, this};
+
+  // Same priority as the PHY workers that feed it
+  struct sched_param thread_param = {};
+  thread_param.sched_priority = 10;
+  _cfg.lookupValue("modem.phy.thread_priority_rt", thread_param.sched_priority);
+  spdlog::info("Launching MCH delivery thread with realtime scheduling priority {}, hold time {} ms, {}",
+      thread_param.sched_priority, _hold.count(), _deliver_late ? "late blocks delivered" : "late blocks dropped");
+  int error = pthread_setschedparam(_thread.native_handle(), SCHED_RR, &thread_param);
+  if (error != 0) {
+    spdlog::error("Cannot set MCH delivery thread priority to realtime: {}. Thread will run at default priority.", strerror(error));
+  }
+  if (placement != nullptr) {
+    placement->place(ThreadPlacement::ThreadClass::Phy, _thread.native_handle(), "mch-delivery");
+  }
+}
+
+auto MchReorderBuffer::reserve(unsigned mch_idx, uint32_t tti) -> Entry* {
+  if (mch_idx >= kMaxMchs) {
+    _overflows++;
+    return nullptr;
+  }
+  auto& queue = _queues[mch_idx];
+  auto tail = queue.tail.load(std::memory_order_relaxed);
+  if (tail - queue.head.load(std::memory_order_acquire) == kDepth) {
+    _overflows++;
+    return nullptr;
+  }
+
+  // The delivery thread is done with the entry once head has moved past it
+  auto& entry = queue.entries[tail % kDepth];
+  entry.tti = tti;
+  entry.reserved_at = std::chrono::steady_clock::now();
+  entry.skipped = false;
+  entry.done = false;
+  entry.state.store(EntryState::Reserved, std::memory_order_relaxed);
+  queue.tail.store(tail + 1, std::memory_order_release);
+  return &entry;
+}
+
+void MchReorderBuffer::deposit(Entry* entry, unsigned mch_idx, bool is_mcch, unsigned mcs, const uint8_t* payload, uint32_t size) {
+  if (entry == nullptr) {
+    return;
+  }
+  entry->mch_idx = mch_idx;
+  entry->is_mcch = is_mcch;
+  entry->mcs = mcs;
+  entry->size = std::min(size, kMaxPayload);
+  memcpy(entry->payload.data(), payload, entry->size);
+  entry->state.store(EntryState::Ready, std::memory_order_release);
+  notify();
+}
+
+void MchReorderBuffer::cancel(Entry* entry) {
+  if (entry == nullptr) {
+    return;
+  }
+  entry->state.store(EntryState::Cancelled, std::memory_order_release);
+  notify();
+}
+
+void MchReorderBuffer::notify() {
+  // Only wake the delivery thread if it has announced that it is going to sleep. It checks _seq again
+  // after that, so with both sides sequentially consistent, one of them sees the other's update.
+  _seq.fetch_add(1, std::memory_order_seq_cst);
+  if (_sleeping.load(std::memory_order_seq_cst)) {
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _cv.notify_one();
+  }
+}
+
+void MchReorderBuffer::run() {
+  while (!_quit.load(std::memory_order_acquire)) {
+    auto seen = _seq.load(std::memory_order_seq_cst);
+
+    auto now = std::chrono::steady_clock::now();
+    auto next_expiry = std::chrono::steady_clock::time_point::max();
+    for (auto& queue : _queues) {
+      service(queue, now, next_expiry);
+    }
+
+    // Entries deposited while servicing have bumped the sequence number, so there is no wait for them
+    std::unique_lock<std::mutex> lock(_mutex);
+    _sleeping.store(true, std::memory_order_seq_cst);
+    auto woken = [this, seen] {
+      return _quit.load(std::memory_order_relaxed) || _seq.load(std::memory_order_seq_cst) != seen;
+    };
+    if (next_expiry == std::chrono::steady_clock::time_point::max()) {
+      _cv.wait(lock, woken);
+    } else {
+      _cv.wait_until(lock, next_expiry, woken);
+    }
+    _sleeping.store(false, std::memory_order_relaxed);
+  }
+}
+
+void MchReorderBuffer::service(Queue& queue, std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point& next_expiry) {
+  auto tail = queue.tail.load(std::memory_order_acquire);
+  auto head = queue.head.load(std::memory_order_relaxed);
+
+  // Deliver in order, as far as the entries are complete or have waited for longer than the hold time
+  while (queue.next != tail) {
+    auto& entry = queue.entries[queue.next % kDepth];
+    auto state = entry.state.load(std::memory_order_acquire);
+    if (state == EntryState::Reserved) {
+      if (now - entry.reserved_at < _hold) {
+        next_expiry = std::min(next_expiry, entry.reserved_at + _hold);
+        break;
+      }
+      spdlog::debug("MCH TTI {} not decoded within {} ms, skipping it", entry.tti, _hold.count());
+      entry.skipped = true;
+      _skipped++;
+    } else {
+      if (state == EntryState::Ready) {
+        deliver(entry);
+        _delivered++;
+      }
+      entry.done = true;
+    }
+    queue.next++;
+  }
+
+  // Skipped entries are freed once their processor is done with them. RLC has already seen the blocks
+  // after them, so they are only delivered if that has been asked for.
+  for (auto idx = head; idx != queue.next; idx++) {
+    auto& entry = queue.entries[idx % kDepth];
+    if (entry.done) {
+      continue;
+    }
+    auto state = entry.state.load(std::memory_order_acquire);
+    if (state == EntryState::Ready) {
+      if (_deliver_late) {
+        deliver(entry);
+      }
+      _late++;
+    }
+    entry.done = state != EntryState::Reserved;
+  }
+
+  // Hand the entries that are done back to the main loop
+  while (head != queue.next && queue.entries[head % kDepth].done) {
+    queue.entries[head % kDepth].state.store(EntryState::Free, std::memory_order_relaxed);
+    head++;
+  }
+  queue.head.store(head, std::memory_order_release);
+}
+
+void MchReorderBuffer::deliver(Entry& entry) {
+  _mch_mac_msg.init_rx(entry.size);
+  _mch_mac_msg.parse_packet(entry.payload.data());
+
+  while (_mch_mac_msg.next()) {
+    if (srsran::mch_lcid::MCH_SCHED_INFO == _mch_mac_msg.get()->mch_ce_type()) {
+      uint16_t stop = 0;
+      uint8_t lcid = 0;
+      while (_mch_mac_msg.get()->get_next_mch_sched_info(&lcid, &stop)) {
+        spdlog::debug("Scheduling stop for LCID {} in sf {}", lcid, stop);
+        _sched_stops[ lcid ] = stop;
+      }
+    } else if (_mch_mac_msg.get()->is_sdu()) {
+      uint32_t lcid = _mch_mac_msg.get()->get_sdu_lcid();
+      spdlog::trace("Processing MAC MCH PDU entered, lcid {}", lcid);
+
+      if (lcid >= SRSRAN_N_MCH_LCIDS) {
+        spdlog::warn("Radio bearer id must be in [0:{}] - {}", SRSRAN_N_MCH_LCIDS, lcid);
+        if (entry.is_mcch) {
+          _rest._mcch.errors++;
+        } else {
+          _rest._mch[entry.mch_idx].errors++;
+        }
+        return;
+      }
+
+      _phy._mcs = entry.mcs;
+      _rlc.write_pdu_mch(entry.mch_idx, lcid, _mch_mac_msg.get()->get_sdu_ptr(), _mch_mac_msg.get()->get_payload_size());
+    }
+  }
+
+  if (!entry.is_mcch) {
+    stop_scheduled(entry.tti);
+  } else {
+    _rlc.stop_mch(0, 0);
+    _rest._mcch.present = true;
+  }
+}
+
+void MchReorderBuffer::stop_scheduled(uint32_t tti) {
+  uint32_t sfn = tti / 10;
+  uint8_t sf = tti % 10;
+  for (uint32_t i = 0; i < _phy.mcch().nof_pmch_info; i++) {
+    unsigned fn_in_scheduling_period =  sfn % srsran::enum_to_number(_phy.mcch().pmch_info_list[i].mch_sched_period);
+    unsigned sf_idx;
+    if (_phy.cell().mbms_dedicated) {
+      sf_idx = fn_in_scheduling_period * 10 + sf - (fn_in_scheduling_period / 4) - 1;
+    } else {
+      sf_idx = fn_in_scheduling_period * 6 + (sf < 6 ? sf - 1 : sf - 3);
+    }
+    spdlog::debug("tti{}, sfn {}, sf {}, fn_in_scheduling_period {}, sf_idf {}", tti, sfn, sf, fn_in_scheduling_period, sf_idx);
+
+    for (auto itr = _sched_stops.cbegin() ; itr != _sched_stops.cend() ;) {
+      if ( sf_idx >= itr->second ) {
+        spdlog::debug("Stopping LCID {} in tti {} (idx in rf {})", itr->first, tti, sf_idx);
+        _rlc.stop_mch(i, itr->first);
+        itr = _sched_stops.erase(itr);
+      } else {
+        itr = std::next(itr);
+      }
+    }
+  }
+}
@@ -0,0 +1,184 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <libconfig.h++>
+#include "srsran/srsran.h"
+#include "srsran/rlc/rlc.h"
+#include "srsran/mac/pdu.h"
+#include "Phy.h"
+#include "RestHandler.h"
+#include "ThreadPlacement.h"
+
+/**
+ *  Delivers the decoded MCH transport blocks to RLC in TTI order.
+ *
+ *  The frame processors finish their subframes out of order. Instead of writing to RLC themselves,
+ *  they deposit the transport block in an entry that the main loop has reserved for the subframe's
+ *  MCH and TTI when dispatching it. Reservations are made in TTI order, one ring per MCH, so every
+ *  entry is only written by the processor it was handed to: depositing takes no lock.
+ *
+ *  A single delivery thread goes through the rings in order. It parses the MAC PDUs, handles the MCH
+ *  scheduling information and passes the SDUs to RLC, so RLC and the scheduling stops are only ever
+ *  touched from this thread. If the next entry of an MCH is still being decoded after the hold time
+ *  (modem.phy.mch_reorder_hold_ms), it is skipped. A skipped entry that is decoded after all is
+ *  dropped, unless modem.phy.mch_deliver_late is set: then it is delivered out of order.
+ *
+ *  The delivery thread sleeps until an entry is deposited or cancelled, or until the hold time of
+ *  the oldest outstanding entry expires. The processors only take its mutex to wake it up when it
+ *  has announced that it is sleeping.
+ */
+class MchReorderBuffer {
+ public:
+    static const unsigned kMaxMchs = 16;
+    static const unsigned kDepth = 64;  // entries per MCH
+    static const uint32_t kMaxPayload = SRSRAN_MAX_BUFFER_SIZE_BYTES;
+
+    enum class EntryState : unsigned { Free, Reserved, Ready, Cancelled };
+
+    /**
+     *  Reorder slot for one subframe
+     */
+    struct Entry {
+      std::atomic<EntryState> state = { EntryState::Free };
+      uint32_t tti = 0;
+      std::chrono::steady_clock::time_point reserved_at;
+
+      // Set by deposit()
+      unsigned mch_idx = 0;
+      bool is_mcch = false;
+      unsigned mcs = 0;
+      std::vector<uint8_t> payload;  // kMaxPayload bytes, allocated up front
+      uint32_t size = 0;
+
+      // Only used by the delivery thread
+      bool skipped = false;
+      bool done = false;
+    };
+
+    /**
+     *  Default constructor.
+     *
+     *  @param cfg Config singleton reference
+     *  @param rlc RLC reference
+     *  @param phy PHY reference
+     *  @param log_h srsLTE log handle for the MCH MAC msg decoder
+     *  @param rest RESTful API handler reference
+     */
+    MchReorderBuffer(const libconfig::Config& cfg, srsran::rlc& rlc, Phy& phy, srslog::basic_logger& log_h, RestHandler& rest);
+
+    /**
+     *  Default destructor. Stops the delivery thread.
+     */
+    virtual ~MchReorderBuffer();
+
+    /**
+     *  Launch the delivery thread
+     */
+    void launch(ThreadPlacement* placement);
+
+    /**
+     *  Reserve the entry for a subframe. Only called from the main loop, in TTI order.
+     *
+     *  @return The entry, or nullptr if the MCH's ring is full. The subframe's data is then lost.
+     */
+    Entry* reserve(unsigned mch_idx, uint32_t tti);
+
+    /**
+     *  Hand a decoded transport block over for delivery. Called by the frame processor the entry was given to.
+     */
+    void deposit(Entry* entry, unsigned mch_idx, bool is_mcch, unsigned mcs, const uint8_t* payload, uint32_t size);
+
+    /**
+     *  Nothing to deliver for the entry's subframe, e.g. because of a CRC error
+     */
+    void cancel(Entry* entry);
+
+    /**
+     *  Number of transport blocks delivered in order
+     */
+    uint64_t delivered() const { return _delivered; }
+
+    /**
+     *  Number of transport blocks that were not ready within the hold time
+     */
+    uint64_t skipped() const { return _skipped; }
+
+    /**
+     *  Number of skipped transport blocks that were decoded after all. They are delivered out of
+     *  order if modem.phy.mch_deliver_late is set, and dropped otherwise.
+     */
+    uint64_t late() const { return _late; }
+
+    /**
+     *  Number of subframes that found their MCH's ring full
+     */
+    uint64_t overflows() const { return _overflows; }
+
+ private:
+    struct Queue {
+      std::array<Entry, kDepth> entries;
+      std::atomic<uint32_t> tail = { 0 };  // next entry to reserve, written by the main loop
+      std::atomic<uint32_t> head = { 0 };  // oldest entry not yet freed, written by the delivery thread
+      uint32_t next = 0;  // next entry to deliver in order
+    };
+
+    void run();
+    void service(Queue& queue, std::chrono::steady_clock::time_point now,
+        std::chrono::steady_clock::time_point& next_expiry);
+    void notify();
+    void deliver(Entry& entry);
+    void stop_scheduled(uint32_t tti);
+
+    const libconfig::Config& _cfg;
+    srsran::rlc& _rlc;
+    Phy& _phy;
+    RestHandler& _rest;
+
+    std::chrono::milliseconds _hold;
+    bool _deliver_late = false;
+
+    std::array<Queue, kMaxMchs> _queues;
+
+    srsran::mch_pdu _mch_mac_msg;
+    std::map<uint8_t, uint16_t> _sched_stops;
+
+    std::atomic<bool> _quit = { false };  // set under _mutex
+    std::atomic<uint64_t> _seq = { 0 };  // bumped for every deposited or cancelled entry
+    std::atomic<bool> _sleeping = { false };  // the delivery thread is about to wait on _cv
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _thread;
+
+    std::atomic<uint64_t> _delivered = { 0 };
+    std::atomic<uint64_t> _skipped = { 0 };
+    std::atomic<uint64_t> _late = { 0 };
+    std::atomic<uint64_t> _overflows = { 0 };
+};
@@ -19,60 +19,136 @@
 
 #include "MultichannelRingbuffer.h"
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <memory>
 #include "spdlog/spdlog.h"
 
-MultichannelRingbuffer::MultichannelRingbuffer(size_t size, size_t channels)
+MultichannelRingbuffer::MultichannelRingbuffer(size_t size, size_t channels, bool mirrored)
   : _size( size )
   , _channels( channels )
-  , _used( 0 )
-  , _head( 0 )
+  , _mirrored( mirrored )
 {
-  for (auto ch = 0; ch < _channels; ch++) {
-    auto buf = (char*)srsran_vec_malloc( _size);
-    //auto buf = (char*)malloc(_size);
-    if (buf == nullptr) {
-      throw "Could not allocate memory";
+  if (_mirrored && !map_mirrored()) {
+    spdlog::warn("Could not create mirrored ringbuffer mapping, falling back to regular buffers");
+    for (auto buffer : _buffers) {
+      munmap(buffer, 2 * _size);
+    }
+    _buffers.clear();
+    _mirrored = false;
+  }
+
+  if (!_mirrored) {
+    for (auto ch = 0; ch < _channels; ch++) {
+      auto buf = (char*)srsran_vec_malloc( _size);
+      if (buf == nullptr) {
+        throw "Could not allocate memory";
+      }
+      _buffers.push_back(buf);
     }
-    _buffers.push_back(buf);
   }
-  spdlog::debug("Created {}-channel ringbuffer with size {}", _channels, _size );
+  spdlog::debug("Created {}-channel {}ringbuffer with size {}", _channels, _mirrored ? "mirrored " : "", _size );
 }
 
 MultichannelRingbuffer::~MultichannelRingbuffer()
 {
   for (auto buffer : _buffers) {
-    if (buffer) free(buffer);
+    if (!buffer) continue;
+    if (_mirrored) {
+      munmap(buffer, 2 * _size);
+    } else {
+      free(buffer);
+    }
   }
 }
 
+auto MultichannelRingbuffer::map_mirrored() -> bool
+{
+  // Both mappings must start on a page boundary, so the buffer size has to be a multiple of the page size
+  auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  _size = ((_size + page_size - 1) / page_size) * page_size;
+
+  for (auto ch = 0; ch < _channels; ch++) {
+    int fd = memfd_create("modem_ringbuffer", MFD_CLOEXEC);
+    if (fd < 0) {
+      spdlog::error("memfd_create failed: {}", strerror(errno));
+      return false;
+    }
+    if (ftruncate(fd, _size) != 0) {
+      spdlog::error("ftruncate on ringbuffer memfd failed: {}", strerror(errno));
+      close(fd);
+      return false;
+    }
+
+    // Reserve an address range of twice the buffer size, then map the memfd into both halves.
+    auto base = (char*)mmap(nullptr, 2 * _size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      spdlog::error("Could not reserve address space for ringbuffer: {}", strerror(errno));
+      close(fd);
+      return false;
+    }
+    if (mmap(base, _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + _size, _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      spdlog::error("Could not map ringbuffer memfd: {}", strerror(errno));
+      munmap(base, 2 * _size);
+      close(fd);
+      return false;
+    }
+    // The mappings keep the memory alive
+    close(fd);
+    _buffers.push_back(base);
+  }
+  return true;
+}
+
+auto MultichannelRingbuffer::used_size() -> size_t
+{
+  // Load the read position first. When called from a thread that is neither producer nor consumer
+  // (e.g. the REST API), both positions may move in between, so clamp the result to the valid range.
+  auto read_pos = tail_pos();
+  auto write_pos = _write_pos.load(std::memory_order_acquire);
+  if (write_pos < read_pos) {
+    return 0;
+  }
+  return std::min(write_pos - read_pos, _size);
+}
+
+auto MultichannelRingbuffer::readable_size() -> size_t
+{
+  return _write_pos.load(std::memory_order_acquire) - _read_pos.load(std::memory_order_relaxed);
+}
+
+auto MultichannelRingbuffer::clear() -> size_t
+{
+  auto write_pos = _write_pos.load(std::memory_order_acquire);
+  auto discarded = write_pos - _read_pos.load(std::memory_order_relaxed);
+  _read_pos.store(write_pos, std::memory_order_release);
+  return discarded;
+}
+
 auto MultichannelRingbuffer::read_head() -> std::vector<void*>
 {
-//  _mutex.lock();
-  std::lock_guard<std::mutex> lock(_mutex);
   std::vector<void*> buffers(_channels, nullptr);
   for (auto ch = 0; ch < _channels; ch++) {
     buffers[ch] = (void*)(_buffers[ch]); // Return the beggining of the buffer;
   }
-  _head = 0;
-  _used = 0;
+  _read_pos.store(0, std::memory_order_relaxed);
+  _write_pos.store(0, std::memory_order_release);
   return buffers;
 }
 
 auto MultichannelRingbuffer::write_head(size_t* writeable) -> std::vector<void*>
 {
-//  _mutex.lock();
-  std::lock_guard<std::mutex> lock(_mutex);
   std::vector<void*> buffers(_channels, nullptr);
-  if (_size == _used) { // In this case we return a nullptr. Because read_head and read functions we should never see a situation where we try to read this returned nullptr. Usually never reach exactly te end of the buffer. 
+  auto write_pos = _write_pos.load(std::memory_order_relaxed);
+  auto used = write_pos - tail_pos();
+  if (_size == used) { // In this case we return a nullptr. Because read_head and read functions we should never see a situation where we try to read this returned nullptr. Usually never reach exactly te end of the buffer. 
     *writeable = 0;
   } else {
-    auto tail = (_head + _used) % _size;
-    if (tail < _head) {
-      *writeable = _head - tail;
-    } else {
-      *writeable = _size - tail;
-    }
+    auto tail = write_pos % _size;
+    // The mirror mapping makes the complete free space contiguous
+    *writeable = _mirrored ? _size - used : std::min(_size - used, _size - tail);
     for (auto ch = 0; ch < _channels; ch++) {
       buffers[ch] = (void*)(_buffers[ch] + tail);
     }
@@ -83,34 +159,181 @@ auto MultichannelRingbuffer::write_head(size_t* writeable) -> std::vector<void*>
 
 auto MultichannelRingbuffer::commit(size_t written) -> void
 {
-  assert(written >= 0);
-  assert(written <= free_size());
-  std::lock_guard<std::mutex> lock(_mutex);
-  _used += written;
-//  _mutex.unlock();
+  auto write_pos = _write_pos.load(std::memory_order_relaxed) + written;
+  assert(written <= _size - (write_pos - written - tail_pos()));
+  if (written > _max_commit.load(std::memory_order_relaxed)) {
+    _max_commit.store(written, std::memory_order_relaxed);
+  }
+
+  // Sequentially consistent, so that either we see the consumer's wait target here, or the consumer
+  // sees the new write position before it goes to sleep.
+  _write_pos.store(write_pos);
+  auto target = _wait_target.load();
+  if (target != 0 && write_pos >= target) {
+    std::lock_guard<std::mutex> lock(_wait_mutex);
+    _wait_cv.notify_one();
+  }
+
+  if (_nof_readers.load(std::memory_order_relaxed) > 0) {
+    bool wake = false;
+    for (auto& reader : _readers) {
+      auto reader_target = reader.wait_target.load();
+      wake |= reader_target != 0 && write_pos >= reader_target;
+    }
+    if (wake) {
+      std::lock_guard<std::mutex> lock(_wait_mutex);
+      _reader_cv.notify_all();
+    }
+  }
+}
+
+auto MultichannelRingbuffer::wait_readable(size_t size, std::chrono::microseconds timeout) -> bool
+{
+  if (readable_size() >= size) {
+    return true;
+  }
+
+  std::unique_lock<std::mutex> lock(_wait_mutex);
+  auto read_pos = _read_pos.load(std::memory_order_relaxed);
+  _wait_target.store(read_pos + size);
+  auto available = _wait_cv.wait_for(lock, timeout, [&]() {
+    return _write_pos.load() - read_pos >= size;
+  });
+  _wait_target.store(0, std::memory_order_relaxed);
+  return available;
 }
 
 auto MultichannelRingbuffer::read(std::vector<char*> dest, size_t size) -> void
 {
   assert(dest.size() >= _channels);
-  assert(size <= used_size());
-  assert(size >= 0);
+  assert(size <= readable_size());
 
-  std::lock_guard<std::mutex> lock(_mutex);
-  auto end = (_head + size) % _size;
+  auto read_pos = _read_pos.load(std::memory_order_relaxed);
+  auto head = read_pos % _size;
+  auto end = (head + size) % _size;
 
-  if (end <= _head) {
-    auto first_part = _size - _head;
+  if (!_mirrored && end <= head && size > 0) {
+    auto first_part = _size - head;
     auto second_part = size - first_part;
     for (auto ch = 0; ch < _channels; ch++) {
-      memcpy(dest[ch],              _buffers[ch] + _head, first_part);
-      memcpy(dest[ch] + first_part, _buffers[ch],         second_part);
+      memcpy(dest[ch],              _buffers[ch] + head, first_part);
+      memcpy(dest[ch] + first_part, _buffers[ch],        second_part);
     }
   } else {
     for (auto ch = 0; ch < _channels; ch++) {
-      memcpy(dest[ch], _buffers[ch] + _head, size);
+      memcpy(dest[ch], _buffers[ch] + head, size);
+    }
+  }
+  _read_pos.store(read_pos + size, std::memory_order_release);
+}
+
+auto MultichannelRingbuffer::tail_pos() -> size_t
+{
+  auto tail = _read_pos.load(std::memory_order_acquire);
+  if (_blocking_readers.load(std::memory_order_acquire)) {
+    for (auto& reader : _readers) {
+      if (reader.active.load(std::memory_order_acquire) && reader.policy == OverflowPolicy::Block) {
+        tail = std::min(tail, reader.pos.load(std::memory_order_acquire));
+      }
+    }
+  }
+  return tail;
+}
+
+auto MultichannelRingbuffer::add_reader(OverflowPolicy policy) -> int
+{
+  std::lock_guard<std::mutex> lock(_wait_mutex);
+  for (int id = 0; id < kMaxReaders; id++) {
+    auto& reader = _readers[id];
+    if (reader.active.load(std::memory_order_relaxed)) {
+      continue;
+    }
+    reader.policy = policy;
+    reader.pos.store(_write_pos.load(std::memory_order_acquire), std::memory_order_relaxed);
+    reader.wait_target.store(0, std::memory_order_relaxed);
+    reader.dropped.store(0, std::memory_order_relaxed);
+    reader.active.store(true, std::memory_order_release);
+    _nof_readers++;
+    if (policy == OverflowPolicy::Block) {
+      _blocking_readers.store(true, std::memory_order_release);
+    }
+    return id;
+  }
+  return -1;
+}
+
+auto MultichannelRingbuffer::remove_reader(int reader) -> void
+{
+  std::lock_guard<std::mutex> lock(_wait_mutex);
+  _readers[reader].active.store(false, std::memory_order_release);
+  _nof_readers--;
+
+  bool blocking = false;
+  for (auto& r : _readers) {
+    blocking |= r.active.load(std::memory_order_relaxed) && r.policy == OverflowPolicy::Block;
+  }
+  _blocking_readers.store(blocking, std::memory_order_release);
+}
+
+auto MultichannelRingbuffer::reader_readable(int reader) -> size_t
+{
+  auto& r = _readers[reader];
+  auto write_pos = _write_pos.load(std::memory_order_acquire);
+  auto pos = r.pos.load(std::memory_order_relaxed);
+  if (r.policy == OverflowPolicy::Drop && write_pos - pos > _size - std::min(_max_commit.load(std::memory_order_relaxed), _size)) {
+    // Fallen behind, the oldest data may be overwritten at any time. Continue with the most recent data.
+    r.dropped += write_pos - pos;
+    r.pos.store(write_pos, std::memory_order_release);
+    return 0;
+  }
+  return write_pos - pos;
+}
+
+auto MultichannelRingbuffer::reader_head(int reader, size_t* readable) -> std::vector<const char*>
+{
+  *readable = reader_readable(reader);
+  auto head = _readers[reader].pos.load(std::memory_order_relaxed) % _size;
+  if (!_mirrored) {
+    *readable = std::min(*readable, _size - head);
+  }
+
+  std::vector<const char*> buffers(_channels, nullptr);
+  for (auto ch = 0; ch < _channels; ch++) {
+    buffers[ch] = _buffers[ch] + head;
+  }
+  return buffers;
+}
+
+auto MultichannelRingbuffer::reader_wait(int reader, size_t size, std::chrono::microseconds timeout) -> bool
+{
+  if (reader_readable(reader) >= size) {
+    return true;
+  }
+
+  auto& r = _readers[reader];
+  std::unique_lock<std::mutex> lock(_wait_mutex);
+  r.wait_target.store(r.pos.load(std::memory_order_relaxed) + size);
+  auto available = _reader_cv.wait_for(lock, timeout, [&]() {
+    return _write_pos.load() - r.pos.load(std::memory_order_relaxed) >= size;
+  });
+  r.wait_target.store(0, std::memory_order_relaxed);
+  return available;
+}
+
+auto MultichannelRingbuffer::reader_consume(int reader, size_t size) -> bool
+{
+  auto& r = _readers[reader];
+  auto pos = r.pos.load(std::memory_order_relaxed);
+  bool intact = true;
+  if (r.policy == OverflowPolicy::Drop) {
+    // Order the reader's accesses to the data before checking how far the producer has come meanwhile
+    std::atomic_thread_fence(std::memory_order_acquire);
+    auto write_pos = _write_pos.load(std::memory_order_acquire);
+    intact = write_pos + _max_commit.load(std::memory_order_relaxed) <= pos + _size;
+    if (!intact) {
+      r.dropped += size;
     }
   }
-  _head = (_head + size) % _size;
-  _used -= size;
+  r.pos.store(pos + size, std::memory_order_release);
+  return intact;
 }
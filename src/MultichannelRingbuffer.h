@@ -19,34 +19,189 @@
 
 #pragma once
 #include <stddef.h>
+#include <array>
 #include <vector>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 
 #include "srsran/srsran.h"
 #include "srsran/phy/common/phy_common.h"
 
+/**
+ *  Lock-free single-producer / single-consumer ringbuffer holding one buffer per RX channel.
+ *
+ *  The producer (SDR reader thread) only ever calls write_head() and commit(), the consumer
+ *  only ever calls read(). Both sides advance their own monotonically increasing byte position,
+ *  and publish it with release semantics. The positions live on separate cache lines, so neither 
+ *  side has to wait for (or bounce the cache line of) the other one.
+ *
+ *  In mirrored mode, each channel buffer is mapped twice back-to-back into the address space.
+ *  Every span of up to capacity() bytes is then contiguous in memory, so write_head() always
+ *  returns the complete free space and read() never has to split a copy at the wrap point.
+ *
+ *  The consumer can block in wait_readable() until enough data has been committed. The producer
+ *  only touches the wakeup mutex if the consumer is actually waiting, and the amount it waits 
+ *  for has been reached.
+ *
+ *  Besides the consumer, up to kMaxReaders additional readers (e.g. the sample file writer) can
+ *  follow the stream with their own read position, accessing the same memory in place. Each reader
+ *  has an overflow policy: a Block reader holds back the producer just like the consumer, a Drop
+ *  reader never does. If a Drop reader falls behind, it loses data and continues with the most
+ *  recent samples. Since the producer may overwrite data a Drop reader is looking at, such a reader
+ *  has to take what it needs from the buffer first, and only use it if reader_consume() confirms
+ *  that it has not been overwritten meanwhile.
+ */
 class MultichannelRingbuffer {
  public:
-    explicit MultichannelRingbuffer(size_t size, size_t channels);
+    enum class OverflowPolicy {
+      Block,  // the producer waits for this reader
+      Drop,   // the reader loses data if it falls behind
+    };
+
+    /**
+     *  Create a ringbuffer
+     *
+     *  @param size Size of each channel buffer in bytes. In mirrored mode, this is rounded up to the page size.
+     *  @param channels Number of channels
+     *  @param mirrored Map the channel buffers twice back-to-back. Falls back to regular buffers if mapping fails.
+     */
+    explicit MultichannelRingbuffer(size_t size, size_t channels, bool mirrored = false);
     virtual ~MultichannelRingbuffer();
 
-    inline size_t free_size() { std::lock_guard<std::mutex> lock(_mutex);  return _size - _used; }
-    inline size_t used_size() { std::lock_guard<std::mutex> lock(_mutex); return _used; }
-    inline size_t capacity() { std::lock_guard<std::mutex> lock(_mutex);return _size; }
+    inline size_t free_size() { return _size - used_size(); }
+    size_t used_size();
+    inline size_t capacity() { return _size; }
+    inline bool mirrored() { return _mirrored; }
+
+    /**
+     *  Number of bytes that can still be read. Consumer side operation.
+     */
+    size_t readable_size();
+
+    /**
+     *  Block until at least bytes can be read. Consumer side operation.
+     *
+     *  @param bytes Required number of readable bytes
+     *  @param timeout Maximum time to wait
+     *  @return true if the data is available, false on timeout
+     */
+    bool wait_readable(size_t bytes, std::chrono::microseconds timeout);
 
-    inline void clear() {std::lock_guard<std::mutex> lock(_mutex); _head = _used = 0; };
+    /**
+     *  Discard all unread data. Consumer side operation.
+     *
+     *  @return Number of unread bytes that have been discarded
+     */
+    size_t clear();
 
+    /**
+     *  Return the start of the buffers and reset the buffer to empty.
+     *
+     *  This moves both the read and the write position, and must only be used if producer
+     *  and consumer are the same thread.
+     */
     std::vector<void*> read_head();
     std::vector<void*> write_head(size_t* writeable);
     void commit(size_t written);
 
     void read(std::vector<char*> dest, size_t bytes);
 
+    /**
+     *  Add a reader that starts at the current write position. Can be called from any thread.
+     *
+     *  @return Reader id, or -1 if kMaxReaders readers are attached already
+     */
+    int add_reader(OverflowPolicy policy);
+
+    /**
+     *  Detach a reader. It must not be waiting or accessing the buffer anymore.
+     */
+    void remove_reader(int reader);
+
+    /**
+     *  Return the data at the reader's position in place. Reader side operation.
+     *
+     *  @param reader Reader id
+     *  @param readable Receives the number of bytes that can be accessed contiguously
+     *  @return Pointer to the data for each channel
+     */
+    std::vector<const char*> reader_head(int reader, size_t* readable);
+
+    /**
+     *  Number of bytes the reader has not read yet. Reader side operation.
+     */
+    size_t reader_readable(int reader);
+
+    /**
+     *  Block until at least bytes can be read by the reader. Reader side operation.
+     *
+     *  @return true if the data is available, false on timeout
+     */
+    bool reader_wait(int reader, size_t bytes, std::chrono::microseconds timeout);
+
+    /**
+     *  Advance the reader's position. Reader side operation.
+     *
+     *  @return false if the data has been (or may have been) overwritten while it was accessed. The
+     *          bytes are skipped anyway, and counted as dropped. Always true for Block readers.
+     */
+    bool reader_consume(int reader, size_t bytes);
+
+    /**
+     *  Advance the reader's position without accessing the data. Reader side operation.
+     */
+    void reader_skip(int reader, size_t bytes) {
+      _readers[reader].pos.store(_readers[reader].pos.load(std::memory_order_relaxed) + bytes, std::memory_order_release);
+    }
+
+    /**
+     *  Current position of the reader, in bytes written to the buffer since it has been created
+     */
+    size_t reader_position(int reader) { return _readers[reader].pos.load(std::memory_order_relaxed); }
+
+    /**
+     *  Number of bytes a Drop reader has lost because it fell behind
+     */
+    uint64_t reader_dropped(int reader) { return _readers[reader].dropped.load(std::memory_order_relaxed); }
+
  private:
+    static constexpr size_t kCacheLineSize = 64;
+    static constexpr int kMaxReaders = 4;
+
+    struct alignas(kCacheLineSize) Reader {
+      std::atomic<bool> active = { false };
+      OverflowPolicy policy = OverflowPolicy::Drop;
+      std::atomic<size_t> pos = { 0 };          // written by the reader only
+      std::atomic<size_t> wait_target = { 0 };  // write position the reader waits for, 0 if not waiting
+      std::atomic<uint64_t> dropped = { 0 };
+    };
+
+    bool map_mirrored();
+
+    // Oldest position still needed by the consumer or a Block reader. Everything before it can be overwritten.
+    size_t tail_pos();
+
     std::vector<char*> _buffers;
     size_t _size;
     size_t _channels;
-    size_t _head;
-    size_t _used;
-    std::mutex _mutex;
+    bool _mirrored;
+
+    alignas(kCacheLineSize) std::atomic<size_t> _write_pos = { 0 };  // written by the producer only
+    alignas(kCacheLineSize) std::atomic<size_t> _read_pos = { 0 };   // written by the consumer only
+
+    // Write position the waiting consumer needs the producer to reach, 0 if the consumer is not waiting
+    alignas(kCacheLineSize) std::atomic<size_t> _wait_target = { 0 };
+    std::mutex _wait_mutex;
+    std::condition_variable _wait_cv;
+
+    std::array<Reader, kMaxReaders> _readers;
+    std::atomic<int> _nof_readers = { 0 };
+    std::atomic<bool> _blocking_readers = { false };
+    std::condition_variable _reader_cv;
+
+    // Largest amount committed at once. Drop readers keep this distance from the write position, as the
+    // producer may already be writing that far ahead of it.
+    std::atomic<size_t> _max_commit = { 0 };
 };
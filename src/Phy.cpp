@@ -185,6 +185,22 @@ auto Phy::cell_search() -> bool {
   return false;
 }
 
+auto Phy::set_known_cell(srsran_cell_t cell) -> bool {
+  if (!srsran_cell_isvalid(&cell)) {
+    spdlog::error("Phy: Known cell parameters are invalid");
+    return false;
+  }
+
+  spdlog::info("Phy: Using known cell. {} cell, Mode {}, PCI {}, PRB {}, Ports {}",
+      cell.mbms_dedicated ? "MBMS dedicated" : "MBMS/Unicast mixed",
+      cell.frame_type != 0u ? "TDD" : "FDD", cell.id, cell.nof_prb, cell.nof_ports);
+
+  _cell = cell;
+  _cell.mbsfn_prb = _cell.nof_prb;
+  set_cell();
+  return true;
+}
+
 auto Phy::set_cell() -> void {
     if (srsran_ue_sync_set_cell(&_ue_sync, cell()) != 0) {
       spdlog::error("Phy: failed to set cell.\n");
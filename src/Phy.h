@@ -73,6 +73,13 @@ class Phy {
      */
     bool cell_search();
 
+    /**
+     *  Use a cell with known parameters (e.g. from sample file metadata) instead of searching for it
+     *
+     *  Returns false if the cell parameters are invalid.
+     */
+    bool set_known_cell(srsran_cell_t cell);
+
     /**
      *  Synchronizes PSS/SSS and tries to deocode the MIB.
      *
@@ -80,6 +87,11 @@ class Phy {
      */
     bool synchronize_subframe();
 
+    /**
+     *  Drop the current timing and search for the PSS/SSS again on the next call to synchronize_subframe()
+     */
+    void reset_sync() { srsran_ue_sync_reset(&_ue_sync); }
+
     /**
      * Get the sample data for the next subframe.
      */
@@ -107,6 +119,16 @@ class Phy {
      */
     float cfo() { return srsran_ue_sync_get_cfo(&_ue_sync);}
 
+    /**
+     * Get the tracked sampling frequency offset, in Hz
+     */
+    float sfo() { return srsran_ue_sync_get_sfo(&_ue_sync); }
+
+    /**
+     * Number of samples per channel written by the last call to get_next_frame()
+     */
+    uint32_t subframe_len() { return _ue_sync.sf_len; }
+
     /**
      * Set the CFO value from channel estimation
      */
@@ -0,0 +1,263 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ *  A set of frame processors, handed out to the main loop one subframe at a time.
+ *
+ *  Every processor sits in a slot, and the slot's state says who owns the processor:
+ *
+ *    Free -> Filling     acquire(): the main loop writes the subframe into the processor's buffer
+ *    Filling -> Queued   submit(): the subframe is queued for a worker thread
+ *    Queued -> Processing  start(): a worker has picked it up
+ *    Processing -> Free  release(): the worker is done
+ *    Filling -> Free     release(): the subframe was not received, or is not going to be processed
+ *    Queued -> Free      release(): the subframe was dropped by the worker, because it was too late
+ *
+ *  acquire() returns the next free processor, so one slow decode only holds up its own processor.
+ *  The main loop only waits (a stall) if all processors are busy. The state changes are lock free,
+ *  the mutex is only taken to sleep while all processors are busy and to wake up the sleeper.
+ */
+template <class Processor>
+class ProcessorPool {
+  public:
+    enum class State : unsigned { Free, Filling, Queued, Processing };
+
+    /**
+     *  Ownership token for one processor, returned by acquire()
+     */
+    struct Slot {
+      Processor* processor;
+      ProcessorPool* pool;
+      unsigned index;
+      std::atomic<State> state = { State::Free };
+    };
+
+    /**
+     *  Default constructor.
+     *
+     *  @param processors The processors to hand out. The pool does not take ownership of them.
+     */
+    explicit ProcessorPool(const std::vector<Processor*>& processors)
+      : _size(processors.size())
+      , _slots(new Slot[processors.size()])
+    {
+      for (unsigned i = 0; i < _size; i++) {
+        _slots[i].processor = processors[i];
+        _slots[i].pool = this;
+        _slots[i].index = i;
+      }
+    }
+
+    /**
+     *  Claim the next free processor. Blocks while all processors are busy.
+     */
+    Slot* acquire() {
+      auto slot = try_acquire();
+      if (slot == nullptr) {
+        _stalls++;
+        auto start = std::chrono::steady_clock::now();
+        wait([this, &slot] { return (slot = try_acquire()) != nullptr; });
+        _stall_us += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+      }
+      return slot;
+    }
+
+    /**
+     *  Claim the next free processor, if there is one.
+     *
+     *  @return The processor's slot, or nullptr if all processors are busy
+     */
+    Slot* try_acquire() {
+      // Start after the last processor handed out, so the processors take turns while all keep up
+      for (unsigned i = 0; i < _size; i++) {
+        auto slot = &_slots[(_next + i) % _size];
+        if (claim(slot)) {
+          _next = (_next + i + 1) % _size;
+          return slot;
+        }
+      }
+      return nullptr;
+    }
+
+    /**
+     *  Claim the next free processor, waiting for one until a deadline at most.
+     *
+     *  @return The processor's slot, or nullptr if all processors were busy until the deadline
+     */
+    Slot* acquire_until(std::chrono::steady_clock::time_point deadline) {
+      auto slot = try_acquire();
+      if (slot == nullptr) {
+        _stalls++;
+        auto start = std::chrono::steady_clock::now();
+        wait_until(deadline, [this, &slot] { return (slot = try_acquire()) != nullptr; });
+        _stall_us += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+      }
+      return slot;
+    }
+
+    /**
+     *  The subframe in the slot's buffer is complete and queued for processing
+     */
+    void submit(Slot* slot) {
+      slot->state.store(State::Queued, std::memory_order_release);
+      _submitted++;
+      auto d = depth();
+      auto max = _max_depth.load(std::memory_order_relaxed);
+      while (d > max && !_max_depth.compare_exchange_weak(max, d, std::memory_order_relaxed)) {
+      }
+    }
+
+    /**
+     *  A worker has started processing the slot's subframe
+     */
+    void start(Slot* slot) { slot->state.store(State::Processing, std::memory_order_relaxed); }
+
+    /**
+     *  Hand the processor back to the pool, and wake up the main loop if it is waiting for it
+     */
+    void release(Slot* slot) {
+      slot->state.store(State::Free, std::memory_order_seq_cst);
+      if (_waiting.load(std::memory_order_seq_cst) > 0) {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        _cv.notify_all();
+      }
+    }
+
+    /**
+     *  Wait until all processors are idle, and keep them from being handed out until resume().
+     *
+     *  Used to read the reception statistics while no subframe is being decoded.
+     */
+    void pause() {
+      for (unsigned i = 0; i < _size; i++) {
+        auto slot = &_slots[i];
+        wait([slot] { return claim(slot); });
+      }
+    }
+
+    /**
+     *  Release all processors claimed by pause()
+     */
+    void resume() {
+      for (unsigned i = 0; i < _size; i++) {
+        release(&_slots[i]);
+      }
+    }
+
+    /**
+     *  Number of processors
+     */
+    unsigned size() const { return _size; }
+
+    /**
+     *  The processor in slot idx
+     */
+    Processor* processor(unsigned idx) const { return _slots[idx].processor; }
+
+    /**
+     *  Number of processors that are free to be handed out
+     */
+    unsigned idle() const {
+      unsigned n = 0;
+      for (unsigned i = 0; i < _size; i++) {
+        n += _slots[i].state.load(std::memory_order_relaxed) == State::Free;
+      }
+      return n;
+    }
+
+    /**
+     *  Number of subframes queued or being processed
+     */
+    unsigned depth() const {
+      unsigned d = 0;
+      for (unsigned i = 0; i < _size; i++) {
+        auto state = _slots[i].state.load(std::memory_order_relaxed);
+        d += state == State::Queued || state == State::Processing;
+      }
+      return d;
+    }
+
+    /**
+     *  Highest depth() seen when a subframe was submitted
+     */
+    unsigned max_depth() const { return _max_depth; }
+
+    /**
+     *  Number of subframes submitted for processing
+     */
+    uint64_t submitted() const { return _submitted; }
+
+    /**
+     *  Number of times acquire() had to wait because all processors were busy
+     */
+    uint64_t stalls() const { return _stalls; }
+
+    /**
+     *  Total time spent waiting in acquire(), in microseconds
+     */
+    uint64_t stall_us() const { return _stall_us; }
+
+  private:
+    static bool claim(Slot* slot) {
+      auto expected = State::Free;
+      return slot->state.compare_exchange_strong(expected, State::Filling, std::memory_order_seq_cst);
+    }
+
+    template <class Predicate>
+    void wait(Predicate pred) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _waiting.fetch_add(1, std::memory_order_seq_cst);
+      _cv.wait(lock, pred);
+      _waiting.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    template <class Predicate>
+    void wait_until(std::chrono::steady_clock::time_point deadline, Predicate pred) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _waiting.fetch_add(1, std::memory_order_seq_cst);
+      _cv.wait_until(lock, deadline, pred);
+      _waiting.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    unsigned _size;
+    std::unique_ptr<Slot[]> _slots;
+    unsigned _next = 0;
+
+    std::atomic<unsigned> _waiting = { 0 };
+    std::mutex _mutex;
+    std::condition_variable _cv;
+
+    std::atomic<uint64_t> _submitted = { 0 };
+    std::atomic<uint64_t> _stalls = { 0 };
+    std::atomic<uint64_t> _stall_us = { 0 };
+    std::atomic<unsigned> _max_depth = { 0 };
+};
@@ -0,0 +1,67 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "Resampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+Resampler::Resampler(unsigned taps_per_branch)
+  : _taps_per_branch(taps_per_branch)
+{
+  set_decimation(1);
+}
+
+void Resampler::set_decimation(unsigned decimation) {
+  _decimation = std::min(decimation, kMaxDecimation);
+  if (decimation <= 1) {
+    _taps.assign(1, 1.0f);
+    return;
+  }
+
+  // Cut off at 80% of the output Nyquist frequency. An odd length keeps the filter delay at a whole sample.
+  auto nof_taps = _decimation * _taps_per_branch + 1;
+  auto fc = 0.8 * 0.5 / _decimation;
+  _taps.resize(nof_taps);
+  double sum = 0;
+  for (unsigned i = 0; i < nof_taps; i++) {
+    double n = i - (nof_taps - 1) / 2.0;
+    double sinc = n == 0 ? 2 * fc : sin(2 * M_PI * fc * n) / (M_PI * n);
+    double window = 0.42 - 0.5 * cos(2 * M_PI * i / (nof_taps - 1)) + 0.08 * cos(4 * M_PI * i / (nof_taps - 1));
+    _taps[i] = sinc * window;
+    sum += _taps[i];
+  }
+  for (auto& tap : _taps) {
+    tap /= sum;
+  }
+}
+
+void Resampler::decimate(const cf_t* in, cf_t* out, uint32_t nof_out) {
+  if (_decimation <= 1) {
+    srsran_vec_cf_copy(out, in, nof_out);
+    return;
+  }
+
+  // Output sample m is the filter output at input sample m * decimation, which only needs the samples up to
+  // it. The taps are symmetric, so no need to reverse them for the convolution.
+  auto first = in - history();
+  for (uint32_t m = 0; m < nof_out; m++) {
+    out[m] = srsran_vec_dot_prod_cfc(first + m * _decimation, _taps.data(), _taps.size());
+  }
+}
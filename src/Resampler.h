@@ -0,0 +1,87 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "srsran/srsran.h"
+
+/**
+ *  Decimates blocks of samples by an integer factor.
+ *
+ *  Used to bring a subframe captured at a wider sample rate down to the rate of a narrower cell.
+ *  The filter is a Blackman windowed sinc, evaluated only for the kept samples. It only looks back:
+ *  the history() samples that precede a block in the stream must be passed along with it, so the
+ *  block edges are filtered like the rest of the stream. The output is delayed by the filter's group
+ *  delay of taps_per_branch / 2 output samples, which moves the FFT window into the cyclic prefix.
+ */
+class Resampler {
+ public:
+    /**
+     *  Default constructor.
+     *
+     *  @param taps_per_branch Filter length per output sample, the filter has decimation * taps_per_branch + 1 taps
+     */
+    explicit Resampler(unsigned taps_per_branch = 8);
+
+    /**
+     *  Default destructor.
+     */
+    virtual ~Resampler() = default;
+
+    /**
+     *  Largest supported decimation factor
+     */
+    static constexpr unsigned kMaxDecimation = 16;
+
+    /**
+     *  Set the decimation factor (at most kMaxDecimation) and design the filter for it
+     */
+    void set_decimation(unsigned decimation);
+
+    /**
+     *  Current decimation factor
+     */
+    unsigned decimation() const { return _decimation; }
+
+    /**
+     *  Number of input samples preceding a block that the filter reads
+     */
+    unsigned history() const { return _taps.size() - 1; }
+
+    /**
+     *  Largest history(), at kMaxDecimation
+     */
+    unsigned max_history() const { return kMaxDecimation * _taps_per_branch; }
+
+    /**
+     *  Decimate one block.
+     *
+     *  @param in  nof_out * decimation() input samples, preceded by the history() samples before them in the stream
+     *  @param out Output buffer for nof_out samples
+     *  @param nof_out Number of output samples
+     */
+    void decimate(const cf_t* in, cf_t* out, uint32_t nof_out);
+
+ private:
+    unsigned _taps_per_branch;
+    unsigned _decimation = 1;
+    std::vector<float> _taps;
+};
@@ -19,6 +19,9 @@
 
 //#include "RestHandler.h"
 #include "CasFrameProcessor.h"
+#include "LoadShedder.h"
+#include "MchReorderBuffer.h"
+#include "SyncStage.h"
 
 #include <memory>
 #include <utility>
@@ -33,6 +36,18 @@ using web::http::status_codes;
 using web::http::experimental::listener::http_listener;
 using web::http::experimental::listener::http_listener_config;
 
+template <class Processor>
+static auto pool_status(const ProcessorPool<Processor>& pool) -> value {
+  value status = value::object();
+  status["processors"] = value(pool.size());
+  status["depth"] = value(pool.depth());
+  status["max_depth"] = value(pool.max_depth());
+  status["submitted"] = value(static_cast<uint64_t>(pool.submitted()));
+  status["stalls"] = value(static_cast<uint64_t>(pool.stalls()));
+  status["stall_us"] = value(static_cast<uint64_t>(pool.stall_us()));
+  return status;
+}
+
 RestHandler::RestHandler(const libconfig::Config& cfg, const std::string& url,
                          state_t& state, SdrReader& sdr, Phy& phy,
                          set_params_t set_params)
@@ -148,7 +163,68 @@ void RestHandler::get(http_request message) {
       sdr["antenna"] = value(_sdr.get_antenna());
       sdr["sample_rate"] = value(_sdr.get_sample_rate());
       sdr["buffer_level"] = value(_sdr.get_buffer_level());
+      sdr["sample_file_dropped"] = value(_sdr.get_sample_file_dropped());
+      sdr["overflows"] = value(_sdr.get_overflows());
+      sdr["gaps"] = value(_sdr.get_gaps());
+      sdr["lost_samples"] = value(_sdr.get_lost_samples());
+      sdr["device_sample_rate"] = value(_sdr.get_device_sample_rate());
+      sdr["resampler_ns_per_sample"] = value(_sdr.get_resampler_ns_per_sample());
+      sdr["rate_correction_ppm"] = value(_sdr.get_rate_correction());
       message.reply(status_codes::OK, sdr);
+    } else if (paths[0] == "threads" && _thread_placement != nullptr) {
+      value threads = value::object();
+      threads["allowed_cpus"] = value(_thread_placement->allowed_cpus());
+      threads["isolated_cpus"] = value(_thread_placement->isolated_cpus());
+      value classes = value::object();
+      for (auto cls : { ThreadPlacement::ThreadClass::SdrReader, ThreadPlacement::ThreadClass::Main,
+                        ThreadPlacement::ThreadClass::Phy, ThreadPlacement::ThreadClass::Housekeeping }) {
+        classes[ThreadPlacement::class_name(cls)] = value(_thread_placement->cpus(cls));
+      }
+      threads["classes"] = classes;
+      std::vector<value> placed;
+      for (const auto& placement : _thread_placement->placements()) {
+        value t;
+        t["name"] = value(placement.name);
+        t["class"] = value(ThreadPlacement::class_name(placement.thread_class));
+        t["cpus"] = value(placement.cpus);
+        t["policy"] = value(ThreadPlacement::policy_name(placement.policy));
+        t["priority"] = value(placement.priority);
+        placed.push_back(t);
+      }
+      threads["threads"] = value::array(placed);
+      message.reply(status_codes::OK, threads);
+    } else if (paths[0] == "processors" && _cas_pool != nullptr && _mbsfn_pool != nullptr) {
+      value processors = value::object();
+      processors["cas"] = pool_status(*_cas_pool);
+      processors["mbsfn"] = pool_status(*_mbsfn_pool);
+      if (_shedder != nullptr) {
+        value dropped = value::object();
+        for (auto priority : { LoadShedder::Priority::Padding, LoadShedder::Priority::UnselectedMch,
+                               LoadShedder::Priority::Mch, LoadShedder::Priority::Mcch }) {
+          value counts = value::object();
+          counts["shed"] = value(static_cast<uint64_t>(_shedder->shed(priority)));
+          counts["late"] = value(static_cast<uint64_t>(_shedder->late(priority)));
+          dropped[LoadShedder::priority_name(priority)] = counts;
+        }
+        processors["dropped"] = dropped;
+      }
+      if (_sync_stage != nullptr) {
+        value sync = value::object();
+        sync["received"] = value(static_cast<uint64_t>(_sync_stage->received()));
+        sync["depth"] = value(_sync_stage->depth());
+        sync["max_queued"] = value(_sync_stage->max_queued());
+        sync["full"] = value(static_cast<uint64_t>(_sync_stage->full()));
+        processors["sync"] = sync;
+      }
+      if (_mch_reorder != nullptr) {
+        value reorder = value::object();
+        reorder["delivered"] = value(static_cast<uint64_t>(_mch_reorder->delivered()));
+        reorder["skipped"] = value(static_cast<uint64_t>(_mch_reorder->skipped()));
+        reorder["late"] = value(static_cast<uint64_t>(_mch_reorder->late()));
+        reorder["overflows"] = value(static_cast<uint64_t>(_mch_reorder->overflows()));
+        processors["reorder"] = reorder;
+      }
+      message.reply(status_codes::OK, processors);
     } else if (paths[0] == "ce_values") {
       auto cestream = Concurrency::streams::bytestream::open_istream(_ce_values);
       message.reply(status_codes::OK, cestream);
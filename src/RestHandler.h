@@ -22,10 +22,13 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <libconfig.h++>
 
 #include "SdrReader.h"
 #include "Phy.h"
+#include "ProcessorPool.h"
+#include "ThreadPlacement.h"
 
 #include "cpprest/json.h"
 #include "cpprest/http_listener.h"
@@ -40,6 +43,9 @@ typedef enum { searching, syncing, processing } state_t;
 
 class CasFrameProcessor; // Forward declaration of CasFrameProcessor to avoid circular references.
 class MbsfnFrameProcessor;
+class LoadShedder;
+class SyncStage;
+class MchReorderBuffer;
 
 /**
  *  The RESTful API handler. Supports GET and PUT verbs for SDR parameters, and GET for reception info
@@ -160,11 +166,45 @@ class RestHandler {
      */
     void set_mbsfn_processor (MbsfnFrameProcessor* mbsfn_processor) { _mbsfn_processors.push_back(mbsfn_processor); };
 
+    /**
+     *  Save the pointer to the thread placement, reported under /threads
+     */
+    void set_thread_placement (const ThreadPlacement* thread_placement) { _thread_placement = thread_placement; };
+
+    /**
+     *  Save the pointers to the frame processor pools, reported under /processors
+     */
+    void set_processor_pools (const ProcessorPool<CasFrameProcessor>* cas_pool, const ProcessorPool<MbsfnFrameProcessor>* mbsfn_pool) {
+      _cas_pool = cas_pool;
+      _mbsfn_pool = mbsfn_pool;
+    };
+
+    /**
+     *  Save the pointer to the load shedder, its drop counts are reported under /processors
+     */
+    void set_load_shedder (const LoadShedder* shedder) { _shedder = shedder; };
+
+    /**
+     *  Save the pointer to the sync thread, its queue is reported under /processors
+     */
+    void set_sync_stage (const SyncStage* sync_stage) { _sync_stage = sync_stage; };
+
+    /**
+     *  Save the pointer to the MCH reorder buffer, its delivery counts are reported under /processors
+     */
+    void set_mch_reorder_buffer (const MchReorderBuffer* reorder) { _mch_reorder = reorder; };
+
 
   private:
     // We need access to the processors to get the values to be displayed in the rt-wui.
     CasFrameProcessor* _cas_processor;
     std::vector<MbsfnFrameProcessor*> _mbsfn_processors; 
+    const ThreadPlacement* _thread_placement = nullptr;
+    const ProcessorPool<CasFrameProcessor>* _cas_pool = nullptr;
+    const ProcessorPool<MbsfnFrameProcessor>* _mbsfn_pool = nullptr;
+    const LoadShedder* _shedder = nullptr;
+    const SyncStage* _sync_stage = nullptr;
+    const MchReorderBuffer* _mch_reorder = nullptr;
     
     std::vector<float>  _cinr_db;
     void get(web::http::http_request message);
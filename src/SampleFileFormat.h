@@ -0,0 +1,92 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+ *  Sample formats for recorded I/Q files.
+ *
+ *  CF32 files are plain 4 byte float I/Q, channels interleaved per sample, as written by srsran_filesink.
+ *  They carry no header, so they stay compatible with the srsRAN tools and existing recordings.
+ *
+ *  The compact formats store each I and Q value as a signed 16 or 8 bit integer. These files start with
+ *  a SampleFileHeader that records the format, the channel count and the scale factor used for the
+ *  conversion (float = integer / scale), padded to kSampleFileHeaderSize to keep the sample data aligned
+ *  for direct I/O.
+ */
+enum class SampleFormat : uint32_t {
+  CF32 = 0,
+  CS16 = 1,
+  CS8 = 2,
+};
+
+const size_t kSampleFileHeaderSize = 4096;
+const char kSampleFileMagic[8] = {'M', 'B', 'M', 'S', '-', 'I', 'Q', '1'};
+
+struct SampleFileHeader {
+  char magic[8];
+  uint32_t format;
+  uint32_t channels;
+  float scale;
+};
+
+/**
+ *  Size of one complex sample (I and Q) in the passed format, in bytes
+ */
+inline auto sample_size(SampleFormat format) -> size_t {
+  switch (format) {
+    case SampleFormat::CS16: return 2 * sizeof(int16_t);
+    case SampleFormat::CS8: return 2 * sizeof(int8_t);
+    default: return 2 * sizeof(float);
+  }
+}
+
+/**
+ *  Default scale factor for the passed format, mapping the SDR full scale of +/-1.0 to the integer range
+ */
+inline auto default_sample_scale(SampleFormat format) -> float {
+  switch (format) {
+    case SampleFormat::CS16: return INT16_MAX;
+    case SampleFormat::CS8: return INT8_MAX;
+    default: return 1.0;
+  }
+}
+
+/**
+ *  Parse a format name (cf32, cs16, cs8).
+ *
+ *  @return false if the name is unknown
+ */
+inline auto sample_format_from_string(const std::string& name, SampleFormat& format) -> bool {
+  if (name == "cf32") {
+    format = SampleFormat::CF32;
+  } else if (name == "cs16") {
+    format = SampleFormat::CS16;
+  } else if (name == "cs8") {
+    format = SampleFormat::CS8;
+  } else {
+    return false;
+  }
+  return true;
+}
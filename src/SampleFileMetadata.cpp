@@ -0,0 +1,276 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "SampleFileMetadata.h"
+
+#include <cpprest/json.h>
+
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+
+#include "spdlog/spdlog.h"
+
+using web::json::value;
+
+const uint32_t kTtiWrap = 10240;
+
+namespace {
+/**
+ *  Current time in ISO 8601 format (UTC), as used for SigMF datetime fields
+ */
+auto iso8601_now() -> std::string {
+  struct timespec now = {};
+  clock_gettime(CLOCK_REALTIME, &now);
+  struct tm utc = {};
+  gmtime_r(&now.tv_sec, &utc);
+  char buf[32];
+  auto len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &utc);
+  snprintf(buf + len, sizeof(buf) - len, ".%03ldZ", now.tv_nsec / 1000000);
+  return buf;
+}
+
+auto sigmf_datatype(SampleFormat format) -> std::string {
+  switch (format) {
+    case SampleFormat::CS16: return "ci16_le";
+    case SampleFormat::CS8: return "ci8";
+    default: return "cf32_le";
+  }
+}
+}  // namespace
+
+auto SampleFileMetadata::path_for(const std::string& sample_file) -> std::string {
+  const std::string data_ext = ".sigmf-data";
+  if (sample_file.size() > data_ext.size() &&
+      sample_file.compare(sample_file.size() - data_ext.size(), data_ext.size(), data_ext) == 0) {
+    return sample_file.substr(0, sample_file.size() - data_ext.size()) + ".sigmf-meta";
+  }
+  return sample_file + ".sigmf-meta";
+}
+
+void SampleFileMetadata::set_format(SampleFormat format, unsigned channels, float scale) {
+  _format = format;
+  _channels = channels;
+  _scale = scale;
+}
+
+void SampleFileMetadata::add_capture(uint64_t sample_start, double sample_rate, double frequency, double gain) {
+  // A restart without any samples in between replaces the previous segment
+  if (!_captures.empty() && _captures.back().sample_start == sample_start) {
+    _captures.pop_back();
+  }
+  _captures.push_back({sample_start, sample_rate, frequency, gain, iso8601_now()});
+}
+
+void SampleFileMetadata::add_annotation(uint64_t sample_start, uint32_t tti) {
+  _annotations.push_back({sample_start, tti, iso8601_now()});
+}
+
+void SampleFileMetadata::set_cell(const srsran_cell_t& cell) {
+  _cell = cell;
+  _cell_valid = true;
+}
+
+auto SampleFileMetadata::cell(srsran_cell_t& cell) const -> bool {
+  if (_cell_valid) {
+    cell = _cell;
+  }
+  return _cell_valid;
+}
+
+auto SampleFileMetadata::sample_rate() const -> double {
+  return _captures.empty() ? 0 : _captures.back().sample_rate;
+}
+
+auto SampleFileMetadata::capture_at(uint64_t sample) const -> const Capture* {
+  const Capture* capture = nullptr;
+  for (const auto& c : _captures) {
+    if (c.sample_start > sample) {
+      break;
+    }
+    capture = &c;
+  }
+  return capture;
+}
+
+auto SampleFileMetadata::sample_for_time(double seconds, uint64_t& sample) const -> bool {
+  if (seconds < 0) {
+    return false;
+  }
+  double segment_start_time = 0;
+  for (size_t i = 0; i < _captures.size(); i++) {
+    const auto& capture = _captures[i];
+    auto offset = static_cast<uint64_t>((seconds - segment_start_time) * capture.sample_rate);
+    if (i + 1 == _captures.size() || capture.sample_start + offset < _captures[i + 1].sample_start) {
+      sample = capture.sample_start + offset;
+      return true;
+    }
+    segment_start_time += (_captures[i + 1].sample_start - capture.sample_start) / capture.sample_rate;
+  }
+  return false;
+}
+
+auto SampleFileMetadata::sample_for_tti(uint32_t tti, uint64_t& sample) const -> bool {
+  for (size_t i = 0; i < _annotations.size(); i++) {
+    const auto& annotation = _annotations[i];
+    auto capture = capture_at(annotation.sample_start);
+    if (capture == nullptr) {
+      continue;
+    }
+    auto subframes = (tti + kTtiWrap - annotation.tti % kTtiWrap) % kTtiWrap;
+    auto candidate = annotation.sample_start + static_cast<uint64_t>(subframes * capture->sample_rate / 1000.0);
+    if (i + 1 == _annotations.size() || candidate < _annotations[i + 1].sample_start) {
+      sample = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+auto SampleFileMetadata::save(const std::string& file) const -> bool {
+  value global = value::object();
+  global["core:datatype"] = value::string(sigmf_datatype(_format));
+  global["core:version"] = value::string("1.0.0");
+  global["core:num_channels"] = value(_channels);
+  global["core:recorder"] = value::string("5G-MAG Reference Tools MBMS Modem");
+  if (!_captures.empty()) {
+    global["core:sample_rate"] = value(_captures.front().sample_rate);
+  }
+  if (_format != SampleFormat::CF32) {
+    global["mbms:scale"] = value(static_cast<double>(_scale));
+  }
+  if (_cell_valid) {
+    value cell = value::object();
+    cell["id"] = value(_cell.id);
+    cell["nof_prb"] = value(_cell.nof_prb);
+    cell["mbsfn_prb"] = value(_cell.mbsfn_prb);
+    cell["nof_ports"] = value(_cell.nof_ports);
+    cell["extended_cp"] = value(_cell.cp == SRSRAN_CP_EXT);
+    cell["tdd"] = value(_cell.frame_type == SRSRAN_TDD);
+    cell["phich_length"] = value(static_cast<uint32_t>(_cell.phich_length));
+    cell["phich_resources"] = value(static_cast<uint32_t>(_cell.phich_resources));
+    cell["mbms_dedicated"] = value(_cell.mbms_dedicated);
+    global["mbms:cell"] = cell;
+  }
+
+  value captures = value::array();
+  for (size_t i = 0; i < _captures.size(); i++) {
+    const auto& c = _captures[i];
+    value capture = value::object();
+    capture["core:sample_start"] = value(c.sample_start);
+    capture["core:frequency"] = value(c.frequency);
+    capture["core:datetime"] = value::string(c.datetime);
+    capture["mbms:sample_rate"] = value(c.sample_rate);
+    capture["mbms:gain"] = value(c.gain);
+    if (i == 0 && _format != SampleFormat::CF32) {
+      capture["core:header_bytes"] = value(static_cast<uint64_t>(kSampleFileHeaderSize));
+    }
+    captures[i] = capture;
+  }
+
+  value annotations = value::array();
+  for (size_t i = 0; i < _annotations.size(); i++) {
+    const auto& a = _annotations[i];
+    value annotation = value::object();
+    annotation["core:sample_start"] = value(a.sample_start);
+    annotation["core:label"] = value::string("SFN " + std::to_string(a.tti / 10) + " SF " + std::to_string(a.tti % 10));
+    annotation["mbms:tti"] = value(a.tti);
+    annotation["mbms:datetime"] = value::string(a.datetime);
+    annotations[i] = annotation;
+  }
+
+  value root = value::object();
+  root["global"] = global;
+  root["captures"] = captures;
+  root["annotations"] = annotations;
+
+  // Write to a temporary file first, so readers never see a half written file
+  auto tmp_file = file + ".tmp";
+  std::ofstream out(tmp_file, std::ios::trunc);
+  out << root.serialize();
+  out.close();
+  if (!out || rename(tmp_file.c_str(), file.c_str()) != 0) {
+    spdlog::warn("Could not write sample file metadata to {}", file);
+    return false;
+  }
+  return true;
+}
+
+auto SampleFileMetadata::load(const std::string& file) -> bool {
+  std::ifstream in(file);
+  if (!in) {
+    return false;
+  }
+
+  try {
+    auto root = value::parse(in);
+    const auto& global = root.at("global");
+    _channels = global.at("core:num_channels").as_number().to_uint32();
+    double global_rate = global.has_field("core:sample_rate") ? global.at("core:sample_rate").as_double() : 0;
+
+    _cell_valid = global.has_field("mbms:cell");
+    if (_cell_valid) {
+      const auto& cell = global.at("mbms:cell");
+      _cell = {};
+      _cell.id = cell.at("id").as_number().to_uint32();
+      _cell.nof_prb = cell.at("nof_prb").as_number().to_uint32();
+      _cell.mbsfn_prb = cell.at("mbsfn_prb").as_number().to_uint32();
+      _cell.nof_ports = cell.at("nof_ports").as_number().to_uint32();
+      _cell.cp = cell.at("extended_cp").as_bool() ? SRSRAN_CP_EXT : SRSRAN_CP_NORM;
+      _cell.frame_type = cell.at("tdd").as_bool() ? SRSRAN_TDD : SRSRAN_FDD;
+      _cell.phich_length = static_cast<srsran_phich_length_t>(cell.at("phich_length").as_integer());
+      _cell.phich_resources = static_cast<srsran_phich_r_t>(cell.at("phich_resources").as_integer());
+      _cell.mbms_dedicated = cell.at("mbms_dedicated").as_bool();
+    }
+
+    _captures.clear();
+    if (root.has_field("captures")) {
+      for (const auto& c : root.at("captures").as_array()) {
+        Capture capture = {};
+        capture.sample_start = c.at("core:sample_start").as_number().to_uint64();
+        capture.sample_rate = c.has_field("mbms:sample_rate") ? c.at("mbms:sample_rate").as_double() : global_rate;
+        capture.frequency = c.has_field("core:frequency") ? c.at("core:frequency").as_double() : 0;
+        capture.gain = c.has_field("mbms:gain") ? c.at("mbms:gain").as_double() : 0;
+        capture.datetime = c.has_field("core:datetime") ? c.at("core:datetime").as_string() : "";
+        _captures.push_back(capture);
+      }
+    }
+
+    _annotations.clear();
+    if (root.has_field("annotations")) {
+      for (const auto& a : root.at("annotations").as_array()) {
+        if (!a.has_field("mbms:tti")) {
+          continue;
+        }
+        Annotation annotation = {};
+        annotation.sample_start = a.at("core:sample_start").as_number().to_uint64();
+        annotation.tti = a.at("mbms:tti").as_number().to_uint32();
+        annotation.datetime = a.has_field("mbms:datetime") ? a.at("mbms:datetime").as_string() : "";
+        _annotations.push_back(annotation);
+      }
+    }
+  } catch (const web::json::json_exception& e) {
+    spdlog::warn("Could not parse sample file metadata {}: {}", file, e.what());
+    return false;
+  }
+
+  spdlog::info("Loaded sample file metadata from {}: {} capture segments, {} TTI annotations{}", file,
+      _captures.size(), _annotations.size(), _cell_valid ? ", cell parameters" : "");
+  return true;
+}
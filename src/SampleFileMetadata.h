@@ -0,0 +1,110 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "srsran/srsran.h"
+#include "SampleFileFormat.h"
+
+/**
+ *  Metadata of a recorded sample file, stored as a SigMF style JSON sidecar next to the samples.
+ *
+ *  Besides the standard SigMF fields (datatype, sample rate, center frequency, ...) it records
+ *  - one capture segment per SDR (re)start, as the sample rate may change during a recording
+ *  - the parameters of the cell the modem was locked to, so playback can skip the cell search
+ *  - a sparse index of annotations mapping sample offsets to the TTI of the subframe starting there
+ *
+ *  All sample offsets are counted in samples per channel from the start of the sample data.
+ */
+class SampleFileMetadata {
+ public:
+    struct Capture {
+      uint64_t sample_start;
+      double sample_rate;
+      double frequency;
+      double gain;
+      std::string datetime;
+    };
+
+    struct Annotation {
+      uint64_t sample_start;
+      uint32_t tti;
+      std::string datetime;
+    };
+
+    /**
+     *  Path of the metadata file belonging to the passed sample file
+     */
+    static std::string path_for(const std::string& sample_file);
+
+    void set_format(SampleFormat format, unsigned channels, float scale);
+
+    /**
+     *  Start a new capture segment at the passed sample offset
+     */
+    void add_capture(uint64_t sample_start, double sample_rate, double frequency, double gain);
+
+    /**
+     *  Record that the subframe with the passed TTI starts at the passed sample offset
+     */
+    void add_annotation(uint64_t sample_start, uint32_t tti);
+
+    void set_cell(const srsran_cell_t& cell);
+
+    /**
+     *  Get the recorded cell parameters
+     *
+     *  @return false if no cell has been recorded
+     */
+    bool cell(srsran_cell_t& cell) const;
+
+    /**
+     *  Sample rate of the last capture segment, 0 if unknown
+     */
+    double sample_rate() const;
+
+    /**
+     *  Find the sample offset for a point in time, in seconds from the start of the recording
+     */
+    bool sample_for_time(double seconds, uint64_t& sample) const;
+
+    /**
+     *  Find the sample offset of the first occurrence of the subframe with the passed TTI after the
+     *  first annotation
+     */
+    bool sample_for_tti(uint32_t tti, uint64_t& sample) const;
+
+    bool save(const std::string& file) const;
+    bool load(const std::string& file);
+
+ private:
+    const Capture* capture_at(uint64_t sample) const;
+
+    SampleFormat _format = SampleFormat::CF32;
+    unsigned _channels = 1;
+    float _scale = 1.0;
+    std::vector<Capture> _captures;
+    std::vector<Annotation> _annotations;
+    bool _cell_valid = false;
+    srsran_cell_t _cell = {};
+};
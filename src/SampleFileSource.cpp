@@ -0,0 +1,176 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "SampleFileSource.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+// The kernel is asked to read ahead this far beyond the current read position
+const size_t kReadaheadSize = 32 * 1024 * 1024;
+
+SampleFileSource::SampleFileSource(unsigned channels)
+  : _channels(channels)
+{
+}
+
+SampleFileSource::~SampleFileSource()
+{
+  if (_data != nullptr) {
+    munmap(_data, _size);
+  }
+}
+
+auto SampleFileSource::open(const std::string& file) -> bool
+{
+  auto fd = ::open(file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    spdlog::error("Could not open sample file {}: {}", file, strerror(errno));
+    return false;
+  }
+
+  struct stat file_stat = {};
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    spdlog::error("Sample file {} is empty or cannot be accessed", file);
+    close(fd);
+    return false;
+  }
+  _size = file_stat.st_size;
+
+  auto data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    spdlog::error("Could not map sample file {}: {}", file, strerror(errno));
+    _size = 0;
+    return false;
+  }
+  _data = static_cast<char*>(data);
+  madvise(_data, _size, MADV_SEQUENTIAL);
+
+  SampleFileHeader header = {};
+  if (_size >= sizeof(header)) {
+    memcpy(&header, _data, sizeof(header));
+  }
+  if (memcmp(header.magic, kSampleFileMagic, sizeof(header.magic)) == 0) {
+    if (header.format != static_cast<uint32_t>(SampleFormat::CS16) &&
+        header.format != static_cast<uint32_t>(SampleFormat::CS8)) {
+      spdlog::error("Sample file {} has unknown sample format {}", file, header.format);
+      return false;
+    }
+    if (header.channels != _channels) {
+      spdlog::error("Sample file {} contains {} channels, but {} are configured", file, header.channels, _channels);
+      return false;
+    }
+    _format = static_cast<SampleFormat>(header.format);
+    _scale = header.scale;
+    _data_offset = std::min(kSampleFileHeaderSize, _size);
+    spdlog::info("Reading samples from {} as {} bit integers, scale factor {}", file,
+        sample_size(_format) * 4, _scale);
+  } else {
+    // No header, this is a plain float file
+    _format = SampleFormat::CF32;
+    _data_offset = 0;
+  }
+
+  _has_metadata = _metadata.load(SampleFileMetadata::path_for(file));
+
+  rewind();
+  return true;
+}
+
+void SampleFileSource::rewind()
+{
+  _position = _data_offset;
+  _readahead_position = _position;
+  readahead();
+}
+
+auto SampleFileSource::seek(uint64_t sample) -> bool
+{
+  auto position = _data_offset + sample * sample_size(_format) * _channels;
+  if (position >= _size) {
+    return false;
+  }
+  _position = position;
+  _readahead_position = _position;
+  readahead();
+  return true;
+}
+
+void SampleFileSource::readahead()
+{
+  // Keep at least half of the readahead window in flight
+  if (_position + kReadaheadSize / 2 < _readahead_position || _readahead_position >= _size) {
+    return;
+  }
+  auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  auto start = (_position / page_size) * page_size;
+  auto end = std::min(_position + kReadaheadSize, _size);
+  madvise(_data + start, end - start, MADV_WILLNEED);
+  _readahead_position = end;
+}
+
+auto SampleFileSource::read(void* const* buffers, size_t samples) -> int
+{
+  auto frame_size = sample_size(_format) * _channels;
+  samples = std::min(samples, (_size - _position) / frame_size);
+  auto values = 2 * samples * _channels;
+  const char* data = _data + _position;
+  _position += samples * frame_size;
+  readahead();
+
+  // Convert to float I/Q
+  const cf_t* interleaved = nullptr;
+  if (_format == SampleFormat::CF32) {
+    interleaved = reinterpret_cast<const cf_t*>(data);
+  } else {
+    _interleaved.resize(samples * _channels);
+    auto out = reinterpret_cast<float*>(_channels == 1 ? buffers[0] : _interleaved.data());
+    if (_format == SampleFormat::CS16) {
+      srsran_vec_convert_if(reinterpret_cast<const int16_t*>(data), _scale, out, values);
+    } else {
+      srsran_vec_convert_bf(reinterpret_cast<const int8_t*>(data), _scale, out, values);
+    }
+    if (_channels == 1) {
+      return static_cast<int>(samples);
+    }
+    interleaved = _interleaved.data();
+  }
+
+  // srsRAN has no SIMD kernel to split interleaved channels, so this stays a copy loop
+  if (_channels == 1) {
+    memcpy(buffers[0], interleaved, samples * sizeof(cf_t));
+  } else {
+    for (auto ch = 0; ch < _channels; ch++) {
+      auto channel = static_cast<cf_t*>(buffers[ch]);
+      for (size_t i = 0; i < samples; i++) {
+        channel[i] = interleaved[i * _channels + ch];
+      }
+    }
+  }
+  return static_cast<int>(samples);
+}
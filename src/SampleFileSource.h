@@ -0,0 +1,108 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "srsran/srsran.h"
+#include "SampleFileFormat.h"
+#include "SampleFileMetadata.h"
+#include "SampleSource.h"
+
+/**
+ *  Reads samples from a previously recorded sample file.
+ *
+ *  The file is memory mapped and read sequentially, with the kernel asked to read ahead of the
+ *  current position, so the samples can be delivered as fast as the consumer takes them.
+ *
+ *  If a metadata file (see SampleFileMetadata) exists next to the sample file, it is loaded as well.
+ *
+ *  Plain float files (as written by srsran_filesink) and the compact integer formats described in
+ *  SampleFileFormat.h are supported. The format is detected from the file header, integer samples
+ *  are converted back to float I/Q and the channels are de-interleaved into the passed buffers.
+ */
+class SampleFileSource : public SampleSource {
+ public:
+    /**
+     *  Default constructor.
+     *
+     *  @param channels Number of RX channels to read
+     */
+    explicit SampleFileSource(unsigned channels);
+
+    /**
+     *  Default destructor. Unmaps the file.
+     */
+    ~SampleFileSource() override;
+
+    /**
+     *  Open the sample file and detect its format
+     */
+    bool open(const std::string& file);
+
+    /**
+     *  Read samples from the file
+     *
+     *  @param buffers Destination buffer for each channel
+     *  @param samples Maximum number of samples per channel to read
+     *  @return Number of samples per channel that have been read, 0 at the end of the file
+     */
+    int read(void* const* buffers, size_t samples) override;
+
+    /**
+     *  Restart reading at the first sample
+     */
+    void rewind() override;
+
+    /**
+     *  Continue reading at the passed sample offset (per channel)
+     *
+     *  @return false if the offset is beyond the end of the file
+     */
+    bool seek(uint64_t sample) override;
+
+    /**
+     *  Return true if a metadata file has been loaded
+     */
+    bool has_metadata() override { return _has_metadata; }
+
+    const SampleFileMetadata& metadata() override { return _metadata; }
+
+    SampleFormat format() { return _format; }
+
+ private:
+    void readahead();
+
+    unsigned _channels;
+    char* _data = nullptr;
+    size_t _size = 0;
+    size_t _data_offset = 0;
+    size_t _position = 0;
+    size_t _readahead_position = 0;
+    SampleFormat _format = SampleFormat::CF32;
+    float _scale = 1.0;
+
+    std::vector<cf_t> _interleaved;
+
+    bool _has_metadata = false;
+    SampleFileMetadata _metadata;
+};
@@ -0,0 +1,372 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "SampleFileWriter.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "spdlog/spdlog.h"
+
+// O_DIRECT requires buffer addresses, sizes and file offsets to be aligned to the logical block size.
+// A page is a safe choice for all common file systems. Chunks are a multiple of this many samples,
+// which keeps every write page aligned regardless of the channel count and sample format.
+const size_t kDirectIoAlignment = 4096;
+const size_t kChunkGranularity = kDirectIoAlignment / sample_size(SampleFormat::CS8);
+
+// Minimum interval between metadata file updates while recording
+const std::chrono::seconds kMetadataInterval(5);
+
+SampleFileWriter::SampleFileWriter(const libconfig::Config& cfg, unsigned channels, SampleFormat format)
+  : _cfg(cfg)
+  , _channels(channels)
+  , _format(format)
+  , _scale(default_sample_scale(format))
+{
+  if (_format != SampleFormat::CF32) {
+    _cfg.lookupValue("modem.sdr.sample_file_scale", _scale);
+  }
+}
+
+SampleFileWriter::~SampleFileWriter()
+{
+  stop();
+  if (_fd >= 0) {
+    close(_fd);
+  }
+  for (auto buffer : _channel_buffers) {
+    free(buffer);
+  }
+  free(_staging);
+  free(_output);
+}
+
+auto SampleFileWriter::open(const std::string& file) -> bool
+{
+  bool direct_io = true;
+  _cfg.lookupValue("modem.sdr.sample_file_direct_io", direct_io);
+
+  if (direct_io) {
+    _fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    _direct_io = (_fd >= 0);
+    if (!_direct_io) {
+      spdlog::info("Sample file {} does not support direct I/O ({}), using buffered writes", file, strerror(errno));
+    }
+  }
+  if (_fd < 0) {
+    _fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  if (_fd < 0) {
+    spdlog::error("Could not create sample file {}: {}", file, strerror(errno));
+    return false;
+  }
+
+  _metadata_file = SampleFileMetadata::path_for(file);
+  _metadata.set_format(_format, _channels, _scale);
+
+  if (_format != SampleFormat::CF32) {
+    auto header_buffer = static_cast<char*>(aligned_alloc(kDirectIoAlignment, kSampleFileHeaderSize));
+    memset(header_buffer, 0, kSampleFileHeaderSize);
+    SampleFileHeader header = {};
+    memcpy(header.magic, kSampleFileMagic, sizeof(header.magic));
+    header.format = static_cast<uint32_t>(_format);
+    header.channels = _channels;
+    header.scale = _scale;
+    memcpy(header_buffer, &header, sizeof(header));
+    auto ok = write_out(header_buffer, kSampleFileHeaderSize);
+    free(header_buffer);
+    if (!ok) {
+      return false;
+    }
+    spdlog::info("Writing samples to {} as {} bit integers, scale factor {}", file,
+        sample_size(_format) * 4, _scale);
+  }
+  return true;
+}
+
+void SampleFileWriter::start(MultichannelRingbuffer* source, double sample_rate, double frequency, double gain)
+{
+  stop();
+
+  {
+    std::lock_guard<std::mutex> lock(_metadata_mutex);
+    _metadata.add_capture(_file_samples, sample_rate, frequency, gain);
+    _metadata_changed = true;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_run_mutex);
+    _run_valid = false;
+  }
+  _run_stream_end = 0;
+  _next_stream_index = std::numeric_limits<uint64_t>::max();
+
+  unsigned chunk_ms = 20;
+  _cfg.lookupValue("modem.sdr.sample_file_chunk_ms", chunk_ms);
+
+  // The chunks have to fit into the ringbuffer several times over, or the writer would always be
+  // overtaken by the SDR reader
+  auto chunk_samples = static_cast<size_t>(ceil(sample_rate / 1000.0 * chunk_ms));
+  chunk_samples = std::min(chunk_samples, source->capacity() / sizeof(cf_t) / 4);
+  _chunk_samples = std::max(kChunkGranularity,
+      ((chunk_samples + kChunkGranularity - 1) / kChunkGranularity) * kChunkGranularity);
+
+  _source = source;
+  _reader = _source->add_reader(MultichannelRingbuffer::OverflowPolicy::Drop);
+  if (_reader < 0) {
+    spdlog::error("Too many readers on the sample ringbuffer, not writing the sample file");
+    return;
+  }
+  _stream_origin = _source->reader_position(_reader);
+
+  for (auto buffer : _channel_buffers) {
+    free(buffer);
+  }
+  _channel_buffers.clear();
+  for (auto ch = 0; ch < _channels; ch++) {
+    _channel_buffers.push_back(static_cast<char*>(srsran_vec_malloc(_chunk_samples * sizeof(cf_t))));
+  }
+  free(_staging);
+  _staging = srsran_vec_cf_malloc(_chunk_samples * _channels);
+  free(_output);
+  _output = static_cast<char*>(aligned_alloc(kDirectIoAlignment, _chunk_samples * _channels * sizeof(cf_t)));
+
+  _running = true;
+  _writer_thread = std::thread{&SampleFileWriter::write_loop, this};
+
+  // Threads inherit the realtime scheduling of their creator. Disk I/O must never compete with the
+  // sample reader or the PHY, so move the writer back to normal scheduling.
+  struct sched_param thread_param = {};
+  thread_param.sched_priority = 0;
+  int error = pthread_setschedparam(_writer_thread.native_handle(), SCHED_OTHER, &thread_param);
+  if (error != 0) {
+    spdlog::warn("Cannot set sample file writer thread to normal scheduling: {}", strerror(error));
+  }
+  if (_thread_placement != nullptr) {
+    _thread_placement->place(ThreadPlacement::ThreadClass::Housekeeping, _writer_thread.native_handle(),
+        "sample-writer");
+  }
+
+  spdlog::debug("Sample file writer started, writing chunks of {} samples", _chunk_samples);
+}
+
+void SampleFileWriter::stop()
+{
+  if (!_running) {
+    return;
+  }
+  _running = false;
+  _writer_thread.join();
+  _dropped_samples += _source->reader_dropped(_reader) / sizeof(cf_t);
+  _source->remove_reader(_reader);
+  _reader = -1;
+  write_metadata();
+  spdlog::info("Sample file writer stopped. {} samples written, {} samples dropped.", _written_samples, _dropped_samples);
+}
+
+auto SampleFileWriter::annotate(uint64_t stream_index, uint32_t tti, const srsran_cell_t& cell) -> bool
+{
+  uint64_t file_index = 0;
+  {
+    std::lock_guard<std::mutex> lock(_run_mutex);
+    if (!_run_valid || stream_index < _run_stream_start || stream_index >= _run_stream_end) {
+      return false;
+    }
+    file_index = _run_file_start + (stream_index - _run_stream_start);
+  }
+
+  std::lock_guard<std::mutex> lock(_metadata_mutex);
+  _metadata.add_annotation(file_index, tti);
+  _metadata.set_cell(cell);
+  _metadata_changed = true;
+  return true;
+}
+
+void SampleFileWriter::write_metadata()
+{
+  SampleFileMetadata metadata;
+  {
+    std::lock_guard<std::mutex> lock(_metadata_mutex);
+    if (!_metadata_changed) {
+      return;
+    }
+    metadata = _metadata;
+    _metadata_changed = false;
+  }
+  metadata.save(_metadata_file);
+}
+
+void SampleFileWriter::write_loop()
+{
+  auto chunk_size = _chunk_samples * sizeof(cf_t);
+  auto metadata_written = std::chrono::steady_clock::now();
+  while (_running) {
+    if (_source->reader_wait(_reader, chunk_size, std::chrono::milliseconds(100))) {
+      if (_enabled) {
+        write_chunk(_chunk_samples);
+      } else {
+        _source->reader_skip(_reader, chunk_size);
+      }
+    }
+
+    // Keep the metadata on disk reasonably current, so it is usable even if the modem does not exit cleanly
+    if (std::chrono::steady_clock::now() - metadata_written > kMetadataInterval) {
+      write_metadata();
+      metadata_written = std::chrono::steady_clock::now();
+    }
+  }
+
+  // Write out whatever is left. The remainder is not a multiple of the alignment, so direct I/O
+  // can't be used for it.
+  auto remaining = _enabled ? _source->reader_readable(_reader) / sizeof(cf_t) : 0;
+  while (remaining > 0) {
+    disable_direct_io();
+    auto samples = std::min(remaining, _chunk_samples);
+    write_chunk(samples);
+    remaining -= samples;
+  }
+}
+
+auto SampleFileWriter::write_chunk(size_t samples) -> bool
+{
+  auto size = samples * sizeof(cf_t);
+  if (_source->reader_readable(_reader) < size) {
+    // The reader has been overtaken and skipped ahead
+    return false;
+  }
+  auto stream_index = (_source->reader_position(_reader) - _stream_origin) / sizeof(cf_t);
+
+  // The SDR reader may overwrite the samples at any time, so they are converted (or copied) into
+  // the output buffer first, and only written out if they were still intact afterwards. Samples that
+  // wrap around the end of a non-mirrored buffer are copied together beforehand.
+  size_t contiguous = 0;
+  auto src = _source->reader_head(_reader, &contiguous);
+  auto intact = true;
+  if (contiguous < size) {
+    for (auto ch = 0; ch < _channels; ch++) {
+      memcpy(_channel_buffers[ch], src[ch], contiguous);
+    }
+    intact &= _source->reader_consume(_reader, contiguous);
+    size_t rest = 0;
+    src = _source->reader_head(_reader, &rest);
+    for (auto ch = 0; ch < _channels; ch++) {
+      memcpy(_channel_buffers[ch] + contiguous, src[ch], size - contiguous);
+    }
+    src.assign(_channel_buffers.begin(), _channel_buffers.end());
+  }
+
+  auto interleaved = reinterpret_cast<const cf_t*>(src[0]);
+  if (_channels == 2) {
+    srsran_vec_interleave(reinterpret_cast<const cf_t*>(src[0]), reinterpret_cast<const cf_t*>(src[1]), _staging,
+        static_cast<int>(samples));
+    interleaved = _staging;
+  } else if (_channels > 1) {
+    for (auto ch = 0; ch < _channels; ch++) {
+      auto channel = reinterpret_cast<const cf_t*>(src[ch]);
+      for (size_t i = 0; i < samples; i++) {
+        _staging[i * _channels + ch] = channel[i];
+      }
+    }
+    interleaved = _staging;
+  }
+
+  auto values = 2 * samples * _channels;
+  const char* out = _output;
+  switch (_format) {
+    case SampleFormat::CS16:
+      srsran_vec_convert_fi(reinterpret_cast<const float*>(interleaved), _scale, reinterpret_cast<int16_t*>(_output), values);
+      break;
+    case SampleFormat::CS8:
+      srsran_vec_convert_fb(reinterpret_cast<const float*>(interleaved), _scale, reinterpret_cast<int8_t*>(_output), values);
+      break;
+    default:
+      if (interleaved != _staging || (_direct_io && reinterpret_cast<uintptr_t>(interleaved) % kDirectIoAlignment != 0)) {
+        memcpy(_output, interleaved, samples * _channels * sizeof(cf_t));
+      } else {
+        out = reinterpret_cast<const char*>(interleaved);
+      }
+      break;
+  }
+  intact &= _source->reader_consume(_reader, contiguous < size ? size - contiguous : size);
+
+  if (!intact) {
+    // Overwritten while converting. The loss is counted by the ringbuffer.
+    std::lock_guard<std::mutex> lock(_run_mutex);
+    _run_valid = false;
+    _next_stream_index = std::numeric_limits<uint64_t>::max();
+    return false;
+  }
+
+  if (stream_index != _next_stream_index) {
+    std::lock_guard<std::mutex> lock(_run_mutex);
+    _run_valid = true;
+    _run_stream_start = stream_index;
+    _run_file_start = _file_samples;
+  }
+
+  if (!write_out(out, samples * _channels * sample_size(_format))) {
+    _dropped_samples += samples;
+    std::lock_guard<std::mutex> lock(_run_mutex);
+    _run_valid = false;
+    _next_stream_index = std::numeric_limits<uint64_t>::max();
+    return false;
+  }
+
+  _written_samples += samples;
+  _file_samples += samples;
+  _next_stream_index = stream_index + samples;
+  _run_stream_end = _next_stream_index;
+  return true;
+}
+
+auto SampleFileWriter::write_out(const char* data, size_t size) -> bool
+{
+  while (size > 0) {
+    auto written = ::write(_fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EINVAL && _direct_io) {
+        // Some file systems accept O_DIRECT on open, but reject the writes
+        spdlog::info("Direct I/O rejected by the file system, using buffered writes");
+        disable_direct_io();
+        continue;
+      }
+      spdlog::error("Error writing sample file: {}", strerror(errno));
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+void SampleFileWriter::disable_direct_io()
+{
+  if (_direct_io) {
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) & ~O_DIRECT);
+    _direct_io = false;
+  }
+}
@@ -0,0 +1,162 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libconfig.h++>
+#include "srsran/srsran.h"
+#include "MultichannelRingbuffer.h"
+#include "SampleFileFormat.h"
+#include "SampleFileMetadata.h"
+#include "ThreadPlacement.h"
+
+/**
+ *  Writes received samples to a file on a separate, low priority thread.
+ *
+ *  The samples are taken straight from the SDR reader's ringbuffer, as a Drop reader (see
+ *  MultichannelRingbuffer), so the SDR reader thread does no additional work for the recording. If
+ *  the disk cannot keep up and the writer falls behind by more than the ringbuffer size, samples are
+ *  dropped and counted instead of stalling the reader. The writer thread takes the samples in large,
+ *  page aligned chunks and writes them out with O_DIRECT if the file system supports it.
+ *
+ *  Samples are stored either as 4 byte float I/Q in the format used by srsran_filesink, or converted to
+ *  one of the compact integer formats (see SampleFileFormat.h). Channels are interleaved per sample.
+ *  A SigMF style metadata file with the capture parameters and a TTI index is maintained next to it.
+ */
+class SampleFileWriter {
+ public:
+    /**
+     *  Default constructor.
+     *
+     *  @param cfg Config singleton reference
+     *  @param channels Number of RX channels to record
+     *  @param format Sample format of the created file
+     */
+    SampleFileWriter(const libconfig::Config& cfg, unsigned channels, SampleFormat format);
+
+    /**
+     *  Default destructor. Flushes and closes the file.
+     */
+    virtual ~SampleFileWriter();
+
+    /**
+     *  Create the sample file and write its header
+     */
+    bool open(const std::string& file);
+
+    /**
+     *  Attach to the ringbuffer, allocate the buffers for the passed sample rate and start the writer
+     *  thread. Starts a new capture segment in the metadata.
+     *
+     *  Position 0 of the caller's sample stream (see annotate()) is the ringbuffer's write position at
+     *  the time of this call.
+     */
+    void start(MultichannelRingbuffer* source, double sample_rate, double frequency, double gain);
+
+    /**
+     *  Write out all remaining samples and stop the writer thread
+     */
+    void stop();
+
+    /**
+     *  Pin the writer thread to the housekeeping CPUs when it is started
+     */
+    void set_thread_placement(ThreadPlacement* placement) { _thread_placement = placement; }
+
+    /**
+     *  Start or pause writing. While paused, the samples in the ringbuffer are skipped.
+     */
+    void set_enabled(bool enabled) { _enabled = enabled; }
+
+    /**
+     *  Add the subframe with the passed TTI, starting at the passed position in the sample stream,
+     *  to the metadata index.
+     *
+     *  @return false if this sample has not been written to the file
+     */
+    bool annotate(uint64_t stream_index, uint32_t tti, const srsran_cell_t& cell);
+
+    /**
+     *  Number of samples (per channel) written to the file
+     */
+    uint64_t written_samples() { return _written_samples; }
+
+    /**
+     *  Number of samples (per channel) that have been dropped because the writer could not keep up
+     */
+    uint64_t dropped_samples() {
+      return _dropped_samples + (_reader >= 0 ? _source->reader_dropped(_reader) / sizeof(cf_t) : 0);
+    }
+
+ private:
+    void write_loop();
+    bool write_chunk(size_t samples);
+    bool write_out(const char* data, size_t size);
+    void disable_direct_io();
+    void write_metadata();
+
+    const libconfig::Config& _cfg;
+    unsigned _channels;
+    SampleFormat _format;
+    float _scale = 1.0;
+
+    int _fd = -1;
+    bool _direct_io = false;
+
+    MultichannelRingbuffer* _source = nullptr;
+    int _reader = -1;
+    std::vector<char*> _channel_buffers;
+    cf_t* _staging = nullptr;
+    char* _output = nullptr;
+    size_t _chunk_samples = 0;
+
+    std::thread _writer_thread;
+    ThreadPlacement* _thread_placement = nullptr;
+    std::atomic<bool> _running = { false };
+    std::atomic<bool> _enabled = { false };
+
+    std::atomic<uint64_t> _written_samples = { 0 };
+    std::atomic<uint64_t> _dropped_samples = { 0 };
+
+    // Ringbuffer position of stream index 0, and the stream index following the last written sample.
+    // Only accessed by the writer thread.
+    size_t _stream_origin = 0;
+    uint64_t _next_stream_index = 0;
+    uint64_t _file_samples = 0;  // samples per channel in the file
+
+    // Mapping from stream positions to file positions for the current run of contiguous samples
+    std::mutex _run_mutex;
+    bool _run_valid = false;
+    uint64_t _run_stream_start = 0;
+    uint64_t _run_file_start = 0;
+    std::atomic<uint64_t> _run_stream_end = { 0 };
+
+    std::string _metadata_file;
+    std::mutex _metadata_mutex;
+    SampleFileMetadata _metadata;
+    bool _metadata_changed = false;
+};
@@ -0,0 +1,71 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <cstdint>
+
+#include "SampleFileMetadata.h"
+
+/**
+ *  A source of recorded samples, or of samples received by another process, that is read instead
+ *  of the SDR.
+ *
+ *  Samples are delivered as float I/Q, one buffer per channel. Sources without a natural end
+ *  (e.g. SharedMemorySource) are rewound whenever read() returns 0.
+ */
+class SampleSource {
+ public:
+    virtual ~SampleSource() = default;
+
+    /**
+     *  Read samples from the source
+     *
+     *  @param buffers Destination buffer for each channel
+     *  @param samples Maximum number of samples per channel to read
+     *  @return Number of samples per channel that have been read, 0 at the end of the source
+     */
+    virtual int read(void* const* buffers, size_t samples) = 0;
+
+    /**
+     *  Restart reading at the first sample
+     */
+    virtual void rewind() = 0;
+
+    /**
+     *  Continue reading at the passed sample offset (per channel)
+     *
+     *  @return false if the offset is beyond the end of the source
+     */
+    virtual bool seek(uint64_t sample) = 0;
+
+    /**
+     *  Return true if metadata (sample rate, cell parameters, ...) is available for the samples
+     */
+    virtual bool has_metadata() = 0;
+
+    virtual const SampleFileMetadata& metadata() = 0;
+
+    /**
+     *  Hardware time of the first sample returned by the last read(), in ns, or -1 if the source
+     *  carries no timestamps
+     */
+    virtual long long time_ns() { return -1; }
+};
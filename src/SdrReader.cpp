@@ -17,18 +17,29 @@
 // along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include "SdrReader.h"
+#include "SharedMemorySource.h"
 #include <SoapySDR/Device.hpp>
 #include <SoapySDR/Types.hpp>
 #include <SoapySDR/Formats.hpp>
+#include <SoapySDR/Errors.hpp>
 
 #include <boost/algorithm/string/join.hpp>
 
+#include <algorithm>
 #include <chrono>
 #include <cmath>
 #include <csignal>
 
 #include "spdlog/spdlog.h"
 
+// Weight of each received block in the DC offset estimate. With blocks of 1ms this gives a time constant
+// of about 100ms.
+const float kDcRemovalAlpha = 0.01;
+const size_t kDcFillSize = 512;  // samples of the DC offset vector subtracted at a time
+
+// Relative deviation from the requested sample rate that is accepted without resampling
+const double kMaxSampleRateError = 1e-6;
+
 SdrReader:: ~SdrReader() {
   if (_sdr != nullptr) {
     auto sdr = (SoapySDR::Device*)_sdr;
@@ -37,12 +48,14 @@ SdrReader:: ~SdrReader() {
     SoapySDR::Device::unmake( sdr );
   }
 
-  if (_reading_from_file) {
-    srsran_filesource_free(&file_source);
+  for (auto buffer : _stream_buffers) {
+    free(buffer);
   }
-
-  if (_writing_to_file) {
-    srsran_filesink_free(&file_sink);
+  for (auto buffer : _resample_buffers) {
+    free(buffer);
+  }
+  for (auto buffer : _resample_output) {
+    free(buffer);
   }
 }
 
@@ -63,26 +76,35 @@ void SdrReader::enumerateDevices()
 
 }
 
-auto SdrReader::init(const std::string& device_args, const char* sample_file,
-                         const char* write_sample_file, bool repeat_sample_file) -> bool {
-  if (sample_file != nullptr) {
-    if (0 == srsran_filesource_init(&file_source,
-                                    const_cast<char*>(sample_file),
-                                    SRSRAN_COMPLEX_FLOAT_BIN)) {
+auto SdrReader::init(const std::string& device_args, const char* sample_file, const char* shared_memory, const char* write_sample_file, SampleFormat write_sample_format,
+                         bool repeat_sample_file, double replay_speed) -> bool {
+  if (shared_memory != nullptr) {
+    // Live samples from a modem-ingest process. They are taken as fast as they arrive, and the
+    // source never ends.
+    auto source = std::make_unique<SharedMemorySource>(_rx_channels);
+    if (!source->open(shared_memory)) {
+      return false;
+    }
+    _sample_file_source = std::move(source);
+    _reading_from_file = true;
+    _repeat_sample_file = true;
+    _replay_speed = 0;
+  } else if (sample_file != nullptr) {
+    auto source = std::make_unique<SampleFileSource>(_rx_channels);
+    if (source->open(sample_file)) {
+      _sample_file_source = std::move(source);
       _reading_from_file = true;
       _repeat_sample_file = repeat_sample_file;
+      _replay_speed = replay_speed;
     } else {
-      spdlog::error("Could not open file {}", sample_file);
       return false;
     }
   } else {
     if (write_sample_file != nullptr) {
-      if (0 == srsran_filesink_init(&file_sink,
-                                    const_cast<char*>(write_sample_file),
-                                    SRSRAN_COMPLEX_FLOAT_BIN)) {
+      _sample_file_writer = std::make_unique<SampleFileWriter>(_cfg, _rx_channels, write_sample_format);
+      if (_sample_file_writer->open(write_sample_file)) {
         _writing_to_file = true;
       } else {
-        spdlog::error("Could not open file {}", write_sample_file);
         return false;
       }
     }
@@ -96,20 +118,39 @@ auto SdrReader::init(const std::string& device_args, const char* sample_file,
   }
 
   _cfg.lookupValue("modem.sdr.ringbuffer_size_ms", _buffer_ms);
+  _cfg.lookupValue("modem.sdr.ringbuffer_mirrored", _buffer_mirrored);
+
+  std::string stream_format = "CF32";
+  _cfg.lookupValue("modem.sdr.stream_format", stream_format);
+  if (stream_format == "CS16") {
+    _stream_cs16 = true;
+  } else if (stream_format != "CF32") {
+    spdlog::error("Unknown SDR stream format {}. Supported formats: CF32, CS16.", stream_format);
+    return false;
+  }
+  _cfg.lookupValue("modem.sdr.dc_removal", _dc_removal);
+  _cfg.lookupValue("modem.sdr.direct_buffer_access", _use_direct_access);
+  _cfg.lookupValue("modem.sdr.resample", _resample_enabled);
+  _cfg.lookupValue("modem.sdr.drift_compensation", _drift_compensation);
+  _cfg.lookupValue("modem.sdr.retune_settle_us", _retune_settle_us);
+  _resampler = std::make_unique<FractionalResampler>(_rx_channels);
   return true;
 }
 
 void SdrReader::init_buffer() {
   auto buffer_size = (unsigned int)ceil(_sampleRate/1000.0 * _buffer_ms);
-  _buffer = std::make_unique<MultichannelRingbuffer>(sizeof(cf_t) * buffer_size, _rx_channels);
-  _buffer_write = std::make_unique<MultichannelRingbuffer>(sizeof(cf_t) * buffer_size * 3, _rx_channels); // This is the buffer where we will store the samples to write a big chunk of samples instead many little ones. It's size is three times the main buffer.
+
+  // Keep the existing buffer (and its mappings) if the sample rate has not changed
+  if (_buffer && _buffer_bytes == sizeof(cf_t) * buffer_size) {
+    return;
+  }
+  _buffer_bytes = sizeof(cf_t) * buffer_size;
+  _buffer = std::make_unique<MultichannelRingbuffer>(_buffer_bytes, _rx_channels, _buffer_mirrored);
   _buffer_ready = true;
 }
 
 void SdrReader::clear_buffer() {
   _buffer->clear();
-  _buffer_write->clear();
-  _high_watermark_reached = false;
 }
 
 auto SdrReader::set_antenna(const std::string& antenna, uint8_t idx) -> bool {
@@ -171,11 +212,22 @@ auto SdrReader::tune(uint32_t frequency, uint32_t sample_rate,
   _frequency = frequency;
   _filterBw = bandwidth;
   _sampleRate = sample_rate;
+  _requested_sample_rate = sample_rate;
   _use_agc = use_agc;
 
+  if (_reading_from_file && sample_file_rate() > 0) {
+    // Replay at the rate the file has been recorded with
+    _sampleRate = sample_file_rate();
+  }
+
   init_buffer();
 
   if (_reading_from_file) {
+    // Drift compensation works on recordings as well, so drifted captures can be replayed
+    _device_sample_rate = _sampleRate;
+    _base_ratio = 1.0;
+    _resampling = _drift_compensation;
+    _resampler->set_ratio(_base_ratio);
     return true;
   }
 
@@ -198,10 +250,26 @@ auto SdrReader::tune(uint32_t frequency, uint32_t sample_rate,
 
   _frequency = sdr->getFrequency( SOAPY_SDR_RX, 0);
   bandwidth = sdr->getBandwidth( SOAPY_SDR_RX, 0);
-  _sampleRate = sdr->getSampleRate( SOAPY_SDR_RX, 0);
+  _device_sample_rate = sdr->getSampleRate( SOAPY_SDR_RX, 0);
 
   spdlog::info("SDR tuned to {} MHz, filter bandwidth {} MHz, sample rate {}, gain {}, antenna path {}",
-      _frequency/1000000.0, bandwidth/1000000.0, _sampleRate/1000000.0, _gain, _antenna);
+      _frequency/1000000.0, bandwidth/1000000.0, _device_sample_rate/1000000.0, _gain, _antenna);
+
+  // Many devices can't hit the LTE sample rates exactly. Instead of decoding at a slightly wrong rate,
+  // resample to the requested one.
+  // The resampler is also needed to compensate for clock drift.
+  auto rate_mismatch = fabs(_device_sample_rate - sample_rate) > kMaxSampleRateError * sample_rate;
+  _resampling = (_resample_enabled && rate_mismatch) || _drift_compensation;
+  if (_resampling) {
+    if (rate_mismatch) {
+      spdlog::warn("SDR delivers {} MHz instead of the requested {} MHz, resampling", _device_sample_rate/1000000.0,
+          sample_rate/1000000.0);
+    }
+    _base_ratio = _device_sample_rate / sample_rate;
+    _resampler->set_ratio(_base_ratio);
+  } else {
+    _sampleRate = _device_sample_rate;
+  }
 
 
   auto sensors = sdr->listSensors();
@@ -221,17 +289,85 @@ void SdrReader::start() {
       channels[ch] = ch;
     }
     sdr->setHardwareTime(0); // Set SDR timestamp to zero.
-    _stream = sdr->setupStream( SOAPY_SDR_RX, SOAPY_SDR_CF32, channels, _device_args);
+
+    if (_stream_cs16) {
+      // Receive the samples in the native integer format and convert them ourselves while writing
+      // them to the ringbuffer, instead of letting the driver do an extra pass over the data.
+      double full_scale = 0;
+      auto native_format = sdr->getNativeStreamFormat(SOAPY_SDR_RX, 0, full_scale);
+      _stream_scale = (native_format == SOAPY_SDR_CS16 && full_scale > 0) ? full_scale : 32768.0;
+      spdlog::info("Streaming CS16 samples, native format {}, full scale {}", native_format, _stream_scale);
+      _dc_offset.assign(_rx_channels, {0, 0});
+      _dc_fill.resize(kDcFillSize);
+    }
+
+    _stream = sdr->setupStream( SOAPY_SDR_RX, _stream_cs16 ? SOAPY_SDR_CS16 : SOAPY_SDR_CF32, channels, _device_args);
     if( _stream == nullptr)
     {
       spdlog::error("Failed to set up RX stream");
       SoapySDR::Device::unmake( sdr );
       return ;
     }
+
+    // Read in whole multiples of the stream MTU, about 1ms per read
+    auto mtu = sdr->getStreamMTU((SoapySDR::Stream*)_stream);
+    _read_chunk = (size_t)ceil(get_device_sample_rate() / 1000.0);
+    if (mtu > 0) {
+      _read_chunk = ((_read_chunk + mtu - 1) / mtu) * mtu;
+    }
+
+    _direct_access = false;
+    if (_use_direct_access && _resampling) {
+      spdlog::info("Not using direct buffer access while resampling");
+    } else if (_use_direct_access) {
+      if (sdr->getNumDirectAccessBuffers((SoapySDR::Stream*)_stream) > 0) {
+        _direct_access = true;
+      } else {
+        spdlog::info("SDR driver does not support direct buffer access, using readStream");
+      }
+    }
+    spdlog::info("Reading {} samples per chunk (stream MTU {}){}", _read_chunk, mtu,
+        _direct_access ? " from the driver buffers" : "");
+
+    if (_stream_cs16 && !_direct_access) {
+      for (auto buffer : _stream_buffers) {
+        free(buffer);
+      }
+      _stream_buffers.clear();
+      for (auto ch = 0; ch < _rx_channels; ch++) {
+        _stream_buffers.push_back(srsran_vec_malloc(_read_chunk * 2 * sizeof(int16_t)));
+      }
+    }
+
     sdr->activateStream( (SoapySDR::Stream*)_stream, SOAPY_SDR_HAS_TIME, 100000000, 0); // Delayed start of the SDR reception, to avoid overfloas at the beggining.
   }
+
+  for (auto buffer : _resample_buffers) {
+    free(buffer);
+  }
+  for (auto buffer : _resample_output) {
+    free(buffer);
+  }
+  _resample_buffers.clear();
+  _resample_output.clear();
+  if (_resampling) {
+    auto chunk = _reading_from_file ? (size_t)ceil(_sampleRate / 1000.0) : _read_chunk;
+    for (auto ch = 0; ch < _rx_channels; ch++) {
+      _resample_buffers.push_back(srsran_vec_cf_malloc(chunk));
+      // Leave room for the largest drift correction
+      _resample_output.push_back(srsran_vec_cf_malloc(_resampler->max_output(chunk) + chunk / 1000));
+    }
+    _resampler->reset();
+  }
   _running = true;
 
+  if (_writing_to_file) {
+    // The writer reads the samples straight from the ringbuffer
+    _sample_file_writer->set_enabled(_write_samples);
+    _sample_file_writer->set_thread_placement(_thread_placement);
+    _sample_file_writer->start(_buffer.get(), _sampleRate, _frequency, _gain);
+  }
+
   // Start the reader thread and elevate its priority to realtime
   _readerThread = std::thread{&SdrReader::read, this};
   struct sched_param thread_param = {};
@@ -244,6 +380,9 @@ void SdrReader::start() {
   if (error != 0) {
     spdlog::warn("Cannot set reader thread priority to realtime: {}. Thread will run at default priority with a high probability of dropped samples and loss of synchronisation.", strerror(error));
   }
+  if (_thread_placement != nullptr) {
+    _thread_placement->place(ThreadPlacement::ThreadClass::SdrReader, _readerThread.native_handle(), "sdr-reader");
+  }
 }
 
 void SdrReader::stop() {
@@ -256,74 +395,218 @@ void SdrReader::stop() {
     sdr->closeStream((SoapySDR::Stream*)_stream);
   }
 
+  if (_writing_to_file) {
+    _sample_file_writer->stop();
+  }
+
   clear_buffer();
+  _discard_pending = false;
+  _produced_samples = 0;
+  _consumed_samples = 0;
+  _device_samples = 0;
+  _time_anchors_written = 0;
+  _time_anchors_read = 0;
+  _producer_anchor = { 0, -1, false };
+  _consumer_anchor = { 0, -1, false };
+}
+
+auto SdrReader::retune(uint32_t frequency, uint32_t sample_rate,
+    uint32_t bandwidth, double gain, const std::string& antenna, bool use_agc) -> bool {
+  if (!_running || _reading_from_file || _sdr == nullptr || sample_rate != _requested_sample_rate) {
+    auto running = _running;
+    if (running) {
+      stop();
+    }
+    auto ok = tune(frequency, sample_rate, bandwidth, gain, antenna, use_agc);
+    if (running) {
+      start();
+    }
+    return ok;
+  }
+
+  auto sdr = (SoapySDR::Device*)_sdr;
+  spdlog::info("Retuning to {} MHz, filter bandwidth {} MHz, gain {}, antenna path {} with AGC set to {}",
+      frequency/1000000.0, bandwidth/1000000.0, gain, antenna, use_agc);
+  _filterBw = bandwidth;
+  _use_agc = use_agc;
+  for (auto ch = 0; ch < _rx_channels; ch++) {
+    set_antenna(antenna, ch);
+    set_gain(_use_agc, gain, ch);
+    set_frequency(frequency, ch);
+    set_filter_bw(bandwidth, ch);
+  }
+  _frequency = sdr->getFrequency( SOAPY_SDR_RX, 0);
+
+  // Everything received until the new settings have settled belongs to the old configuration. If the
+  // stream has timestamps, that's everything up to the current hardware time plus the settling time.
+  _discard_until_ns = sdr->getHardwareTime() + _retune_settle_us * 1000LL;
+  _discard_samples = static_cast<uint64_t>(get_device_sample_rate() * _retune_settle_us / 1e6);
+  _discard_pending.store(true, std::memory_order_release);
+
+  // Wait for the reader thread to pick this up, so nothing it is still writing survives the flush below.
+  auto generation = ++_retune_generation;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+  while (_reader_generation.load(std::memory_order_acquire) != generation &&
+      std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+
+  // Drop the samples with the old settings that are already in the ringbuffer
+  _consumed_samples += _buffer->clear() / sizeof(cf_t);
+  apply_time_anchors(_consumed_samples);
+  _discontinuity = true;
+
+  spdlog::info("SDR retuned to {} MHz", _frequency/1000000.0);
+  return true;
+}
+
+auto SdrReader::discard_stale(int flags, long long time_ns, size_t samples) -> bool {
+  if (!_discard_pending.load(std::memory_order_acquire)) {
+    return false;
+  }
+
+  bool stale = false;
+  auto until = _discard_until_ns.load();
+  if (until >= 0 && (flags & SOAPY_SDR_HAS_TIME) != 0) {
+    stale = time_ns + static_cast<long long>(samples * 1e9 / get_device_sample_rate()) <= until;
+  } else {
+    auto remaining = _discard_samples.load();
+    stale = remaining > 0;
+    _discard_samples = remaining > samples ? remaining - samples : 0;
+  }
+
+  if (stale) {
+    _device_samples += samples;
+    return true;
+  }
+
+  // First block with the new settings. Start a new time anchor, the stream is not contiguous,
+  // and don't let the resampler interpolate across the retune.
+  _discard_pending = false;
+  push_time_anchor(-1, true);
+  if (_resampling) {
+    _resampler->reset();
+  }
+  return false;
 }
 
 void SdrReader::read() {
   std::array<void*, SRSRAN_MAX_CHANNELS> radio_buffers = { nullptr };
+  auto replay_start = std::chrono::steady_clock::now();
+  uint64_t replayed_samples = 0;
+  bool eof_signalled = false;
+  double applied_correction = 0;
   while (_running) {
-    int toRead = ceil(_sampleRate / 1000.0);
+    _reader_generation.store(_retune_generation.load(std::memory_order_acquire), std::memory_order_release);
+
+    // Follow the clock drift correction requested by the receiver
+    auto correction = _rate_correction_ppm.load(std::memory_order_relaxed);
+    if (_resampling && correction != applied_correction) {
+      _resampler->adjust_ratio(_base_ratio * (1.0 + correction * 1e-6));
+      applied_correction = correction;
+    }
+
+    int toRead = _reading_from_file ? ceil(_sampleRate / 1000.0) : _read_chunk;
     //int toRead = 254;
-    if (_buffer->free_size() < toRead * sizeof(cf_t)) {
-      spdlog::debug("ringbuffer overflow");
+    size_t toWrite = _resampling ? _resampler->max_output(toRead) : toRead;
+    if (_buffer->free_size() < toWrite * sizeof(cf_t)) {
+      // When replaying a file, a full buffer is the expected backpressure from the decoder
+      if (!_reading_from_file) {
+        spdlog::debug("ringbuffer overflow");
+      }
       std::this_thread::sleep_for(std::chrono::microseconds(1000));
     } else {
       int read = 0;
       size_t writeable = 0;
-      size_t writeable_write = 0;
       auto buffers = _buffer->write_head(&writeable);
-      auto buffers_write = _buffer_write->write_head(&writeable_write);
       int writeable_samples = (int)floor(writeable / sizeof(cf_t));
-      int writeable_write_samples = (int)floor(writeable_write / sizeof(cf_t));
 
       if (_reading_from_file) {
-        std::chrono::steady_clock::time_point entered = {};
-        entered = std::chrono::steady_clock::now();
-
-        read = srsran_filesource_read_multi(&file_source, buffers.data(), std::min(writeable_samples, toRead), (int)_rx_channels);
+        read = _resampling ? _sample_file_source->read(_resample_buffers.data(), toRead) :
+          _sample_file_source->read(buffers.data(), std::min(writeable_samples, toRead));
         if ( read == 0  ) {
           if (_repeat_sample_file) {
-            srsran_filesource_seek(&file_source, 0);
-          } else {
-            spdlog::info("EOF, exiting...");
+            _sample_file_source->rewind();
+          } else if (!eof_signalled) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - replay_start;
+            spdlog::info("EOF after replaying {:.1f} s of samples in {:.1f} s ({:.2f}x real time), exiting...",
+                replayed_samples / _sampleRate, elapsed.count(), replayed_samples / _sampleRate / elapsed.count());
             raise(SIGINT); //SIGINT to signal srsran that we want to exit.
+            eof_signalled = true;
+          } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(1000));
           }
         }
-        read = read / _rx_channels;
-        int64_t required_time_us = (1000000.0/_sampleRate) * read;
 
+        // Live sources pass on the hardware timestamps, so gaps are detected as with the SDR
         if (read > 0) {
+          auto time_ns = _sample_file_source->time_ns();
+          if (time_ns >= 0) {
+            check_timestamp(time_ns);
+          }
+          _device_samples += read;
+        }
+
+        if (read > 0 && _resampling) {
+          write_resampled(_resampler->resample(_resample_buffers.data(), read, _resample_output.data()));
+          replayed_samples += read;
+        } else if (read > 0) {
           _buffer->commit( read * sizeof(cf_t) );
+          _produced_samples += read;
+          replayed_samples += read;
         }
 
-        std::chrono::microseconds sleep = (std::chrono::microseconds(required_time_us) -
-            std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - entered));
-        std::this_thread::sleep_for(sleep);
+        // Pace the replay against the start time, so sleep inaccuracies don't add up. With a replay speed
+        // of 0, samples are delivered as fast as the decoder takes them.
+        if (_replay_speed > 0) {
+          std::this_thread::sleep_until(replay_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(replayed_samples / (_sampleRate * _replay_speed))));
+        }
       } else {
         auto sdr = (SoapySDR::Device*)_sdr;
         int flags = 0;
         long long time_ns = 0;
 
-        read = sdr->readStream( (SoapySDR::Stream*)_stream, buffers.data(), std::min(writeable_samples, toRead), flags, time_ns);
+        if (_direct_access) {
+          read_direct();
+          continue;
+        }
 
+        // When resampling, the samples are read into an intermediate buffer first
+        auto samples = _resampling ? _resample_buffers.data() : buffers.data();
+        read = sdr->readStream( (SoapySDR::Stream*)_stream, _stream_cs16 ? _stream_buffers.data() : samples,
+            _resampling ? toRead : std::min(writeable_samples, toRead), flags, time_ns);
+
+        if (read > 0 && discard_stale(flags, time_ns, read)) {
+          continue;
+        }
         if (read> 0 ) {
-          auto rbuff = buffers.data();
-          
-          if (_writing_to_file) { // Only if we are going to write into a file.
-            auto wbuff = buffers_write.data();
-            for (int i = 0; i < _rx_channels; i++) {
-              memcpy(wbuff[i], rbuff[i], read * sizeof(cf_t)); // Copy the data in the input buffer to the toWrite buffer.
-            _buffer_write->commit( read * sizeof(cf_t) ); // We used another ring buffer for the written of the samples, to not block a lot we only write to the disk when the ring buffer is at 95% of its capacity
+          if (_stream_cs16) {
+            convert_stream_samples(_stream_buffers.data(), samples, read);
+          }
+          if (_resampling) {
+            auto resampled = _resampler->resample(samples, read, _resample_output.data());
+            if ((flags & SOAPY_SDR_HAS_TIME) != 0) {
+              check_timestamp(time_ns);
             }
+            _device_samples += read;
+            write_resampled(resampled);
+            continue;
           }
-          _buffer->commit( read * sizeof(cf_t) );
-    
-          if (_writing_to_file && _write_samples && _buffer_write->used_size() >= 0.95* _buffer_write->capacity()) {
-            int toWrite = _buffer_write->used_size(); // We are going to storage all the info
-            auto buff_to_write = _buffer_write->read_head(); // Gives the beggining of the buffer, it also puts _used and _head to 0, to start adding at the beggining again.
-            srsran_filesink_write_multi(&file_sink, buff_to_write.data(), toWrite, (int)_rx_channels); // From the begginin of the buffer we write used_size data
+          if ((flags & SOAPY_SDR_HAS_TIME) != 0) {
+            check_timestamp(time_ns);
           }
-              spdlog::debug("buffer: commited {}, requested {}, writeable {}, writeable_write {}, flags {}", read, toRead, writeable_samples, writeable_write_samples, flags);
+          _device_samples += read;
+
+          _buffer->commit( read * sizeof(cf_t) );
+          _produced_samples += read;
+          spdlog::trace("buffer: commited {}, requested {}, writeable {}, flags {}", read, toRead, writeable_samples, flags);
+        }
+        else if (read == SOAPY_SDR_OVERFLOW) {
+          // The driver dropped samples, we don't know how many. The next timestamp starts a new anchor.
+          _overflows++;
+          spdlog::warn("SDR overflow at sample {}", _produced_samples);
+          push_time_anchor(-1, true);
         }
         else {
           spdlog::error("readStream returned {}", read);
@@ -335,58 +618,237 @@ void SdrReader::read() {
   spdlog::debug("Sample reader thread exited");
 }
 
-auto SdrReader::get_samples(cf_t* data[SRSRAN_MAX_CHANNELS], uint32_t nsamples, //NOLINT
-                               srsran_timestamp_t *
-                               /*rx_time*/) -> int {
-  std::chrono::steady_clock::time_point entered = {};
-  entered = std::chrono::steady_clock::now();
+void SdrReader::check_timestamp(long long time_ns) {
+  if (_producer_anchor.time_ns < 0) {
+    // First timestamp of the stream, or after an overflow
+    push_time_anchor(time_ns, false);
+    return;
+  }
 
-  int64_t required_time_us = (1000000.0/_sampleRate) * nsamples;
-  size_t cnt = nsamples * sizeof(cf_t);
+  // Compare against the samples received from the SDR, so resampling and drift correction don't count as gaps
+  auto device_rate = get_device_sample_rate();
+  auto expected_ns = _producer_anchor.time_ns +
+    static_cast<long long>((_device_samples - _device_anchor_index) * 1e9 / device_rate);
+  auto gap = llround((time_ns - expected_ns) * device_rate / 1e9);
+  if (gap != 0) {
+    _gaps++;
+    if (gap > 0) {
+      _lost_samples += gap;
+    }
+    spdlog::warn("Gap of {} samples in the sample stream at sample {}", gap, _produced_samples);
+    push_time_anchor(time_ns, true);
+  }
+}
+
+void SdrReader::push_time_anchor(long long time_ns, bool discontinuity) {
+  _producer_anchor = { _produced_samples, time_ns, discontinuity };
+  _device_anchor_index = _device_samples;
+
+  auto written = _time_anchors_written.load(std::memory_order_relaxed);
+  if (written - _time_anchors_read.load(std::memory_order_acquire) >= kMaxTimeAnchors) {
+    spdlog::debug("Time anchor queue full, dropping anchor");
+    return;
+  }
+  _time_anchors[written % kMaxTimeAnchors] = _producer_anchor;
+  _time_anchors_written.store(written + 1, std::memory_order_release);
+}
 
-  if (_high_watermark_reached &&  _buffer->used_size() < (_sampleRate / 1000.0) * 10 * sizeof(cf_t)) {
-    _high_watermark_reached = false;
+void SdrReader::apply_time_anchors(uint64_t end) {
+  auto read = _time_anchors_read.load(std::memory_order_relaxed);
+  auto written = _time_anchors_written.load(std::memory_order_acquire);
+  while (read < written && _time_anchors[read % kMaxTimeAnchors].stream_index < end) {
+    _consumer_anchor = _time_anchors[read % kMaxTimeAnchors];
+    if (_consumer_anchor.discontinuity) {
+      _discontinuity = true;
+    }
+    read++;
   }
+  _time_anchors_read.store(read, std::memory_order_release);
+}
 
-  if (!_high_watermark_reached) {
-    while (_buffer->used_size() < (_sampleRate / 1000.0) * (_buffer_ms / 2.0) * sizeof(cf_t)) {
-      std::this_thread::sleep_for(std::chrono::microseconds(500));
+void SdrReader::write_resampled(size_t samples) {
+  // Copy the resampled samples into the ringbuffer, in two parts if it wraps around
+  size_t done = 0;
+  while (done < samples) {
+    size_t writeable = 0;
+    auto buffers = _buffer->write_head(&writeable);
+    auto part = std::min(writeable / sizeof(cf_t), samples - done);
+    if (part == 0) {
+      spdlog::warn("ringbuffer overflow, dropping {} samples", samples - done);
+      _overflows++;
+      push_time_anchor(-1, true);
+      break;
+    }
+
+    for (auto ch = 0; ch < _rx_channels; ch++) {
+      memcpy(buffers[ch], static_cast<cf_t*>(_resample_output[ch]) + done, part * sizeof(cf_t));
     }
-    spdlog::debug("Filled ringbuffer to half capacity");
-    _high_watermark_reached = true;
+    _buffer->commit(part * sizeof(cf_t));
+    _produced_samples += part;
+    done += part;
+  }
+}
+
+void SdrReader::read_direct() {
+  auto sdr = (SoapySDR::Device*)_sdr;
+  size_t handle = 0;
+  std::array<const void*, SRSRAN_MAX_CHANNELS> driver_buffers = { nullptr };
+  int flags = 0;
+  long long time_ns = 0;
+
+  int read = sdr->acquireReadBuffer((SoapySDR::Stream*)_stream, handle, driver_buffers.data(), flags, time_ns, 100000);
+  if (read == SOAPY_SDR_OVERFLOW) {
+    _overflows++;
+    spdlog::warn("SDR overflow at sample {}", _produced_samples);
+    push_time_anchor(-1, true);
+    return;
+  }
+  if (read <= 0) {
+    spdlog::error("acquireReadBuffer returned {}", read);
+    return;
+  }
+  if (discard_stale(flags, time_ns, read)) {
+    sdr->releaseReadBuffer((SoapySDR::Stream*)_stream, handle);
+    return;
+  }
+
+  if ((flags & SOAPY_SDR_HAS_TIME) != 0) {
+    check_timestamp(time_ns);
+  }
+  _device_samples += read;
+
+  // Copy (or convert) the samples straight from the driver's buffer into the ringbuffer. This takes
+  // two parts if the ringbuffer wraps around.
+  size_t done = 0;
+  while (done < (size_t)read) {
+    size_t writeable = 0;
+    auto buffers = _buffer->write_head(&writeable);
+    auto part = std::min(writeable / sizeof(cf_t), read - done);
+    if (part == 0) {
+      // Driver buffers can be larger than the chunk size checked against free_size() above
+      spdlog::warn("ringbuffer overflow, dropping {} samples", read - done);
+      _overflows++;
+      push_time_anchor(-1, true);
+      break;
+    }
+
+    std::array<const void*, SRSRAN_MAX_CHANNELS> src = { nullptr };
+    for (auto ch = 0; ch < _rx_channels; ch++) {
+      src[ch] = static_cast<const char*>(driver_buffers[ch]) +
+        done * (_stream_cs16 ? 2 * sizeof(int16_t) : sizeof(cf_t));
+    }
+    if (_stream_cs16) {
+      convert_stream_samples(src.data(), buffers.data(), part);
+    } else {
+      for (auto ch = 0; ch < _rx_channels; ch++) {
+        memcpy(buffers[ch], src[ch], part * sizeof(cf_t));
+      }
+    }
+
+    _buffer->commit(part * sizeof(cf_t));
+    _produced_samples += part;
+    done += part;
+  }
+
+  sdr->releaseReadBuffer((SoapySDR::Stream*)_stream, handle);
+}
+
+void SdrReader::convert_stream_samples(const void* const* stream_buffers, void* const* buffers, size_t samples) {
+  for (auto ch = 0; ch < _rx_channels; ch++) {
+    auto in = static_cast<const int16_t*>(stream_buffers[ch]);
+    auto out = static_cast<cf_t*>(buffers[ch]);
+    srsran_vec_convert_if(in, _stream_scale, reinterpret_cast<float*>(out), 2 * samples);
+    if (!_dc_removal) {
+      continue;
+    }
+
+    // Sum up the block for the next DC estimate, and subtract the offset estimated from the previous
+    // blocks, both with SIMD kernels. The offset is subtracted in pieces of kDcFillSize, so blocks of
+    // any size (e.g. driver buffers) need no allocation.
+    auto block_dc = srsran_vec_acc_cc(out, samples) / static_cast<float>(samples);
+
+    std::fill(_dc_fill.begin(), _dc_fill.end(), _dc_offset[ch]);
+    for (size_t done = 0; done < samples; done += kDcFillSize) {
+      auto part = static_cast<uint32_t>(std::min(kDcFillSize, samples - done));
+      srsran_vec_sub_ccc(out + done, _dc_fill.data(), out + done, part);
+    }
+    _dc_offset[ch] += kDcRemovalAlpha * (block_dc - _dc_offset[ch]);
+  }
+}
+
+auto SdrReader::get_samples(cf_t* data[SRSRAN_MAX_CHANNELS], uint32_t nsamples, //NOLINT
+                               srsran_timestamp_t *rx_time) -> int {
+  size_t cnt = nsamples * sizeof(cf_t);
+
+  // Block until the reader thread has committed enough samples. It wakes us up as soon as they are
+  // available, so we follow the pace of the hardware (or the sample file) directly.
+  if (!_buffer->wait_readable(cnt, std::chrono::milliseconds(_buffer_ms))) {
+    spdlog::warn("No samples received from the SDR within {} ms", _buffer_ms);
+    return SRSRAN_ERROR;
   }
 
   std::vector<char*> buffers(_rx_channels);
   for (auto ch = 0; ch < _rx_channels; ch++) {
     buffers[ch] = (char*)data[ch];
   }
-  _buffer->read(buffers, cnt); // Copy from the ringbuffer to the data array. This also decreases _used.
-
-  if (_buffer->used_size() < (_sampleRate / 1000.0) * (_buffer_ms / 4.0) * sizeof(cf_t)) {
-    required_time_us += 500;
-  } else {
-    required_time_us -= 500;
+  _buffer->read(buffers, cnt); // Copy from the ringbuffer to the data array
+
+  // Timestamp of the first sample, from the latest anchor at or before it. Anchors within this block
+  // only flag a discontinuity, they apply to the following blocks.
+  apply_time_anchors(_consumed_samples + 1);
+  if (rx_time != nullptr && _consumer_anchor.time_ns >= 0) {
+    auto time_ns = _consumer_anchor.time_ns +
+      static_cast<long long>((_consumed_samples - _consumer_anchor.stream_index) * 1e9 / _sampleRate);
+    srsran_timestamp_init(rx_time, time_ns / 1000000000, (time_ns % 1000000000) / 1e9);
   }
+  _consumed_samples += nsamples;
+  apply_time_anchors(_consumed_samples);
+
+  spdlog::trace("read {} samples, buffer level {}", nsamples, get_buffer_level());
+  return 0;
+}
 
-  spdlog::debug("took {}, read {} samples, adjusted required {} us, delta {} us, sleep adj {},  sleeping for {} us",
-      std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - entered).count(),
-      nsamples,
-      std::chrono::microseconds(required_time_us).count(),
-      std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _last_read).count(),
-      _sleep_adjustment,
-      (std::chrono::microseconds(_sleep_adjustment + required_time_us) - std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _last_read)).count());
+auto SdrReader::annotate_tti(uint32_t tti, uint64_t stream_end, const srsran_cell_t& cell) -> bool {
+  auto subframe_samples = static_cast<uint64_t>(round(_sampleRate / 1000.0));
+  if (!_writing_to_file || !_write_samples || stream_end < subframe_samples) {
+    return false;
+  }
+  return _sample_file_writer->annotate(stream_end - subframe_samples, tti, cell);
+}
 
-  std::chrono::microseconds sleep = (std::chrono::microseconds(_sleep_adjustment + required_time_us) - std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _last_read));
+auto SdrReader::seek_sample_file(double seconds) -> bool {
+  if (!_reading_from_file || seconds < 0) {
+    return false;
+  }
+  uint64_t sample = 0;
+  if (!_sample_file_source->has_metadata() || !_sample_file_source->metadata().sample_for_time(seconds, sample)) {
+    sample = static_cast<uint64_t>(seconds * _sampleRate);
+  }
+  spdlog::info("Seeking to {} s, sample {}", seconds, sample);
+  return _sample_file_source->seek(sample);
+}
 
-  if (sleep.count() > 0) {
-    std::this_thread::sleep_for(sleep);
-    _sleep_adjustment = 0;
-  } else if (sleep.count() > -100000) {
-    _sleep_adjustment = sleep.count();
+auto SdrReader::seek_sample_file_tti(uint32_t tti) -> bool {
+  uint64_t sample = 0;
+  if (!_reading_from_file || !_sample_file_source->has_metadata() ||
+      !_sample_file_source->metadata().sample_for_tti(tti, sample)) {
+    spdlog::error("The sample file has no TTI index for TTI {}", tti);
+    return false;
   }
 
-  _last_read = std::chrono::steady_clock::now();
-  return 0;
+  // Start one radio frame early, so the PHY is synchronized when the requested subframe arrives
+  auto frame_samples = static_cast<uint64_t>(_sampleRate / 100.0);
+  sample = sample > frame_samples ? sample - frame_samples : 0;
+  spdlog::info("Seeking to TTI {}, sample {}", tti, sample);
+  return _sample_file_source->seek(sample);
+}
+
+auto SdrReader::sample_file_cell(srsran_cell_t& cell) -> bool {
+  return _reading_from_file && _sample_file_source->has_metadata() && _sample_file_source->metadata().cell(cell);
+}
+
+auto SdrReader::sample_file_rate() -> double {
+  return (_reading_from_file && _sample_file_source->has_metadata()) ? _sample_file_source->metadata().sample_rate() : 0;
 }
 
 auto SdrReader::get_buffer_level() -> double
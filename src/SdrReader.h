@@ -19,6 +19,9 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 #include <thread>
@@ -26,7 +29,11 @@
 #include <cstdint>
 #include <libconfig.h++>
 #include "srsran/srsran.h"
+#include "FractionalResampler.h"
 #include "MultichannelRingbuffer.h"
+#include "SampleFileSource.h"
+#include "SampleFileWriter.h"
+#include "ThreadPlacement.h"
 
 /**
  *  Interface to the SDR stick.
@@ -56,8 +63,17 @@ public:
 
     /**
      * Initializes the SDR interface and creates a ring buffer according to the params from Cfg.
+     *
+     * If a sample file is passed, samples are read from the file instead of the SDR. If the name of a
+     * shared memory segment is passed, the samples published there by a modem-ingest process are read.
      */
-    bool init(const std::string &device_args, const char *sample_file, const char *write_sample_file, bool repeat_sample_file);
+    bool init(const std::string &device_args, const char *sample_file, const char *shared_memory,
+        const char *write_sample_file, SampleFormat write_sample_format, bool repeat_sample_file, double replay_speed);
+
+    /**
+     * Pin the reader thread (and the sample file writer thread) to the CPUs configured for them
+     */
+    void set_thread_placement(ThreadPlacement* placement) { _thread_placement = placement; }
 
     /**
      * Tune the SDR to the desired frequency, and set gain, filter and antenna parameters.
@@ -75,6 +91,16 @@ public:
      */
     void stop();
 
+    /**
+     * Change the tuning while the SDR is running.
+     *
+     * Frequency, gain, filter bandwidth and antenna are changed on the live stream, and the samples
+     * received with the old settings are discarded. Only if the sample rate changes, the stream is
+     * stopped and restarted (see tune()). If the SDR is not running, this is the same as tune().
+     */
+    bool retune(uint32_t frequency, uint32_t sample_rate, uint32_t bandwidth, double gain, const std::string &antenna,
+              bool use_agc);
+
     /**
      * Clear all samples from the rx buffers
      */
@@ -94,6 +120,35 @@ public:
      */
     double get_sample_rate() { return _sampleRate; }
 
+    /**
+     * Get the sample rate the SDR actually delivers. If it differs from get_sample_rate(), the samples
+     * are resampled to get_sample_rate() before they are written to the ringbuffer.
+     */
+    double get_device_sample_rate() { return _resampling ? _device_sample_rate : _sampleRate; }
+
+    /**
+     * Average CPU time spent in the resampler per sample, in nanoseconds. 0 if not resampling.
+     */
+    double get_resampler_ns_per_sample() { return _resampling ? _resampler->ns_per_sample() : 0.0; }
+
+    /**
+     * Correct the resampling ratio for a drifting SDR clock. Takes effect with the next block read
+     * from the SDR. Only has an effect if drift compensation is enabled.
+     *
+     * @param ppm Deviation of the SDR's sample clock from the transmitter's, in ppm
+     */
+    void set_rate_correction(double ppm) { _rate_correction_ppm = ppm; }
+
+    /**
+     * Currently applied sample clock correction, in ppm
+     */
+    double get_rate_correction() { return _rate_correction_ppm; }
+
+    /**
+     * True if drift compensation is enabled
+     */
+    bool drift_compensation() { return _drift_compensation; }
+
     /**
      * Get current center frequency
      */
@@ -131,12 +186,84 @@ public:
     /**
      * If sample file creation is enabled, writing samples starts after this call
      */
-    void enableSampleFileWriting() { _write_samples = true; }
+    void enableSampleFileWriting() {
+      _write_samples = true;
+      if (_writing_to_file) {
+        _sample_file_writer->set_enabled(true);
+      }
+    }
 
     /**
      * If sample file creation is enabled, writing samples stops after this call
      */
-    void disableSampleFileWriting() { _write_samples = false; }
+    void disableSampleFileWriting() {
+      _write_samples = false;
+      if (_writing_to_file) {
+        _sample_file_writer->set_enabled(false);
+      }
+    }
+
+    /**
+     * Number of samples that could not be written to the sample file because the disk did not keep up
+     */
+    uint64_t get_sample_file_dropped() { return _writing_to_file ? _sample_file_writer->dropped_samples() : 0; }
+
+    /**
+     * Number of overflows reported by the SDR driver
+     */
+    unsigned get_overflows() { return _overflows; }
+
+    /**
+     * Number of gaps detected in the hardware timestamps of the sample stream
+     */
+    unsigned get_gaps() { return _gaps; }
+
+    /**
+     * Number of samples lost in gaps of the sample stream, as far as they could be determined from the timestamps
+     */
+    uint64_t get_lost_samples() { return _lost_samples; }
+
+    /**
+     * Returns true (once) if samples returned by get_samples() since the last call were not contiguous,
+     * because the SDR dropped samples. The receiver should resynchronize.
+     */
+    bool take_discontinuity() { return _discontinuity.exchange(false); }
+
+    /**
+     * Number of samples returned by get_samples() since start(), i.e. the stream index of the next sample
+     */
+    uint64_t consumed_samples() const { return _consumed_samples.load(std::memory_order_acquire); }
+
+    /**
+     * Record in the sample file metadata that the subframe with the passed TTI ends at the passed stream
+     * index (see consumed_samples()).
+     *
+     * Returns false if the subframe is not part of the sample file, e.g. because writing is disabled.
+     */
+    bool annotate_tti(uint32_t tti, uint64_t stream_end, const srsran_cell_t& cell);
+
+    /**
+     * Continue reading the sample file at the passed time, in seconds from the start of the recording
+     */
+    bool seek_sample_file(double seconds);
+
+    /**
+     * Continue reading the sample file shortly before the first subframe with the passed TTI.
+     * Requires the TTI index from the sample file metadata.
+     */
+    bool seek_sample_file_tti(uint32_t tti);
+
+    /**
+     * Get the cell parameters recorded in the sample file metadata
+     *
+     * Returns false if they are not available
+     */
+    bool sample_file_cell(srsran_cell_t& cell);
+
+    /**
+     * Sample rate recorded in the sample file metadata, 0 if unknown
+     */
+    double sample_file_rate();
 
 private:
     void init_buffer();
@@ -153,13 +280,27 @@ private:
 
     void read();
 
+    void read_direct();
+
+    bool discard_stale(int flags, long long time_ns, size_t samples);
+
+    void write_resampled(size_t samples);
+
+    void convert_stream_samples(const void* const* stream_buffers, void* const* buffers, size_t samples);
+
+    void check_timestamp(long long time_ns);
+
+    void push_time_anchor(long long time_ns, bool discontinuity);
+
+    void apply_time_anchors(uint64_t end);
+
     void *_sdr = nullptr;
     void *_stream = nullptr;
 
     const libconfig::Config &_cfg;
 
     std::unique_ptr<MultichannelRingbuffer> _buffer;
-    std::unique_ptr<MultichannelRingbuffer> _buffer_write;
+    size_t _buffer_bytes = 0;
 
     std::thread _readerThread;
     bool _running;
@@ -173,25 +314,80 @@ private:
     double _min_gain;
     double _max_gain;
     std::string _antenna;
-    unsigned _overflows;
+    std::atomic<unsigned> _overflows;
     unsigned _underflows;
+    std::atomic<unsigned> _gaps = { 0 };
+    std::atomic<uint64_t> _lost_samples = { 0 };
 
     cf_t *_read_buffer;
 
-    srsran_filesource_t file_source;
-    srsran_filesink_t file_sink;
-
-    std::chrono::steady_clock::time_point _last_read;
-
-    bool _high_watermark_reached = false;
-    int _sleep_adjustment = 0;
+    std::unique_ptr<SampleSource> _sample_file_source;
+    std::unique_ptr<SampleFileWriter> _sample_file_writer;
+    ThreadPlacement* _thread_placement = nullptr;
+
+    // Samples written to / read from the ringbuffer since start()
+    uint64_t _produced_samples = 0;
+    std::atomic<uint64_t> _consumed_samples = { 0 };
+
+    // Samples received from the SDR since start(). Differs from _produced_samples when resampling.
+    uint64_t _device_samples = 0;
+    uint64_t _device_anchor_index = 0;  // _device_samples at the time of _producer_anchor
+
+    // Hardware timestamps, passed from the reader thread to get_samples() alongside the samples.
+    // An anchor gives the time of one sample in the stream, the following samples are spaced at the
+    // sample rate until the next anchor. New anchors are only needed after a discontinuity.
+    struct TimeAnchor {
+      uint64_t stream_index;
+      long long time_ns;   // -1 if unknown
+      bool discontinuity;
+    };
+    static const size_t kMaxTimeAnchors = 64;
+    std::array<TimeAnchor, kMaxTimeAnchors> _time_anchors = {};
+    std::atomic<size_t> _time_anchors_written = { 0 };
+    std::atomic<size_t> _time_anchors_read = { 0 };
+    TimeAnchor _producer_anchor = { 0, -1, false };  // reader thread
+    TimeAnchor _consumer_anchor = { 0, -1, false };  // get_samples() caller
+    std::atomic<bool> _discontinuity = { false };
+
+    bool _stream_cs16 = false;
+    float _stream_scale = 1.0;
+    bool _dc_removal = false;
+    std::vector<void*> _stream_buffers;
+    size_t _read_chunk = 0;
+    bool _use_direct_access = false;
+    bool _direct_access = false;
+
+    // Conversion from the rate the SDR delivers to the requested rate
+    bool _resample_enabled = true;
+    bool _resampling = false;
+    double _device_sample_rate = 0;
+    double _base_ratio = 1.0;
+    bool _drift_compensation = false;
+    std::atomic<double> _rate_correction_ppm = { 0.0 };
+
+    // In-place retuning. The reader thread drops the samples received before the new settings took effect:
+    // up to a hardware time if the stream has timestamps, or else a number of samples.
+    uint32_t _requested_sample_rate = 0;
+    unsigned _retune_settle_us = 2000;
+    std::atomic<bool> _discard_pending = { false };
+    std::atomic<long long> _discard_until_ns = { -1 };
+    std::atomic<uint64_t> _discard_samples = { 0 };
+    std::atomic<unsigned> _retune_generation = { 0 };
+    std::atomic<unsigned> _reader_generation = { 0 };
+    std::unique_ptr<FractionalResampler> _resampler;
+    std::vector<void*> _resample_buffers;
+    std::vector<void*> _resample_output;
+    std::vector<cf_t> _dc_offset;
+    std::vector<cf_t> _dc_fill;  // the current channel's DC offset, repeated for srsran_vec_sub_ccc
 
     unsigned _buffer_ms = 200;
+    bool _buffer_mirrored = true;
     bool _buffer_ready = false;
     bool _reading_from_file = false;
     bool _writing_to_file = false;
-    bool _write_samples = false;
+    std::atomic<bool> _write_samples = { false };
     bool _repeat_sample_file = false;
+    double _replay_speed = 1.0;
 
     uint32_t _rssi = 0;
 
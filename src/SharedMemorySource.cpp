@@ -0,0 +1,97 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "SharedMemorySource.h"
+
+#include <thread>
+
+#include "spdlog/spdlog.h"
+
+SharedMemorySource::SharedMemorySource(unsigned channels)
+  : _channels(channels)
+{
+}
+
+auto SharedMemorySource::open(const std::string& name) -> bool {
+  _name = name;
+  if (!attach()) {
+    spdlog::error("Could not attach to shared memory segment {}. Is modem-ingest running?", name);
+    return false;
+  }
+  return true;
+}
+
+auto SharedMemorySource::attach() -> bool {
+  auto ring = SharedSampleRing::attach(_name);
+  if (!ring) {
+    return false;
+  }
+  if (ring->channels() < _channels) {
+    spdlog::error("Shared memory segment {} has {} channel(s), {} are needed", _name, ring->channels(), _channels);
+    return false;
+  }
+  if (_ring && ring->sample_rate() != _ring->sample_rate()) {
+    // The modem has been configured for the old rate, keep waiting for a matching ring
+    spdlog::error("Shared memory segment {} changed its sample rate to {} MHz, ignoring it", _name,
+        ring->sample_rate() / 1000000.0);
+    return false;
+  }
+
+  if (_ring) {
+    _lost_samples += _ring->lost_samples();
+  } else {
+    _metadata.set_format(SampleFormat::CF32, _channels, 1.0);
+    _metadata.add_capture(0, ring->sample_rate(), ring->frequency(), 0);
+  }
+  spdlog::info("Attached to shared memory segment {}: {} MHz at {} MHz", _name,
+      ring->sample_rate() / 1000000.0, ring->frequency() / 1000000.0);
+  _ring = std::move(ring);
+  return true;
+}
+
+auto SharedMemorySource::read(void* const* buffers, size_t samples) -> int {
+  if (_ring->closed()) {
+    return 0;
+  }
+  if (!_ring->read(reinterpret_cast<cf_t* const*>(buffers), samples, _time_ns, std::chrono::milliseconds(100))) {
+    return 0;
+  }
+  return static_cast<int>(samples);
+}
+
+void SharedMemorySource::rewind() {
+  // Called after read() has timed out. A writer that crashed and has been restarted has closed our
+  // segment in the meantime, one that couldn't has at least replaced its name.
+  if (!_ring->closed() && !_ring->replaced()) {
+    _ring->skip_to_live();
+    return;
+  }
+
+  // Called again by the reader thread as long as read() returns 0, so it can still be stopped meanwhile
+  if (!_waiting) {
+    spdlog::warn("Shared memory segment {} has been closed or replaced, waiting for modem-ingest to restart", _name);
+    _waiting = true;
+  }
+  if (attach()) {
+    _waiting = false;
+  } else {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
@@ -0,0 +1,92 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "SampleSource.h"
+#include "SharedSampleRing.h"
+
+/**
+ *  Reads the samples published by a modem-ingest process through a SharedSampleRing.
+ *
+ *  The stream is live: reading starts at the most recent sample, and the hardware timestamps of
+ *  the ingest process are passed on, so gaps (e.g. after this process has fallen behind) are
+ *  detected like SDR overflows. If the ingest process is restarted, the new ring is attached
+ *  automatically.
+ */
+class SharedMemorySource : public SampleSource {
+ public:
+    /**
+     *  Default constructor.
+     *
+     *  @param channels Number of RX channels to read
+     */
+    explicit SharedMemorySource(unsigned channels);
+
+    /**
+     *  Attach to the ring with the passed name
+     */
+    bool open(const std::string& name);
+
+    /**
+     *  Read samples from the ring, waiting up to 100 ms for them
+     *
+     *  @return Number of samples per channel that have been read, 0 on timeout or if the ring has been closed
+     */
+    int read(void* const* buffers, size_t samples) override;
+
+    /**
+     *  Continue with the most recent sample, re-attaching to the ring if it has been closed
+     */
+    void rewind() override;
+
+    /**
+     *  A live stream can't be seeked
+     */
+    bool seek(uint64_t /*sample*/) override { return false; }
+
+    /**
+     *  The sample rate of the ring is always known
+     */
+    bool has_metadata() override { return true; }
+
+    const SampleFileMetadata& metadata() override { return _metadata; }
+
+    long long time_ns() override { return _time_ns; }
+
+    /**
+     *  Number of samples lost because the ring has been overwritten before they could be read
+     */
+    uint64_t lost_samples() const { return _lost_samples + (_ring ? _ring->lost_samples() : 0); }
+
+ private:
+    bool attach();
+
+    unsigned _channels;
+    std::string _name;
+    std::unique_ptr<SharedSampleRing> _ring;
+    SampleFileMetadata _metadata;
+    long long _time_ns = -1;
+    uint64_t _lost_samples = 0;
+    bool _waiting = false;
+};
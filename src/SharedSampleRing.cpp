@@ -0,0 +1,355 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "SharedSampleRing.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+namespace {
+const char kMagic[8] = "5GMRTIQ";
+const uint32_t kVersion = 2;
+const size_t kHeaderSize = 4096;
+const uint32_t kMaxAnchors = 128;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory atomics must be lock free");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared memory atomics must be lock free");
+
+auto futex_wait(std::atomic<uint32_t>* word, uint32_t expected, std::chrono::nanoseconds timeout) -> void {
+  struct timespec ts = {};
+  ts.tv_sec = timeout.count() / 1000000000;
+  ts.tv_nsec = timeout.count() % 1000000000;
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+auto futex_wake_all(std::atomic<uint32_t>* word) -> void {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+auto shm_path(const std::string& name) -> std::string {
+  return "/" + name;
+}
+}  // namespace
+
+struct SharedSampleRing::Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t channels;
+  uint64_t capacity;
+  double sample_rate;
+  double frequency;
+
+  std::atomic<uint64_t> write_pos;  // samples per channel written since the ring has been created
+  std::atomic<uint64_t> max_write;  // largest write, raised before the samples are copied
+  std::atomic<uint32_t> wake_seq;   // futex word, bumped on every write
+  std::atomic<uint32_t> waiters;
+  std::atomic<uint32_t> closed;
+
+  // Timestamps are published as anchors: the stream is contiguous from one anchor to the next. Anchor n
+  // is written to slot n % kMaxAnchors before anchors_written is raised to n + 1.
+  std::atomic<uint64_t> anchors_written;
+  struct Anchor {
+    std::atomic<uint64_t> stream_index;
+    std::atomic<int64_t> time_ns;
+  } anchors[kMaxAnchors];
+};
+
+auto SharedSampleRing::create(const std::string& name, unsigned channels, size_t capacity,
+    double sample_rate, double frequency) -> std::unique_ptr<SharedSampleRing> {
+  static_assert(sizeof(Header) <= kHeaderSize, "shared ring header too large");
+
+  // Readers of a previous writer keep their mapping until they notice it has been closed. A writer that
+  // crashed never closed it, so do that on its behalf before replacing the name.
+  close_stale(name);
+  shm_unlink(shm_path(name).c_str());
+  auto fd = shm_open(shm_path(name).c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+  if (fd < 0) {
+    spdlog::error("Could not create shared memory segment {}: {}", name, strerror(errno));
+    return nullptr;
+  }
+
+  auto segment_size = kHeaderSize + channels * capacity * sizeof(cf_t);
+  void* segment = MAP_FAILED;
+  if (ftruncate(fd, segment_size) == 0) {
+    segment = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (segment == MAP_FAILED) {
+    spdlog::error("Could not map shared memory segment {}: {}", name, strerror(errno));
+    shm_unlink(shm_path(name).c_str());
+    return nullptr;
+  }
+
+  auto header = new (segment) Header();
+  header->version = kVersion;
+  header->channels = channels;
+  header->capacity = capacity;
+  header->sample_rate = sample_rate;
+  header->frequency = frequency;
+  // The magic is written last, readers ignore the segment until then
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(header->magic, kMagic, sizeof(kMagic));
+
+  spdlog::info("Publishing {} channel(s) at {} MHz in shared memory segment {}, {} ms deep", channels,
+      sample_rate / 1000000.0, name, capacity * 1000 / sample_rate);
+  return std::unique_ptr<SharedSampleRing>(new SharedSampleRing(name, segment, segment_size, true));
+}
+
+void SharedSampleRing::close_stale(const std::string& name) {
+  auto fd = shm_open(shm_path(name).c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    return;
+  }
+  struct stat segment_stat = {};
+  void* segment = MAP_FAILED;
+  if (fstat(fd, &segment_stat) == 0 && static_cast<size_t>(segment_stat.st_size) >= kHeaderSize) {
+    segment = mmap(nullptr, kHeaderSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (segment == MAP_FAILED) {
+    return;
+  }
+
+  auto header = static_cast<Header*>(segment);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 && header->version == kVersion &&
+      header->closed.load(std::memory_order_acquire) == 0) {
+    spdlog::warn("Shared memory segment {} has not been closed by its previous writer", name);
+    header->closed.store(1, std::memory_order_release);
+    header->wake_seq.fetch_add(1, std::memory_order_release);
+    futex_wake_all(&header->wake_seq);
+  }
+  munmap(segment, kHeaderSize);
+}
+
+auto SharedSampleRing::attach(const std::string& name) -> std::unique_ptr<SharedSampleRing> {
+  auto fd = shm_open(shm_path(name).c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    spdlog::debug("Could not open shared memory segment {}: {}", name, strerror(errno));
+    return nullptr;
+  }
+
+  struct stat segment_stat = {};
+  void* segment = MAP_FAILED;
+  if (fstat(fd, &segment_stat) == 0 && static_cast<size_t>(segment_stat.st_size) >= kHeaderSize) {
+    segment = mmap(nullptr, segment_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (segment == MAP_FAILED) {
+    spdlog::debug("Could not map shared memory segment {}", name);
+    return nullptr;
+  }
+
+  auto header = static_cast<Header*>(segment);
+  auto valid = memcmp(header->magic, kMagic, sizeof(kMagic)) == 0;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!valid || header->version != kVersion ||
+      kHeaderSize + header->channels * header->capacity * sizeof(cf_t) > static_cast<size_t>(segment_stat.st_size)) {
+    spdlog::debug("Shared memory segment {} is not (yet) a valid sample ring", name);
+    munmap(segment, segment_stat.st_size);
+    return nullptr;
+  }
+
+  auto ring = std::unique_ptr<SharedSampleRing>(new SharedSampleRing(name, segment, segment_stat.st_size, false));
+  ring->_device = segment_stat.st_dev;
+  ring->_inode = segment_stat.st_ino;
+  ring->skip_to_live();
+  return ring;
+}
+
+SharedSampleRing::SharedSampleRing(std::string name, void* segment, size_t segment_size, bool writer)
+  : _name(std::move(name))
+  , _segment(segment)
+  , _segment_size(segment_size)
+  , _writer(writer)
+  , _header(static_cast<Header*>(segment))
+{
+}
+
+SharedSampleRing::~SharedSampleRing() {
+  if (_writer) {
+    _header->closed.store(1, std::memory_order_release);
+    _header->wake_seq.fetch_add(1, std::memory_order_release);
+    futex_wake_all(&_header->wake_seq);
+    shm_unlink(shm_path(_name).c_str());
+  }
+  munmap(_segment, _segment_size);
+}
+
+auto SharedSampleRing::channel_data(unsigned ch) const -> cf_t* {
+  return reinterpret_cast<cf_t*>(static_cast<char*>(_segment) + kHeaderSize) + ch * _header->capacity;
+}
+
+void SharedSampleRing::write(const cf_t* const* buffers, size_t samples, long long time_ns) {
+  auto pos = _header->write_pos.load(std::memory_order_relaxed);
+
+  // Only publish a new anchor if the timestamp doesn't follow from the previous one. Without hardware
+  // timestamps, the time is counted from the first sample.
+  auto anchors = _header->anchors_written.load(std::memory_order_relaxed);
+  bool new_anchor = anchors == 0;
+  if (!new_anchor && time_ns >= 0) {
+    auto& last = _header->anchors[(anchors - 1) % kMaxAnchors];
+    auto expected_ns = last.time_ns.load(std::memory_order_relaxed) +
+      static_cast<int64_t>((pos - last.stream_index.load(std::memory_order_relaxed)) * 1e9 / _header->sample_rate);
+    new_anchor = std::llabs(time_ns - expected_ns) * _header->sample_rate > 0.5e9;
+  }
+  if (new_anchor) {
+    auto& anchor = _header->anchors[anchors % kMaxAnchors];
+    anchor.stream_index.store(pos, std::memory_order_relaxed);
+    anchor.time_ns.store(time_ns >= 0 ? time_ns : static_cast<int64_t>(pos * 1e9 / _header->sample_rate),
+        std::memory_order_relaxed);
+    _header->anchors_written.store(anchors + 1, std::memory_order_release);
+  }
+
+  // Readers check their copies against write_pos + max_write, so raise it before overwriting anything
+  if (samples > _header->max_write.load(std::memory_order_relaxed)) {
+    _header->max_write.store(samples, std::memory_order_relaxed);
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  // Copy in two parts if the ring wraps around
+  size_t done = 0;
+  while (done < samples) {
+    auto offset = (pos + done) % _header->capacity;
+    auto part = std::min(samples - done, static_cast<size_t>(_header->capacity - offset));
+    for (unsigned ch = 0; ch < _header->channels; ch++) {
+      memcpy(channel_data(ch) + offset, buffers[ch] + done, part * sizeof(cf_t));
+    }
+    done += part;
+  }
+
+  _header->write_pos.store(pos + samples, std::memory_order_release);
+  _header->wake_seq.fetch_add(1, std::memory_order_release);
+  if (_header->waiters.load(std::memory_order_acquire) > 0) {
+    futex_wake_all(&_header->wake_seq);
+  }
+}
+
+auto SharedSampleRing::read(cf_t* const* buffers, size_t samples, long long& time_ns,
+    std::chrono::milliseconds timeout) -> bool {
+  auto capacity = _header->capacity;
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  for (;;) {
+    if (closed()) {
+      return false;
+    }
+    auto seq = _header->wake_seq.load(std::memory_order_acquire);
+    auto write_pos = _header->write_pos.load(std::memory_order_acquire);
+    if (write_pos - _read_pos > capacity) {
+      // Overtaken by the writer. Continue with the live stream, the timestamps will show the gap.
+      _lost_samples += write_pos - _read_pos;
+      _read_pos = write_pos;
+    }
+
+    if (write_pos - _read_pos >= samples) {
+      size_t done = 0;
+      while (done < samples) {
+        auto offset = (_read_pos + done) % capacity;
+        auto part = std::min(samples - done, static_cast<size_t>(capacity - offset));
+        for (unsigned ch = 0; ch < _header->channels; ch++) {
+          memcpy(buffers[ch] + done, channel_data(ch) + offset, part * sizeof(cf_t));
+        }
+        done += part;
+      }
+
+      // If the writer has wrapped around into the copied region meanwhile, the copy is torn. A write that
+      // is still in progress may already have overwritten up to max_write samples past write_pos.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      auto written = _header->write_pos.load(std::memory_order_relaxed) + _header->max_write.load(std::memory_order_relaxed);
+      if (written <= _read_pos + capacity) {
+        time_ns = time_for(_read_pos);
+        _read_pos += samples;
+        return true;
+      }
+      continue;
+    }
+
+    auto remaining = deadline - std::chrono::steady_clock::now();
+    if (remaining <= std::chrono::nanoseconds::zero()) {
+      return false;
+    }
+    _header->waiters.fetch_add(1, std::memory_order_acq_rel);
+    futex_wait(&_header->wake_seq, seq, remaining);
+    _header->waiters.fetch_sub(1, std::memory_order_acq_rel);
+  }
+}
+
+auto SharedSampleRing::time_for(uint64_t stream_index) const -> long long {
+  for (;;) {
+    auto anchors = _header->anchors_written.load(std::memory_order_acquire);
+    auto oldest = anchors > kMaxAnchors ? anchors - kMaxAnchors : 0;
+    bool torn = false;
+    for (auto i = anchors; i > oldest; i--) {
+      const auto& anchor = _header->anchors[(i - 1) % kMaxAnchors];
+      auto index = anchor.stream_index.load(std::memory_order_relaxed);
+      auto time_ns = anchor.time_ns.load(std::memory_order_relaxed);
+
+      // The slot of anchor i - 1 is overwritten once anchor i - 1 + kMaxAnchors is being written. The
+      // newer slots read before it are overwritten even later, so they are valid if this one is.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (_header->anchors_written.load(std::memory_order_relaxed) >= i - 1 + kMaxAnchors) {
+        torn = true;
+        break;
+      }
+      if (index <= stream_index) {
+        return time_ns + static_cast<long long>((stream_index - index) * 1e9 / _header->sample_rate);
+      }
+    }
+    if (!torn) {
+      return -1;
+    }
+  }
+}
+
+void SharedSampleRing::skip_to_live() {
+  _read_pos = _header->write_pos.load(std::memory_order_acquire);
+}
+
+auto SharedSampleRing::closed() const -> bool {
+  return _header->closed.load(std::memory_order_acquire) != 0;
+}
+
+auto SharedSampleRing::replaced() const -> bool {
+  // If the name is gone, the writer has died without a successor yet, keep waiting on this segment
+  auto fd = shm_open(shm_path(_name).c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat segment_stat = {};
+  auto result = fstat(fd, &segment_stat) == 0 &&
+    (segment_stat.st_dev != _device || segment_stat.st_ino != _inode);
+  close(fd);
+  return result;
+}
+
+auto SharedSampleRing::channels() const -> unsigned { return _header->channels; }
+auto SharedSampleRing::capacity() const -> size_t { return _header->capacity; }
+auto SharedSampleRing::sample_rate() const -> double { return _header->sample_rate; }
+auto SharedSampleRing::frequency() const -> double { return _header->frequency; }
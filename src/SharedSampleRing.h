@@ -0,0 +1,141 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <sys/types.h>
+
+#include "srsran/srsran.h"
+
+/**
+ *  A ring of I/Q samples in POSIX shared memory, written by one process and read by any number of others.
+ *
+ *  The writer (modem-ingest) owns the SDR and publishes the received samples together with their
+ *  hardware timestamps. Readers attach to the ring by name and read from it directly, each at its own
+ *  position. A reader that falls behind by more than the ring capacity loses samples, which it sees as
+ *  a gap in the timestamps; the writer is never slowed down by its readers.
+ *
+ *  Readers sleep on a futex in the shared segment until new samples have been committed. If the
+ *  writer restarts, it closes the old segment (on behalf of its predecessor, if that has crashed) and
+ *  creates a new one under the same name, and readers re-attach to it.
+ *
+ *  Layout of the segment: a header page, followed by one area of capacity() samples per channel.
+ */
+class SharedSampleRing {
+ public:
+    /**
+     *  Create the segment and take the writer role. An existing segment with the same name is marked as
+     *  closed and replaced.
+     *
+     *  @param name Name of the segment (without the leading /)
+     *  @param channels Number of channels
+     *  @param capacity Ring size in samples per channel
+     *  @param sample_rate Sample rate of the published stream
+     *  @param frequency Center frequency of the published stream
+     *  @return nullptr on failure
+     */
+    static std::unique_ptr<SharedSampleRing> create(const std::string& name, unsigned channels, size_t capacity,
+        double sample_rate, double frequency);
+
+    /**
+     *  Attach to an existing segment as a reader. Reading starts at the most recent sample.
+     *
+     *  @return nullptr if the segment does not exist or is not valid
+     */
+    static std::unique_ptr<SharedSampleRing> attach(const std::string& name);
+
+    /**
+     *  Default destructor. Unmaps the segment. The writer marks the ring as closed and removes its name.
+     */
+    virtual ~SharedSampleRing();
+
+    /**
+     *  Writer: publish samples and wake up the readers.
+     *
+     *  @param buffers Source buffer for each channel
+     *  @param samples Number of samples per channel
+     *  @param time_ns Hardware time of the first sample, or -1 if unknown
+     */
+    void write(const cf_t* const* buffers, size_t samples, long long time_ns);
+
+    /**
+     *  Reader: copy the next samples into the passed buffers, waiting for them if necessary.
+     *
+     *  @param buffers Destination buffer for each channel
+     *  @param samples Number of samples per channel
+     *  @param time_ns Set to the hardware time of the first sample, or -1 if unknown
+     *  @param timeout Maximum time to wait for the samples
+     *  @return false on timeout, or if the writer has closed the ring
+     */
+    bool read(cf_t* const* buffers, size_t samples, long long& time_ns, std::chrono::milliseconds timeout);
+
+    /**
+     *  Reader: skip to the most recent sample
+     */
+    void skip_to_live();
+
+    /**
+     *  Reader: true if the writer has closed the ring (e.g. it has been restarted)
+     */
+    bool closed() const;
+
+    /**
+     *  Reader: true if the name now refers to another segment than the attached one, i.e. a new writer
+     *  has taken over without being able to close this one (e.g. a different version of modem-ingest)
+     */
+    bool replaced() const;
+
+    unsigned channels() const;
+    size_t capacity() const;
+    double sample_rate() const;
+    double frequency() const;
+
+    /**
+     *  Reader: number of samples lost because this reader fell behind
+     */
+    uint64_t lost_samples() const { return _lost_samples; }
+
+ private:
+    struct Header;
+
+    SharedSampleRing(std::string name, void* segment, size_t segment_size, bool writer);
+
+    static void close_stale(const std::string& name);
+
+    cf_t* channel_data(unsigned ch) const;
+    long long time_for(uint64_t stream_index) const;
+
+    std::string _name;
+    void* _segment;
+    size_t _segment_size;
+    bool _writer;
+    Header* _header;
+    dev_t _device = 0;
+    ino_t _inode = 0;
+
+    uint64_t _read_pos = 0;
+    uint64_t _lost_samples = 0;
+};
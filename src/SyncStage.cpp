@@ -0,0 +1,169 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "SyncStage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include "spdlog/spdlog.h"
+
+SyncStage::SyncStage(const libconfig::Config& cfg, Phy& phy, SdrReader& sdr, unsigned rx_channels, uint32_t buffer_size,
+    uint32_t history)
+  : _cfg(cfg)
+  , _phy(phy)
+  , _sdr(sdr)
+  , _rx_channels(rx_channels)
+  , _buffer_size(buffer_size)
+  , _history(history)
+{
+  _cfg.lookupValue("modem.phy.sync_queue_subframes", _depth);
+  _depth = std::max(_depth, 1U);
+}
+
+SyncStage::~SyncStage() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _quit = true;
+    _running = false;
+  }
+  _cv.notify_all();
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+  for (auto& subframe : _queue) {
+    for (auto buffer : subframe.buffer) {
+      if (buffer != nullptr) {
+        free(buffer - _history);
+      }
+    }
+  }
+}
+
+void SyncStage::launch(ThreadPlacement* placement) {
+  _queue.resize(_depth);
+  for (auto& subframe : _queue) {
+    memset(&subframe, 0, sizeof(subframe));
+    for (unsigned ch = 0; ch < _rx_channels; ch++) {
+      subframe.buffer[ch] = srsran_vec_cf_malloc(_history + _buffer_size) + _history;
+    }
+  }
+
+  _thread = std::thread{&SyncStage::run, this};
+
+  // Same priority as the main thread, this is the part of its work that can't wait
+  struct sched_param thread_param = {};
+  thread_param.sched_priority = 20;
+  _cfg.lookupValue("modem.phy.main_thread_priority_rt", thread_param.sched_priority);
+  spdlog::info("Launching sync thread with realtime scheduling priority {}, {} subframe queue",
+      thread_param.sched_priority, _depth);
+  int error = pthread_setschedparam(_thread.native_handle(), SCHED_RR, &thread_param);
+  if (error != 0) {
+    spdlog::error("Cannot set sync thread priority to realtime: {}. Thread will run at default priority.", strerror(error));
+  }
+  if (placement != nullptr) {
+    placement->place(ThreadPlacement::ThreadClass::Main, _thread.native_handle(), "sync");
+  }
+}
+
+void SyncStage::start() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _running = true;
+  }
+  _cv.notify_all();
+}
+
+void SyncStage::stop() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _running = false;
+  _cv.wait(lock, [this] { return !_busy; });
+  _read_idx = _write_idx = _queued = 0;
+  _contiguous = false;
+  _cv.notify_all();
+}
+
+auto SyncStage::next() -> const Subframe& {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cv.wait(lock, [this] { return _queued > 0; });
+  return _queue[_read_idx];
+}
+
+void SyncStage::release() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _read_idx = (_read_idx + 1) % _depth;
+    _queued--;
+  }
+  _cv.notify_all();
+}
+
+void SyncStage::run() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (!_quit) {
+    if (_running && _queued == _depth) {
+      _full++;
+    }
+    _cv.wait(lock, [this] { return _quit || (_running && _queued < _depth); });
+    if (_quit) {
+      break;
+    }
+
+    // The buffer at _write_idx is not visible to the main loop until it is queued below
+    auto& subframe = _queue[_write_idx];
+    auto& previous = _queue[(_write_idx + _depth - 1) % _depth];
+    bool contiguous = _contiguous && previous.samples >= _history;
+    _busy = true;
+    lock.unlock();
+
+    // Only this thread writes the buffers, so the previous one can still be read even if it has been released
+    for (unsigned ch = 0; ch < _rx_channels; ch++) {
+      if (contiguous) {
+        srsran_vec_cf_copy(subframe.buffer[ch] - _history, previous.buffer[ch] + previous.samples - _history, _history);
+      } else {
+        srsran_vec_cf_zero(subframe.buffer[ch] - _history, _history);
+      }
+    }
+
+    subframe.ok = _phy.get_next_frame(subframe.buffer, _buffer_size);
+    subframe.received_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    subframe.samples = _phy.subframe_len();
+    subframe.sfo = _phy.sfo();
+    // The samples are read on this thread, so the stream position and discontinuities belong to this subframe
+    subframe.stream_end = _sdr.consumed_samples();
+    subframe.discontinuity = _sdr.take_discontinuity();
+    lock.lock();
+    _busy = false;
+
+    if (_running) {
+      _contiguous = subframe.ok;
+      _write_idx = (_write_idx + 1) % _depth;
+      _queued++;
+      _received++;
+      if (_queued > _max_queued) {
+        _max_queued = _queued;
+      }
+      // Nothing can be received after a failure until the main loop has resynchronized
+      _running = subframe.ok;
+    }
+    _cv.notify_all();
+  }
+}
@@ -0,0 +1,160 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <libconfig.h++>
+#include "Phy.h"
+#include "SdrReader.h"
+#include "ThreadPlacement.h"
+#include "srsran/srsran.h"
+
+/**
+ *  Runs the subframe synchronisation (Phy::get_next_frame) on a thread of its own.
+ *
+ *  While started, the thread keeps receiving aligned subframes into a short queue of pre-allocated
+ *  buffers. The main loop takes them from the queue with next(), copies the samples into the buffer
+ *  of a frame processor, and hands the queue buffer back with release(). Time tracking therefore
+ *  continues while the main loop is busy with something else, e.g. collecting the statistics, until
+ *  the queue is full.
+ *
+ *  If a subframe can't be received, it is queued with ok set to false and the stage stops. All other
+ *  calls into the Phy's sync (synchronize_subframe, set_cell, reset_sync, ...) must only be made
+ *  while the stage is stopped.
+ */
+class SyncStage {
+ public:
+    /**
+     *  A received subframe
+     */
+    struct Subframe {
+      cf_t* buffer[SRSRAN_MAX_PORTS];  // preceded by history() samples, see there
+      uint32_t samples;  // per channel
+      float sfo;  // sampling frequency offset estimate after this subframe
+      uint64_t stream_end;  // SdrReader::consumed_samples() after this subframe was read
+      int64_t received_ns;  // steady_clock time the subframe was read, on the clock of thread_pool::now_ns()
+      bool discontinuity;  // the samples read since the previous subframe were not contiguous
+      bool ok;
+    };
+
+    /**
+     *  Default constructor.
+     *
+     *  @param cfg Config singleton reference
+     *  @param phy PHY reference
+     *  @param sdr SDR reader the Phy reads its samples from
+     *  @param rx_channels Number of RX channels
+     *  @param buffer_size Size of each subframe buffer, per channel
+     *  @param history Number of samples kept in front of each subframe buffer
+     */
+    SyncStage(const libconfig::Config& cfg, Phy& phy, SdrReader& sdr, unsigned rx_channels, uint32_t buffer_size,
+        uint32_t history);
+
+    /**
+     *  Default destructor. Stops the thread.
+     */
+    virtual ~SyncStage();
+
+    /**
+     *  Allocate the queue and launch the thread, with realtime priority
+     */
+    void launch(ThreadPlacement* placement);
+
+    /**
+     *  Start receiving subframes. The Phy must be synchronized.
+     */
+    void start();
+
+    /**
+     *  Stop receiving subframes, wait until the thread is idle and discard all queued subframes.
+     *  Subframes taken with next() must have been released.
+     */
+    void stop();
+
+    /**
+     *  Get the next subframe. Blocks until it has been received.
+     */
+    const Subframe& next();
+
+    /**
+     *  Hand the buffer of the subframe returned by next() back to the stage
+     */
+    void release();
+
+    /**
+     *  Number of subframes received
+     */
+    uint64_t received() const { return _received; }
+
+    /**
+     *  Number of times the thread had to wait because the queue was full
+     */
+    uint64_t full() const { return _full; }
+
+    /**
+     *  Highest number of subframes queued at once
+     */
+    unsigned max_queued() const { return _max_queued; }
+
+    /**
+     *  Number of subframe buffers
+     */
+    unsigned depth() const { return _depth; }
+
+    /**
+     *  Number of samples in front of each subframe buffer. They hold the end of the previous subframe, so
+     *  filters can run across the subframe boundary, or zeros for the first subframe after start().
+     */
+    uint32_t history() const { return _history; }
+
+ private:
+    void run();
+
+    const libconfig::Config& _cfg;
+    Phy& _phy;
+    SdrReader& _sdr;
+    unsigned _rx_channels;
+    uint32_t _buffer_size;
+    uint32_t _history;
+    unsigned _depth = 4;
+
+    std::vector<Subframe> _queue;
+    unsigned _read_idx = 0;
+    unsigned _write_idx = 0;
+    unsigned _queued = 0;
+    bool _contiguous = false;  // the next subframe follows the one before _write_idx in the stream
+
+    bool _running = false;  // producing subframes
+    bool _busy = false;  // the thread is in Phy::get_next_frame
+    bool _quit = false;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _thread;
+
+    std::atomic<uint64_t> _received = { 0 };
+    std::atomic<uint64_t> _full = { 0 };
+    std::atomic<unsigned> _max_queued = { 0 };
+};
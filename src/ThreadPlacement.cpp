@@ -0,0 +1,296 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "ThreadPlacement.h"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "spdlog/spdlog.h"
+
+namespace {
+const char* const kConfigKeys[] = {
+  "modem.cpu_affinity.sdr_reader",
+  "modem.cpu_affinity.main",
+  "modem.cpu_affinity.phy",
+  "modem.cpu_affinity.housekeeping",
+};
+}  // namespace
+
+ThreadPlacement::ThreadPlacement(const libconfig::Config& cfg, const std::string& root)
+{
+  CPU_ZERO(&_allowed);
+  CPU_ZERO(&_inherited);
+  CPU_ZERO(&_isolated);
+  if (sched_getaffinity(0, sizeof(_inherited), &_inherited) != 0) {
+    spdlog::warn("Cannot get the CPUs the modem has been started on: {}", strerror(errno));
+    for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, &_inherited);
+    }
+  }
+
+  // Isolated CPUs are never in the inherited affinity, so what the threads may be moved to is taken
+  // from the cpuset instead
+  if (!read_cpuset(root, _allowed) && !read_list(root + "/sys/devices/system/cpu/online", _allowed)) {
+    _allowed = _inherited;
+  }
+  CPU_OR(&_allowed, &_allowed, &_inherited);
+
+  if (read_list(root + "/sys/devices/system/cpu/isolated", _isolated)) {
+    CPU_AND(&_isolated, &_isolated, &_allowed);
+  }
+
+  cpu_set_t assigned;
+  CPU_ZERO(&assigned);
+  for (size_t cls = 0; cls < kNofClasses; cls++) {
+    CPU_ZERO(&_sets[cls]);
+    std::string list;
+    if (!cfg.lookupValue(kConfigKeys[cls], list)) {
+      continue;
+    }
+    cpu_set_t configured;
+    if (!parse_list(list, configured)) {
+      spdlog::error("Invalid CPU list \"{}\" in {}, not pinning these threads", list, kConfigKeys[cls]);
+      continue;
+    }
+    CPU_AND(&_sets[cls], &configured, &_allowed);
+    if (!CPU_EQUAL(&_sets[cls], &configured)) {
+      spdlog::warn("{}: CPUs {} are outside of the modem's cpuset ({}), ignoring them", kConfigKeys[cls],
+          to_list(configured), to_list(_allowed));
+    }
+    if (CPU_COUNT(&_sets[cls]) == 0) {
+      continue;
+    }
+    _pinned[cls] = true;
+    CPU_OR(&assigned, &assigned, &_sets[cls]);
+  }
+
+  // Threads that aren't pinned explicitly stay within the CPUs the modem has been started on
+  _available = _inherited;
+  cpu_set_t unassigned = _inherited;
+  for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &_isolated)) {
+      CPU_CLR(cpu, &_available);
+      CPU_CLR(cpu, &unassigned);
+    } else if (CPU_ISSET(cpu, &assigned)) {
+      CPU_CLR(cpu, &unassigned);
+    }
+  }
+  if (CPU_COUNT(&_available) == 0) {
+    _available = _inherited;
+  }
+
+  // Housekeeping gets what's left, as long as the realtime threads have been pinned at all
+  _active = CPU_COUNT(&assigned) > 0;
+  auto housekeeping = static_cast<size_t>(ThreadClass::Housekeeping);
+  if (!_pinned[housekeeping] && _active) {
+    _sets[housekeeping] = CPU_COUNT(&unassigned) > 0 ? unassigned : _available;
+    _pinned[housekeeping] = true;
+  }
+}
+
+void ThreadPlacement::place(ThreadClass thread_class, pthread_t thread, const std::string& name)
+{
+  pthread_setname_np(thread, name.substr(0, 15).c_str());
+
+  // Threads of classes without a CPU set may have inherited the housekeeping CPUs from their creator,
+  // give them all non-isolated CPUs back
+  auto cls = static_cast<size_t>(thread_class);
+  if (_active) {
+    const auto& set = _pinned[cls] ? _sets[cls] : _available;
+    int error = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set);
+    if (error != 0) {
+      spdlog::warn("Cannot pin thread {} to CPUs {}: {}", name, to_list(set), strerror(error));
+    }
+  }
+
+  Placement placement = { name, thread_class, "", SCHED_OTHER, 0 };
+  cpu_set_t current;
+  if (pthread_getaffinity_np(thread, sizeof(current), &current) == 0) {
+    placement.cpus = to_list(current);
+  }
+  struct sched_param param = {};
+  pthread_getschedparam(thread, &placement.policy, &param);
+  placement.priority = param.sched_priority;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (auto& existing : _placements) {
+    if (existing.name == name) {
+      existing = placement;
+      return;
+    }
+  }
+  _placements.push_back(placement);
+}
+
+void ThreadPlacement::report() const
+{
+  spdlog::info("CPUs allowed: {}, isolated: {}", to_list(_allowed),
+      CPU_COUNT(&_isolated) > 0 ? to_list(_isolated) : "none");
+  for (size_t cls = 0; cls < kNofClasses; cls++) {
+    spdlog::info("  {} threads: {}", class_name(static_cast<ThreadClass>(cls)),
+        _pinned[cls] ? to_list(_sets[cls]) : "not pinned");
+  }
+  for (const auto& placement : placements()) {
+    spdlog::info("  thread {} ({}): CPUs {}, {} priority {}", placement.name, class_name(placement.thread_class),
+        placement.cpus, policy_name(placement.policy), placement.priority);
+  }
+}
+
+auto ThreadPlacement::placements() const -> std::vector<Placement>
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _placements;
+}
+
+auto ThreadPlacement::cpus(ThreadClass thread_class) const -> std::string
+{
+  auto cls = static_cast<size_t>(thread_class);
+  return _pinned[cls] ? to_list(_sets[cls]) : "";
+}
+
+auto ThreadPlacement::class_name(ThreadClass thread_class) -> const char*
+{
+  switch (thread_class) {
+    case ThreadClass::SdrReader: return "sdr_reader";
+    case ThreadClass::Main: return "main";
+    case ThreadClass::Phy: return "phy";
+    case ThreadClass::Housekeeping: return "housekeeping";
+  }
+  return "unknown";
+}
+
+auto ThreadPlacement::policy_name(int policy) -> const char*
+{
+  switch (policy) {
+    case SCHED_RR: return "SCHED_RR";
+    case SCHED_FIFO: return "SCHED_FIFO";
+    case SCHED_OTHER: return "SCHED_OTHER";
+    default: return "other";
+  }
+}
+
+auto ThreadPlacement::parse_list(const std::string& list, cpu_set_t& set) -> bool
+{
+  CPU_ZERO(&set);
+  std::stringstream stream(list);
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    unsigned first = 0;
+    unsigned last = 0;
+    char dash = 0;
+    std::stringstream range_stream(range);
+    if (!(range_stream >> first)) {
+      return false;
+    }
+    last = first;
+    if (range_stream >> dash && (dash != '-' || !(range_stream >> last))) {
+      return false;
+    }
+    if (last < first || last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (auto cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return CPU_COUNT(&set) > 0;
+}
+
+auto ThreadPlacement::read_list(const std::string& path, cpu_set_t& set) -> bool
+{
+  std::ifstream file(path);
+  std::string list;
+  return std::getline(file, list) && !list.empty() && parse_list(list, set);
+}
+
+auto ThreadPlacement::read_cpuset(const std::string& root, cpu_set_t& set) -> bool
+{
+  // Lines of /proc/self/cgroup are "id:controllers:path". The cpuset controller is listed by name on
+  // cgroup v1, the v2 hierarchy has id 0 and no controllers.
+  std::ifstream cgroup_file(root + "/proc/self/cgroup");
+  std::string line;
+  std::string v1_path;
+  std::string v2_path;
+  bool v1 = false;
+  bool v2 = false;
+  while (std::getline(cgroup_file, line)) {
+    auto first = line.find(':');
+    auto second = line.find(':', first + 1);
+    if (first == std::string::npos || second == std::string::npos) {
+      continue;
+    }
+    std::stringstream controllers(line.substr(first + 1, second - first - 1));
+    std::string controller;
+    while (std::getline(controllers, controller, ',')) {
+      if (controller == "cpuset") {
+        v1 = true;
+        v1_path = line.substr(second + 1);
+      }
+    }
+    if (line.compare(0, first + 1, "0:") == 0 && second == first + 1) {
+      v2 = true;
+      v2_path = line.substr(second + 1);
+    }
+  }
+
+  // The cgroup's own file may be missing if the cpuset controller isn't enabled for it, its parents
+  // restrict it just as well
+  auto read_up = [&set](const std::string& base, std::string path, const std::string& file) {
+    if (path == "/") {
+      path.clear();
+    }
+    for (;;) {
+      if (read_list(base + path + "/" + file, set)) {
+        return true;
+      }
+      if (path.empty()) {
+        return false;
+      }
+      path = path.substr(0, path.rfind('/'));
+    }
+  };
+  return (v1 && read_up(root + "/sys/fs/cgroup/cpuset", v1_path, "cpuset.effective_cpus")) ||
+    (v2 && read_up(root + "/sys/fs/cgroup", v2_path, "cpuset.cpus.effective"));
+}
+
+auto ThreadPlacement::to_list(const cpu_set_t& set) -> std::string
+{
+  std::string list;
+  for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &set)) {
+      continue;
+    }
+    auto last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set)) {
+      last++;
+    }
+    if (!list.empty()) {
+      list += ",";
+    }
+    list += std::to_string(cpu);
+    if (last > cpu) {
+      list += "-" + std::to_string(last);
+    }
+    cpu = last;
+  }
+  return list;
+}
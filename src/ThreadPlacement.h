@@ -0,0 +1,128 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <array>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <libconfig.h++>
+
+/**
+ *  Pins the threads of the modem to CPU sets, per thread class.
+ *
+ *  The CPU set of each class is read from modem.cpu_affinity (in the kernel's list format, e.g.
+ *  "2-3,6"). Only CPUs in the process's cgroup cpuset are used. CPUs isolated with isolcpus are
+ *  only used if they are listed explicitly: they are not part of the affinity the modem inherits at
+ *  startup. Classes without a CPU set stay within that inherited affinity. If no housekeeping set is
+ *  configured, the housekeeping threads get all inherited, non-isolated CPUs that are not assigned to
+ *  another class.
+ *
+ *  Threads inherit the CPU set (and scheduling) of the thread that creates them. The main thread
+ *  therefore starts out on the housekeeping CPUs, so all threads created by libraries (e.g. the REST
+ *  API listener) end up there, and moves to its own CPUs once everything has been started.
+ *
+ *  Without a modem.cpu_affinity section, no thread is pinned. The placement is reported anyway.
+ */
+class ThreadPlacement {
+ public:
+    enum class ThreadClass {
+      SdrReader,
+      Main,
+      Phy,
+      Housekeeping,
+    };
+
+    /**
+     *  Placement of one thread, as applied by place()
+     */
+    struct Placement {
+      std::string name;
+      ThreadClass thread_class;
+      std::string cpus;
+      int policy;
+      int priority;
+    };
+
+    /**
+     *  Default constructor. Must be called from the main thread before any other thread has been pinned.
+     *
+     *  @param cfg Config singleton reference
+     *  @param root Prefix for the /proc and /sys paths the CPU sets are read from
+     */
+    explicit ThreadPlacement(const libconfig::Config& cfg, const std::string& root = "");
+
+    /**
+     *  Name and set the CPU set of a thread according to its class, and record its placement.
+     *  Call after setting the thread's scheduling policy. Can be called from any thread.
+     *
+     *  @param thread_class Class of the thread
+     *  @param thread The thread
+     *  @param name Name of the thread, at most 15 characters are shown by the kernel
+     */
+    void place(ThreadClass thread_class, pthread_t thread, const std::string& name);
+
+    /**
+     *  Log the CPU sets and the placement of all threads
+     */
+    void report() const;
+
+    /**
+     *  Placement of all threads placed so far
+     */
+    std::vector<Placement> placements() const;
+
+    /**
+     *  CPU list of a thread class, empty if the class is not pinned
+     */
+    std::string cpus(ThreadClass thread_class) const;
+
+    /**
+     *  CPUs the process is allowed to run on (its cpuset), and the isolated CPUs among them
+     */
+    std::string allowed_cpus() const { return to_list(_allowed); }
+    std::string isolated_cpus() const { return to_list(_isolated); }
+
+    static const char* class_name(ThreadClass thread_class);
+    static const char* policy_name(int policy);
+
+ private:
+    static constexpr size_t kNofClasses = 4;
+
+    static bool parse_list(const std::string& list, cpu_set_t& set);
+    static std::string to_list(const cpu_set_t& set);
+    static bool read_list(const std::string& path, cpu_set_t& set);
+    static bool read_cpuset(const std::string& root, cpu_set_t& set);
+
+    cpu_set_t _allowed;
+    cpu_set_t _inherited;  // affinity of the main thread at startup
+    cpu_set_t _isolated;
+    cpu_set_t _available;  // inherited and not isolated
+    bool _active = false;  // at least one class is pinned
+    std::array<cpu_set_t, kNofClasses> _sets;
+    std::array<bool, kNofClasses> _pinned = {};
+
+    mutable std::mutex _mutex;
+    std::vector<Placement> _placements;
+};
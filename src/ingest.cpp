@@ -0,0 +1,226 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+/**
+ * @file ingest.cpp
+ * @brief Entry point of modem-ingest, which owns the SDR and publishes its samples in shared memory.
+ *
+ * Decoding modem processes read the samples with --shared-memory. Since the SDR stream keeps running
+ * when a modem is restarted (or crashes), no resynchronisation of the hardware is needed, and several
+ * modems can decode the same capture.
+ */
+
+#include <argp.h>
+
+#include <atomic>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <vector>
+#include <libconfig.h++>
+
+#include "SdrReader.h"
+#include "SharedSampleRing.h"
+#include "ThreadPlacement.h"
+#include "Version.h"
+#include "spdlog/spdlog.h"
+#include "spdlog/sinks/syslog_sink.h"
+#include "srsran/srsran.h"
+
+using libconfig::Config;
+using libconfig::FileIOException;
+using libconfig::ParseException;
+
+static void print_version(FILE *stream, struct argp_state *state);
+void (*argp_program_version_hook)(FILE *, struct argp_state *) = print_version;
+const char *argp_program_bug_address = "5G-MAG Reference Tools <reference-tools@5g-mag.com>";
+static char doc[] = "5G-MAG-RT MBMS Modem I/Q Ingest Process";  // NOLINT
+
+static struct argp_option options[] = {  // NOLINT
+    {"config", 'c', "FILE", 0, "Configuration file (default: /etc/5gmag-rt.conf)", 0},
+    {"log-level", 'l', "LEVEL", 0,
+     "Log verbosity: 0 = trace, 1 = debug, 2 = info, 3 = warn, 4 = error, 5 = "
+     "critical, 6 = none. Default: 2.",
+     0},
+    {"name", 'n', "NAME", 0,
+     "Name of the shared memory segment (default: modem.ingest.name from the config file, or 5gmag-rt-iq)",
+     0},
+    {nullptr, 0, nullptr, 0, nullptr, 0}};
+
+/**
+ * Holds all options passed on the command line
+ */
+struct arguments {
+  const char *config_file = {};  /**< file path of the config file. */
+  unsigned log_level = 2;        /**< log level */
+  const char *name = {};         /**< name of the shared memory segment */
+};
+
+/**
+ * Print the program version in MAJOR.MINOR.PATCH format.
+ */
+void print_version(FILE *stream, struct argp_state * /*state*/) {
+  fprintf(stream, "%s.%s.%s\n", std::to_string(VERSION_MAJOR).c_str(),
+          std::to_string(VERSION_MINOR).c_str(),
+          std::to_string(VERSION_PATCH).c_str());
+}
+
+/**
+ * Parses the command line options into the arguments struct.
+ */
+static auto parse_opt(int key, char *arg, struct argp_state *state) -> error_t {
+  auto arguments = static_cast<struct arguments *>(state->input);
+  switch (key) {
+    case 'c':
+      arguments->config_file = arg;
+      break;
+    case 'l':
+      arguments->log_level = static_cast<unsigned>(strtoul(arg, nullptr, 10));
+      break;
+    case 'n':
+      arguments->name = arg;
+      break;
+    case ARGP_KEY_ARG:
+      argp_usage(state);
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+static struct argp argp = {options, parse_opt, nullptr, doc,
+                           nullptr, nullptr,   nullptr};
+
+static std::atomic<bool> running = { true };
+
+static void stop_running(int /*signal*/) {
+  running = false;
+}
+
+/**
+ *  Main entry point for modem-ingest.
+ *
+ * @param argc  Command line agument count
+ * @param argv  Command line arguments
+ * @return 0 on clean exit, 1 on failure
+ */
+auto main(int argc, char **argv) -> int {
+  struct arguments arguments;
+  arguments.config_file = "/etc/5gmag-rt.conf";
+  argp_parse(&argp, argc, argv, 0, nullptr, &arguments);
+
+  Config cfg;
+  try {
+    cfg.readFile(arguments.config_file);
+  } catch(const FileIOException &fioex) {
+    spdlog::error("I/O error while reading config file at {}. Exiting.", arguments.config_file);
+    exit(1);
+  } catch(const ParseException &pex) {
+    spdlog::error("Config parse error at {}:{} - {}. Exiting.",
+        pex.getFile(), pex.getLine(), pex.getError());
+    exit(1);
+  }
+
+  std::string ident = "modem-ingest";
+  auto syslog_logger = spdlog::syslog_logger_mt("syslog", ident, LOG_PID | LOG_PERROR | LOG_CONS );
+  spdlog::set_level(static_cast<spdlog::level::level_enum>(arguments.log_level));
+  spdlog::set_pattern("[%H:%M:%S.%f %z] [%^%l%$] [thr %t] %v");
+  spdlog::set_default_logger(syslog_logger);
+  spdlog::info("5g-mag-rt modem-ingest v{}.{}.{} starting up", VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+
+  std::string name = "5gmag-rt-iq";
+  cfg.lookupValue("modem.ingest.name", name);
+  if (arguments.name != nullptr) {
+    name = arguments.name;
+  }
+
+  // The modem decodes a fixed capture from shared memory, so the rate has to fit the MBSFN bandwidth
+  unsigned sample_rate = 7680000;
+  cfg.lookupValue("modem.ingest.sample_rate_hz", sample_rate);
+  srsran_use_standard_symbol_size(true);
+  auto nof_prb = std::max(srsran_nof_prb(sample_rate / 15000), 6);
+  unsigned bandwidth = nof_prb * 200000 * 1.2;
+  cfg.lookupValue("modem.ingest.bandwidth_hz", bandwidth);
+  unsigned buffer_ms = 500;
+  cfg.lookupValue("modem.ingest.buffer_ms", buffer_ms);
+
+  unsigned long long frequency = 0;
+  if (!cfg.lookupValue("modem.sdr.center_frequency_hz", frequency) || frequency > UINT_MAX) {
+    spdlog::error("Unable to parse center_frequency_hz - values must have a ‘L’ character appended");
+    exit(1);
+  }
+  double gain = 0.9;
+  std::string antenna = "LNAW";
+  bool use_agc = false;
+  cfg.lookupValue("modem.sdr.normalized_gain", gain);
+  cfg.lookupValue("modem.sdr.antenna", antenna);
+  cfg.lookupValue("modem.sdr.use_agc", use_agc);
+
+  auto rx_channels = 1;
+  cfg.lookupValue("modem.sdr.rx_channels", rx_channels);
+  ThreadPlacement thread_placement(cfg);
+  SdrReader sdr(cfg, rx_channels);
+  sdr.set_thread_placement(&thread_placement);
+  std::string sdr_dev = "driver=lime";
+  cfg.lookupValue("modem.sdr.device_args", sdr_dev);
+  if (!sdr.init(sdr_dev, nullptr, nullptr, nullptr, SampleFormat::CF32, false, 1.0) ||
+      !sdr.tune(static_cast<uint32_t>(frequency), sample_rate, bandwidth, gain, antenna, use_agc)) {
+    spdlog::error("Failed to initialize the SDR. Exiting.");
+    exit(1);
+  }
+
+  auto ring = SharedSampleRing::create(name, rx_channels, static_cast<size_t>(sample_rate / 1000.0 * buffer_ms),
+      sample_rate, frequency);
+  if (!ring) {
+    exit(1);
+  }
+
+  signal(SIGINT, stop_running);
+  signal(SIGTERM, stop_running);
+
+  // Pass the samples on in blocks of one subframe
+  auto block = static_cast<uint32_t>(sample_rate / 1000);
+  std::vector<cf_t*> buffers(SRSRAN_MAX_CHANNELS, nullptr);
+  for (auto ch = 0; ch < rx_channels; ch++) {
+    buffers[ch] = srsran_vec_cf_malloc(block);
+  }
+
+  sdr.start();
+  thread_placement.place(ThreadPlacement::ThreadClass::Main, pthread_self(), "modem-ingest");
+  thread_placement.report();
+  while (running) {
+    srsran_timestamp_t rx_time = { -1, 0 };
+    if (sdr.get_samples(buffers.data(), block, &rx_time) != 0) {
+      continue;
+    }
+    auto time_ns = rx_time.full_secs < 0 ? -1 :
+      static_cast<long long>(rx_time.full_secs) * 1000000000 + llround(rx_time.frac_secs * 1e9);
+    ring->write(buffers.data(), block, time_ns);
+  }
+
+  spdlog::info("Shutting down");
+  sdr.stop();
+  ring.reset();
+  for (auto buffer : buffers) {
+    free(buffer);
+  }
+  return 0;
+}
@@ -34,13 +34,19 @@
 #include <libconfig.h++>
 
 #include "CasFrameProcessor.h"
+#include "DriftCompensation.h"
 #include "Gw.h"
+#include "LoadShedder.h"
 #include "SdrReader.h"
 #include "MbsfnFrameProcessor.h"
+#include "MchReorderBuffer.h"
 #include "MeasurementFileWriter.h"
 #include "Phy.h"
+#include "ProcessorPool.h"
 #include "RestHandler.h"
 #include "Rrc.h"
+#include "SyncStage.h"
+#include "ThreadPlacement.h"
 #include "Version.h"
 #include "spdlog/async.h"
 #include "spdlog/spdlog.h"
@@ -63,6 +69,11 @@ void (*argp_program_version_hook)(FILE *, struct argp_state *) = print_version;
 const char *argp_program_bug_address = "5G-MAG Reference Tools <reference-tools@5g-mag.com>";
 static char doc[] = "5G-MAG-RT MBMS Modem Process";  // NOLINT
 
+// Keys for options without a short form
+const int kSeekOption = 0x100;
+const int kSeekTtiOption = 0x101;
+const int kSharedMemoryOption = 0x103;
+
 static struct argp_option options[] = {  // NOLINT
     {"config", 'c', "FILE", 0, "Configuration file (default: /etc/5gmag-rt.conf)", 0},
     {"log-level", 'l', "LEVEL", 0,
@@ -74,16 +85,24 @@ static struct argp_option options[] = {  // NOLINT
      "none, Default: 4.",
      0},
     {"sample-file", 'f', "FILE", 0,
-     "Sample file in 4 byte float interleaved format to read I/Q data from. If "
-     "present, the data from this file will be decoded instead of live SDR "
+     "Sample file to read I/Q data from (4 byte float interleaved, or a "
+     "compact file created with --sample-file-format). If present, the data from this file will be decoded instead of live SDR "
      "data. The channel bandwith must be specified with the --file-bandwidth "
      "flag, and the sample rate of the file must be suitable for this "
      "bandwidth.",
      0},
+    {"shared-memory", kSharedMemoryOption, "NAME", 0,
+     "Decode the samples published by a modem-ingest process in the shared "
+     "memory segment with this name, instead of opening the SDR.",
+     0},
     {"write-sample-file", 'w', "FILE", 0,
      "Create a sample file in 4 byte float interleaved format containing the "
      "raw received I/Q data.",
      0},
+    {"sample-file-format", 'F', "FORMAT", 0,
+     "Sample format of the file created with --write-sample-file: cf32 (4 byte "
+     "float, default), cs16 (16 bit integer) or cs8 (8 bit integer)",
+     0},
     {"file-bandwidth", 'b', "BANDWIDTH (MHz)", 0,
      "If decoding data from a file, specify the channel bandwidth of the "
      "recorded data in MHz here (e.g. 5)",
@@ -94,6 +113,15 @@ static struct argp_option options[] = {  // NOLINT
      "Prints a list of all available SDR devices", 0},
     {"repeat", 'r', nullptr, 0,
      "Replay the sample file endlessly (default: false)", 0},
+    {"seek", kSeekOption, "SECONDS", 0,
+     "Start replaying the sample file at this time from the start of the "
+     "recording", 0},
+    {"seek-tti", kSeekTtiOption, "TTI", 0,
+     "Start replaying the sample file at the first subframe with this TTI. "
+     "Requires the TTI index from the sample file metadata.", 0},
+    {"replay-speed", 'x', "FACTOR", 0,
+     "Speed at which the sample file is replayed, as a multiple of real time. "
+     "0 replays as fast as the samples can be decoded. (default: 1)", 0},
 
     {nullptr, 0, nullptr, 0, nullptr, 0}};
 
@@ -106,11 +134,16 @@ struct arguments {
   unsigned srs_log_level = 4;    /**< srsLTE log level */
   int8_t override_nof_prb = -1;  /**< ovride PRB number */
   const char *sample_file = {};  /**< file path of the sample file. */
+  const char *shared_memory = {};  /**< name of the shared memory segment to read from */
   uint8_t file_bw = 0;           /**< bandwidth of the sample file */
   const char
       *write_sample_file = {};   /**< file path of the created sample file. */
+  SampleFormat write_sample_format = SampleFormat::CF32; /**< format of the created sample file. */
   bool list_sdr_devices = false;
   bool repeat_sample_file = false;
+  double replay_speed = 1.0;       /**< sample file replay speed, 0 = unpaced */
+  double seek = 0;                 /**< sample file start time in seconds */
+  int seek_tti = -1;               /**< sample file start TTI, -1 = none */
 };
 
 /**
@@ -132,9 +165,17 @@ static auto parse_opt(int key, char *arg, struct argp_state *state) -> error_t {
     case 'f':
       arguments->sample_file = arg;
       break;
+    case kSharedMemoryOption:
+      arguments->shared_memory = arg;
+      break;
     case 'w':
       arguments->write_sample_file = arg;
       break;
+    case 'F':
+      if (!sample_format_from_string(arg, arguments->write_sample_format)) {
+        argp_error(state, "Unknown sample file format %s", arg);
+      }
+      break;
     case 'b':
       arguments->file_bw = static_cast<uint8_t>(strtoul(arg, nullptr, 10));
       break;
@@ -148,6 +189,21 @@ static auto parse_opt(int key, char *arg, struct argp_state *state) -> error_t {
     case 'r':
       arguments->repeat_sample_file = true;
       break;
+    case kSeekOption:
+      arguments->seek = strtod(arg, nullptr);
+      break;
+    case kSeekTtiOption:
+      arguments->seek_tti = static_cast<int>(strtol(arg, nullptr, 10));
+      if (arguments->seek_tti < 0 || arguments->seek_tti >= 10240) {
+        argp_error(state, "TTI must be in the range 0..10239");
+      }
+      break;
+    case 'x':
+      arguments->replay_speed = strtod(arg, nullptr);
+      if (arguments->replay_speed < 0) {
+        argp_error(state, "Replay speed must not be negative");
+      }
+      break;
     case ARGP_KEY_ARG:
       argp_usage(state);
       break;
@@ -181,6 +237,7 @@ static bool use_agc = false;
 
 static unsigned mbsfn_nof_prb = 0;
 static unsigned cas_nof_prb = 0;
+static unsigned capture_nof_prb = 0;  /**< Number of PRB the SDR sample rate is set for */
 
 /**
  * Restart flag. Setting this to true triggers resynchronization using the params set in the following parameters:
@@ -214,6 +271,74 @@ void set_params(const std::string& ant, unsigned fc, double g, unsigned sr, unsi
   restart = true;
 }
 
+/**
+ * Pool job for a CAS subframe: decode it, pass the CINR to the REST API handler, and hand the processor back.
+ *
+ * @param j The job. object is the ProcessorPool slot of the CasFrameProcessor holding the subframe, context the RestHandler.
+ */
+static void process_cas_subframe(const thread_pool::job& j) {
+  auto cas_slot = static_cast<ProcessorPool<CasFrameProcessor>::Slot*>(j.object);
+  cas_slot->pool->start(cas_slot);
+  if (cas_slot->processor->process(j.tti)) {
+    // Set constellation diagram data and rx params for CAS in the REST API handler
+    static_cast<RestHandler*>(j.context)->add_cinr_value(cas_slot->processor->cinr_db());
+  }
+  cas_slot->pool->release(cas_slot);
+}
+
+/**
+ * Pool job for an MBSFN subframe: decode it, and hand the processor back.
+ *
+ * @param j The job. object is the ProcessorPool slot of the MbsfnFrameProcessor holding the subframe.
+ */
+static void process_mbsfn_subframe(const thread_pool::job& j) {
+  auto mbsfn_slot = static_cast<ProcessorPool<MbsfnFrameProcessor>::Slot*>(j.object);
+  mbsfn_slot->pool->start(mbsfn_slot);
+  mbsfn_slot->processor->process(j.tti);
+  mbsfn_slot->pool->release(mbsfn_slot);
+}
+
+/**
+ * Copy a subframe received by the sync thread into the buffer of a frame processor.
+ *
+ * @param subframe The subframe
+ * @param buffer The processor's buffer, one per channel
+ * @param size Size of the processor's buffer, per channel
+ * @param rx_channels Number of RX channels
+ * @param history Number of samples before the subframe to copy in front of the buffer, at most SyncStage::history()
+ */
+static void copy_subframe(const SyncStage::Subframe& subframe, cf_t** buffer, uint32_t size, int rx_channels,
+    uint32_t history = 0) {
+  auto samples = std::min(subframe.samples, size);
+  for (int ch = 0; ch < rx_channels; ch++) {
+    srsran_vec_cf_copy(buffer[ch] - history, subframe.buffer[ch] - history, history + samples);
+  }
+}
+
+/**
+ * Apply a new cell to the CAS processor. A worker may still be decoding the last CAS subframe with it, so
+ * wait for that first.
+ */
+static void set_cas_cell(ProcessorPool<CasFrameProcessor>& cas_pool, CasFrameProcessor& cas_processor,
+    const srsran_cell_t& cell) {
+  cas_pool.pause();
+  cas_processor.set_cell(cell);
+  cas_pool.resume();
+}
+
+/**
+ * Called instead of process_mbsfn_subframe if a worker only gets to the subframe after its deadline.
+ *
+ * @param j The job. context is the LoadShedder, tag the subframe's LoadShedder::Priority.
+ */
+static void drop_mbsfn_subframe(const thread_pool::job& j) {
+  auto mbsfn_slot = static_cast<ProcessorPool<MbsfnFrameProcessor>::Slot*>(j.object);
+  static_cast<LoadShedder*>(j.context)->count_late(static_cast<LoadShedder::Priority>(j.tag));
+  spdlog::debug("dropping tti {}, past its deadline", j.tti);
+  mbsfn_slot->processor->discard();
+  mbsfn_slot->pool->release(mbsfn_slot);
+}
+
 /**
  *  Main entry point for the program.
  *  
@@ -252,11 +377,17 @@ auto main(int argc, char **argv) -> int {
   spdlog::set_default_logger(syslog_logger);
   spdlog::info("5g-mag-rt modem v{}.{}.{} starting up", VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
 
+  // Until everything has been started, the main thread runs on the housekeeping CPUs. All threads created
+  // meanwhile, except for the explicitly placed realtime threads, inherit them.
+  ThreadPlacement thread_placement(cfg);
+  thread_placement.place(ThreadPlacement::ThreadClass::Housekeeping, pthread_self(), "modem");
+
   // Init and tune the SDR
   auto rx_channels = 1;
   cfg.lookupValue("modem.sdr.rx_channels", rx_channels);
   spdlog::info("Initialising SDR with {} RX channel(s)", rx_channels);
   SdrReader sdr(cfg, rx_channels);
+  sdr.set_thread_placement(&thread_placement);
   if (arguments.list_sdr_devices) {
     sdr.enumerateDevices();
     exit(0);
@@ -264,7 +395,8 @@ auto main(int argc, char **argv) -> int {
 
   std::string sdr_dev = "driver=lime";
   cfg.lookupValue("modem.sdr.device_args", sdr_dev);
-  if (!sdr.init(sdr_dev, arguments.sample_file, arguments.write_sample_file, arguments.repeat_sample_file)) {
+  if (!sdr.init(sdr_dev, arguments.sample_file, arguments.shared_memory, arguments.write_sample_file,
+        arguments.write_sample_format, arguments.repeat_sample_file, arguments.replay_speed)) {
     spdlog::error("Failed to initialize I/Q data source.");
     exit(1);
   }
@@ -292,7 +424,7 @@ auto main(int argc, char **argv) -> int {
   cfg.lookupValue("modem.sdr.antenna", antenna);
   cfg.lookupValue("modem.sdr.use_agc", use_agc);
 
-  if (!sdr.tune(frequency, sample_rate, bandwidth, gain, antenna, use_agc)) {
+  if (!sdr.retune(frequency, sample_rate, bandwidth, gain, antenna, use_agc)) {
     spdlog::error("Failed to set initial center frequency. Exiting.");
     exit(1);
   }
@@ -300,24 +432,42 @@ auto main(int argc, char **argv) -> int {
   set_srsran_verbose_level(arguments.log_level <= 1 ? SRSRAN_VERBOSE_DEBUG : SRSRAN_VERBOSE_NONE);
   srsran_use_standard_symbol_size(true);
 
+  // The bandwidth of a sample file can be given on the command line, or taken from the file's metadata
+  unsigned file_nof_prb = arguments.file_bw * 5;
+  srsran_cell_t recorded_cell = {};
+  bool use_recorded_cell = false;
+  bool replaying = arguments.sample_file != nullptr || arguments.shared_memory != nullptr;
+  if (replaying) {
+    use_recorded_cell = sdr.sample_file_cell(recorded_cell);
+    if (file_nof_prb == 0 && use_recorded_cell) {
+      file_nof_prb = recorded_cell.mbsfn_prb;
+    } else if (file_nof_prb == 0 && sdr.sample_file_rate() > 0) {
+      file_nof_prb = std::max(srsran_nof_prb(sdr.sample_file_rate() / 15000), 0);
+    }
+    if (file_nof_prb > 0) {
+      spdlog::info("Decoding sample file with {} PRB", file_nof_prb);
+    }
+
+    if (arguments.seek_tti >= 0) {
+      if (!sdr.seek_sample_file_tti(arguments.seek_tti)) {
+        exit(1);
+      }
+    } else if (arguments.seek > 0) {
+      if (!sdr.seek_sample_file(arguments.seek)) {
+        spdlog::error("Seek position is beyond the end of the sample file. Exiting.");
+        exit(1);
+      }
+    }
+  }
+
   // Create a thread pool for the frame processors
   unsigned thread_cnt = 4;
   cfg.lookupValue("modem.phy.threads", thread_cnt);
   int phy_prio = 10;
   cfg.lookupValue("modem.phy.thread_priority_rt", phy_prio);
-  thread_pool pool{ thread_cnt + 1, phy_prio };
-
-  // Elevate execution to real time scheduling
-  struct sched_param thread_param = {};
-  thread_param.sched_priority = 20;
-  cfg.lookupValue("modem.phy.main_thread_priority_rt", thread_param.sched_priority);
-
-  spdlog::info("Raising main thread to realtime scheduling priority {}", thread_param.sched_priority);
-
-  int error = pthread_setschedparam(pthread_self(), SCHED_RR, &thread_param);
-  if (error != 0) {
-    spdlog::error("Cannot set main thread priority to realtime: {}. Thread will run at default priority.", strerror(error));
-  }
+  thread_pool pool{ thread_cnt + 1, phy_prio, [&thread_placement](std::thread& worker, std::size_t idx) {
+    thread_placement.place(ThreadPlacement::ThreadClass::Phy, worker.native_handle(), "phy-" + std::to_string(idx));
+  } };
 
   bool enable_measurement_file = false;
   cfg.lookupValue("modem.measurement_file.enabled", enable_measurement_file);
@@ -327,7 +477,7 @@ auto main(int argc, char **argv) -> int {
   Phy phy(
       cfg,
       std::bind(&SdrReader::get_samples, &sdr, _1, _2, _3),  // NOLINT
-      arguments.file_bw ? arguments.file_bw * 5 : 25,
+      file_nof_prb ? file_nof_prb : 25,
       arguments.override_nof_prb,
       rx_channels);
 
@@ -382,9 +532,15 @@ auto main(int argc, char **argv) -> int {
   // We need the cas processor to be accesible within the rest_handler object to gather all the values display in the rt-wui
   rest_handler.set_cas_processor(&cas_processor);
   
+  // The MBSFN processors hand their transport blocks to the reorder buffer, which passes them on to RLC
+  // in TTI order from a thread of its own.
+  MchReorderBuffer mch_reorder(cfg, rlc, phy, mac_log, rest_handler);
+  mch_reorder.launch(&thread_placement);
+  rest_handler.set_mch_reorder_buffer(&mch_reorder);
+
   std::vector<MbsfnFrameProcessor*> mbsfn_processors;
   for (int i = 0; i < thread_cnt; i++) {
-    auto p = new MbsfnFrameProcessor(cfg, rlc, phy, mac_log, rest_handler, rx_channels);
+    auto p = new MbsfnFrameProcessor(cfg, mch_reorder, phy, rest_handler, rx_channels);
     if (!p->init()) {
       spdlog::error("Failed to create MBSFN processor. Exiting.");
       exit(1);
@@ -392,9 +548,43 @@ auto main(int argc, char **argv) -> int {
     mbsfn_processors.push_back(p);
   }
 
+  // Subframes are handed to the next idle processor, the main loop only waits if all of them are busy
+  ProcessorPool<CasFrameProcessor> cas_pool({&cas_processor});
+  ProcessorPool<MbsfnFrameProcessor> mbsfn_pool(mbsfn_processors);
+  rest_handler.set_processor_pools(&cas_pool, &mbsfn_pool);
+
+  // Drops MBSFN subframes by priority if the processors can't keep up
+  LoadShedder shedder(cfg);
+  shedder.init();
+  rest_handler.set_load_shedder(&shedder);
+
+  // While processing, the subframes are received on a thread of their own, so the subframe timing is kept
+  // while the main loop waits for a processor or collects the statistics.
+  SyncStage sync_stage(cfg, phy, sdr, rx_channels, mbsfn_processors[0]->rx_buffer_size(),
+      cas_processor.max_rx_history());
+  sync_stage.launch(&thread_placement);
+  rest_handler.set_sync_stage(&sync_stage);
+
+  rest_handler.set_thread_placement(&thread_placement);
   rest_handler.start(); // Start the listener, we need to do it after storing the cas into the rest_handler, otherwise we will get segfault.
+
+  // Elevate execution to real time scheduling. This is done only now, so the housekeeping threads created
+  // above (REST API listener, GPS reader, ...) don't inherit the realtime priority.
+  struct sched_param thread_param = {};
+  thread_param.sched_priority = 20;
+  cfg.lookupValue("modem.phy.main_thread_priority_rt", thread_param.sched_priority);
+
+  spdlog::info("Raising main thread to realtime scheduling priority {}", thread_param.sched_priority);
+
+  int error = pthread_setschedparam(pthread_self(), SCHED_RR, &thread_param);
+  if (error != 0) {
+    spdlog::error("Cannot set main thread priority to realtime: {}. Thread will run at default priority.", strerror(error));
+  }
+  thread_placement.place(ThreadPlacement::ThreadClass::Main, pthread_self(), "modem");
+
   // Start receiving sample data
   sdr.start();
+  thread_placement.report();
 
   // Variables to store the measure BLER of PDSCH and MCH/MCCH. 
   uint32_t mch_bler_global = 0;
@@ -416,74 +606,104 @@ auto main(int argc, char **argv) -> int {
   uint32_t measurement_interval = measurement_interval_f * 1000;
   uint32_t tick = 0;
 
+  // MBSFN bandwidth to capture at right after the cell search, if it is known to be wider than the CAS
+  unsigned expected_mbsfn_nof_prb = 0;
+  cfg.lookupValue("modem.phy.mbsfn_nof_prb", expected_mbsfn_nof_prb);
+
+  // Sample clock drift compensation: the SFO tracked by the PHY is integrated into a rate correction for the
+  // SDR's resampler
+  DriftCompensation drift_compensation(cfg);
+  drift_compensation.init();
+
+  // Set when a TTI should be added to the sample file index as soon as possible
+  bool annotate_pending = false;
+
   // Initial state: searching a cell
   state = searching;
 
-  uint8_t mb_idx = 0;
   // Start the main processing loop
   for (;;) { // Only one main loop, any time therè's a change of state we force next iteration with continue. This way there's no need of nested loops within the cases.
     switch (state) {
       case processing: {  // processing
         tti = (tti + 1) % 10240; // Clamp the TTI
         unsigned sfn = tti / 10;
+
+        // Take the next subframe from the sync thread. Its buffer is handed back as soon as the samples have been copied.
+        auto t1 = std::chrono::high_resolution_clock::now();
+        const SyncStage::Subframe* subframe = restart ? nullptr : &sync_stage.next();
+        auto t2 = std::chrono::high_resolution_clock::now();
+        bool received = subframe != nullptr && subframe->ok;
+        float sfo = received ? subframe->sfo : 0;
+        bool discontinuity = received && subframe->discontinuity;
+        uint64_t stream_end = received ? subframe->stream_end : 0;
+
         if (phy.is_cas_subframe(tti)) {
-          // Get the samples from the SDR interface, hand them to a CAS processor, and start it
-          // on a thread from the pool.
-          if (!restart && phy.get_next_frame(cas_processor.get_rx_buffer_and_lock(), cas_processor.rx_buffer_size())) {
+          // Hand the samples to a CAS processor, and start it on a thread from the pool.
+          if (received) {
+            auto cas_slot = cas_pool.acquire();
+            auto cas_buffer = cas_slot->processor->get_rx_buffer();
+            copy_subframe(*subframe, cas_buffer, cas_slot->processor->rx_buffer_size(), rx_channels,
+                cas_slot->processor->rx_history());
+            sync_stage.release();
+            subframe = nullptr;
             spdlog::debug("sending tti {} to regular processor", tti);
-            pool.push([ObjectPtr = &cas_processor, tti, &rest_handler] {
-                if (ObjectPtr->process(tti)) {
-                // Set constellation diagram data and rx params for CAS in the REST API handler
-                rest_handler.add_cinr_value(ObjectPtr->cinr_db());
-                }
-            });
+            cas_pool.submit(cas_slot);
+            pool.post({process_cas_subframe, nullptr, cas_slot, &rest_handler, tti, 0, 0});
 
 
             if (phy.nof_mbsfn_prb() != mbsfn_nof_prb)
             {
               // Handle the non-LTE bandwidths (6, 7 and 8 MHz). In these cases, CAS stays at the original bandwidth, but the MBSFN
-              // portion of the frames can be wider. We need to...
-
+              // portion of the frames can be wider.
               mbsfn_nof_prb = phy.nof_mbsfn_prb();
 
-              // ...adjust the SDR's sample rate to fit the wider MBSFN bandwidth...
-              unsigned new_srate = srsran_sampling_freq_hz(mbsfn_nof_prb);
-              spdlog::info("Setting sample rate {} Mhz for MBSFN with {} PRB / {} Mhz channel width", new_srate/1000000.0, mbsfn_nof_prb,
-                  mbsfn_nof_prb * 0.2);
-              sdr.stop();
-
-              bandwidth = (mbsfn_nof_prb * 200000) * 1.2;
-              sdr.tune(frequency, new_srate, bandwidth, gain, antenna, use_agc);
-
-              // ... configure the PHY and CAS processor to decode a narrow CAS and wider MBSFN, and move back to syncing state
-              // after reconfiguring and restarting the SDR.
-              phy.set_cell();
-              cas_processor.set_cell(phy.cell());
-
-              sdr.start();
-              spdlog::info("Synchronizing subframe after PRB extension");
-              state = syncing;
+              if (srsran_symbol_sz(mbsfn_nof_prb) == srsran_symbol_sz(capture_nof_prb)) {
+                // The SDR already runs at the sample rate for this bandwidth (see modem.phy.mbsfn_nof_prb), so there is no
+                // need to restart it and resynchronize. The CAS processor decimates the CAS subframes to their narrower rate.
+                spdlog::info("MBSFN bandwidth of {} PRB fits the current sample rate", mbsfn_nof_prb);
+                set_cas_cell(cas_pool, cas_processor, phy.cell());
+              } else {
+                // Otherwise we need to adjust the SDR's sample rate to fit the wider MBSFN bandwidth...
+                sync_stage.stop();
+                capture_nof_prb = mbsfn_nof_prb;
+                unsigned new_srate = srsran_sampling_freq_hz(mbsfn_nof_prb);
+                spdlog::info("Setting sample rate {} Mhz for MBSFN with {} PRB / {} Mhz channel width", new_srate/1000000.0, mbsfn_nof_prb,
+                    mbsfn_nof_prb * 0.2);
+
+                bandwidth = (mbsfn_nof_prb * 200000) * 1.2;
+                sdr.retune(frequency, new_srate, bandwidth, gain, antenna, use_agc);
+
+                // ... configure the PHY and CAS processor to decode a narrow CAS and wider MBSFN, and move back to syncing state
+                // after reconfiguring the SDR.
+                phy.set_cell();
+                set_cas_cell(cas_pool, cas_processor, phy.cell());
+
+                spdlog::info("Synchronizing subframe after PRB extension");
+                state = syncing;
+              }
             }
           } else {
             // Failed to receive data, or sync lost. Go back to searching state.
             spdlog::warn("Synchronization lost while processing. Going back to searching state.");
             sync_losses++;
             state = syncing;
-            auto t2 = std::chrono::high_resolution_clock::now();
           }
         } else {
           // All other frames in FeMBMS dedicated mode are MBSFN frames.
-          spdlog::debug("sending tti {} to mbsfn proc {}", tti, mb_idx);
-
-          // Get the samples from the SDR interface, hand them to an MNSFN processor, and start it
-          // on a thread from the pool. Getting the buffer pointer from the pool also locks this processor.
-          auto t1 = std::chrono::high_resolution_clock::now();
-          auto t2 = t1;
-          if (!restart && phy.get_next_frame(mbsfn_processors[mb_idx]->get_rx_buffer_and_lock(), mbsfn_processors[mb_idx]->rx_buffer_size())) {
-            t2 = std::chrono::high_resolution_clock::now();
-            if (phy.mcch_configured() && phy.is_mbsfn_subframe(tti)) {
+          // Hand the samples to the next idle MBSFN processor, and start it on a thread from the pool.
+          // If no processor can be had in time, the subframe is dropped.
+          if (received) {
+            unsigned mch_idx = 0;
+            auto priority = shedder.classify(phy, tti, mch_idx);
+            auto mbsfn_slot = shedder.admit(mbsfn_pool, priority);
+            auto mbsfn_processor = mbsfn_slot != nullptr ? mbsfn_slot->processor : nullptr;
+            if (mbsfn_slot == nullptr) {
+              spdlog::debug("dropping tti {} ({}), no idle mbsfn proc", tti, LoadShedder::priority_name(priority));
+              shedder.count_shed(priority);
+            } else if (phy.mcch_configured() && phy.is_mbsfn_subframe(tti)) {
+              spdlog::debug("sending tti {} to mbsfn proc {}", tti, mbsfn_slot->index);
               // If data frm SIB1/SIB13 has been received in CAS, configure the processors accordingly
-              if (!mbsfn_processors[mb_idx]->mbsfn_configured()) {
+              if (!mbsfn_processor->mbsfn_configured()) {
                 srsran_scs_t scs = SRSRAN_SCS_15KHZ;
                 switch (phy.mbsfn_subcarrier_spacing()) {
                   case Phy::SubcarrierSpacing::df_15kHz:  scs = SRSRAN_SCS_15KHZ; break;
@@ -492,16 +712,20 @@ auto main(int argc, char **argv) -> int {
                 }
                 auto cell = phy.cell();
                 cell.nof_prb = cell.mbsfn_prb;
-                mbsfn_processors[mb_idx]->set_cell(cell);
-                mbsfn_processors[mb_idx]->configure_mbsfn(phy.mbsfn_area_id(), scs);
+                mbsfn_processor->set_cell(cell);
+                mbsfn_processor->configure_mbsfn(phy.mbsfn_area_id(), scs);
               }
-              pool.push([ObjectPtr = mbsfn_processors[mb_idx], tti] {
-                ObjectPtr->process(tti);
-              });
+              copy_subframe(*subframe, mbsfn_processor->get_rx_buffer(), mbsfn_processor->rx_buffer_size(), rx_channels);
+              // Padding carries no data, so there is nothing to wait for
+              mbsfn_processor->set_reorder_entry(priority != LoadShedder::Priority::Padding ? mch_reorder.reserve(mch_idx, tti) : nullptr);
+              mbsfn_pool.submit(mbsfn_slot);
+              auto deadline = shedder.deadline_ns(priority, subframe->received_ns);
+              pool.post({process_mbsfn_subframe, deadline > 0 ? drop_mbsfn_subframe : nullptr, mbsfn_slot, &shedder,
+                  tti, static_cast<uint32_t>(priority), deadline});
             } else {
               // Nothing to do yet, we lack the data from SIB1/SIB13
-              // Discard the samples and unlock the processor.
-              mbsfn_processors[mb_idx]->unlock();
+              // Discard the samples and hand the processor back.
+              mbsfn_pool.release(mbsfn_slot);
             }
           } else {
             // Failed to receive data, or sync lost. Go back to searching state.
@@ -509,17 +733,45 @@ auto main(int argc, char **argv) -> int {
             sync_losses++; 
             state = syncing;
           }
-          mb_idx = static_cast<int>((mb_idx + 1) % thread_cnt);
+        }
+        if (subframe != nullptr) {
+          sync_stage.release();
+        }
+
+        // If the SDR dropped samples, our timing is off by an unknown amount. Resynchronize right away instead
+        // of waiting for the decoding to fail.
+        if (state == processing && discontinuity) {
+          spdlog::warn("Discontinuity in the sample stream. Resynchronizing.");
+          sync_stage.stop();
+          phy.reset_sync();
+          sync_losses++;
+          state = syncing;
+        }
+
+        // Keep the subframe timing locked to the transmitter's clock, instead of letting it drift until sync is lost
+        if (state == processing && sdr.drift_compensation() &&
+            drift_compensation.update(tti, sfo, sdr.get_sample_rate())) {
+          sdr.set_rate_correction(drift_compensation.correction_ppm());
+          spdlog::debug("SFO residual {:.3f} ppm, rate correction {:.3f} ppm", drift_compensation.residual_ppm(),
+              drift_compensation.correction_ppm());
+        }
+
+        // Index the sample file being written: the first subframe after synchronisation, and then once a second
+        if (state == processing && (annotate_pending || tti % 1000 == 0)) {
+          annotate_pending = !sdr.annotate_tti(tti, stream_end, phy.cell());
+        }
+
+        // The Phy's sync is back in the hands of the main loop
+        if (state != processing) {
+          sync_stage.stop();
         }
       }
       break;
       
       case searching: {
         if (restart) { // Triggered from the rt-wui
-          sdr.stop();
           sample_rate = search_sample_rate;  // sample rate for searching
-          sdr.tune(frequency, sample_rate, bandwidth, gain, antenna, use_agc);
-          sdr.start();
+          sdr.retune(frequency, sample_rate, bandwidth, gain, antenna, use_agc);
         }
 
         // We're at the search sample rate, and there's no point in creating a sample file. rtop the sample writer, if enabled.
@@ -528,31 +780,40 @@ auto main(int argc, char **argv) -> int {
         // In searching state, clear the receive buffer and try to find a cell at the configured frequency and synchronize with it
         restart = false;
        // sdr.clear_buffer();
-        bool cell_found = phy.cell_search();
+        bool cell_found = false;
+        if (use_recorded_cell) {
+          // The cell parameters are known from the sample file metadata, no need to search
+          use_recorded_cell = false;
+          cell_found = phy.set_known_cell(recorded_cell);
+        } else {
+          cell_found = phy.cell_search();
+        }
         if (cell_found) {
           // A cell has been found. We now know the required number of PRB = bandwidth of the carrier. Set the approproiate
           // sample rate...
           cas_nof_prb = mbsfn_nof_prb = phy.nr_prb();
 
-          if (arguments.sample_file && arguments.file_bw) {
+          if (replaying && file_nof_prb) {
             // Samples files are recorded at a fixed sample rate that can be determined from the bandwidth command line argument.
             // If we're decoding from file, do not readjust the rate to match the CAS PRBs, but stay at this rate and instead configure the
             // PHY to decode a narrow CAS from a wider channel.
-            mbsfn_nof_prb = arguments.file_bw * 5;
+            mbsfn_nof_prb = capture_nof_prb = file_nof_prb;
             phy.set_nof_mbsfn_prb(mbsfn_nof_prb);
             phy.set_cell();
           } else {
-            // When decoding from the air, configure the SDR accordingly
-            unsigned new_srate = srsran_sampling_freq_hz(cas_nof_prb);
-            spdlog::info("Setting sample rate {} Mhz for {} PRB / {} Mhz channel width", new_srate/1000000.0, phy.nr_prb(),
-                phy.nr_prb() * 0.2);
-            sdr.stop();
-            sdr.clear_buffer();
-            bandwidth = (cas_nof_prb * 200000) * 1.2;
-            sdr.tune(frequency, new_srate, bandwidth, gain, antenna, use_agc);
-            //sleep(1);
-
-            sdr.start();
+            // When decoding from the air, configure the SDR accordingly. If the MBSFN bandwidth is known to be wider,
+            // capture at its rate right away, so there's no need to retune once it has been signalled in SIB13.
+            capture_nof_prb = std::max(cas_nof_prb, expected_mbsfn_nof_prb);
+            if (capture_nof_prb > cas_nof_prb) {
+              mbsfn_nof_prb = capture_nof_prb;
+              phy.set_nof_mbsfn_prb(mbsfn_nof_prb);
+              phy.set_cell();
+            }
+            unsigned new_srate = srsran_sampling_freq_hz(capture_nof_prb);
+            spdlog::info("Setting sample rate {} Mhz for {} PRB / {} Mhz channel width", new_srate/1000000.0, capture_nof_prb,
+                capture_nof_prb * 0.2);
+            bandwidth = (capture_nof_prb * 200000) * 1.2;
+            sdr.retune(frequency, new_srate, bandwidth, gain, antenna, use_agc);
           }
           spdlog::debug("Synchronizing subframe");
           // ... and move to syncing state.
@@ -580,23 +841,24 @@ auto main(int argc, char **argv) -> int {
           spdlog::info("Decoded MIB at target sample rate, TTI is {}. Subframe synchronized, sync lost in TTI {}, {} subframes lost, {} total subframe lost, sync losses {}.", phy.tti(), tti, (((phy.tti() < tti) * 10240 +  phy.tti())-tti) * cas_processor.is_started(), lost_subframes, sync_losses);
 
           // Set the cell parameters in the CAS processor, and set started to true
-          cas_processor.set_cell(phy.cell());
-
-          for (int i = 0; i < thread_cnt; i++) {
-            mbsfn_processors[i]->unlock();
-          }
-          cas_processor.unlock(); // We need to unlock because we felt here from processing after calling get_rx_buffer_and_lock()
+          set_cas_cell(cas_pool, cas_processor, phy.cell());
 
           // Get the initial TTI / subframe ID (= system frame number * 10 + subframe number)
           tti = phy.tti();
           // Reset the RRC
           rrc.reset();
 
+          // Sample stream discontinuities before this point have been handled by the synchronization. From here on,
+          // the sync thread reads the samples and flags them per subframe.
+          sdr.take_discontinuity();
+
           // Ready to receive actual data. Go to processing state.
           state = processing;
+          sync_stage.start();
 
           // If sample file creation is enabled, start writing out samples now that we're at the target sample rate
           sdr.enableSampleFileWriting();
+          annotate_pending = true;
         }
       }
       break;
@@ -617,7 +879,7 @@ auto main(int argc, char **argv) -> int {
         cols.push_back(std::to_string((float)rest_handler.cinr_db()));
 
         // Wait to finish and lock, we don't want to update total and errors independently. Yes, it's a blocking solution, but, what other way is possible?
-        cas_processor.lock();
+        cas_pool.pause();
         
         spdlog::info("PDSCH: MCS {}, BLER {}",
             rest_handler._pdsch.mcs,
@@ -631,12 +893,10 @@ auto main(int argc, char **argv) -> int {
         rest_handler._pdsch.errors = 0;
         rest_handler._pdsch.total = 0;
         // We are done with the CAS
-        cas_processor.unlock();
+        cas_pool.resume();
         
         // Wait for all the mbsfn processors to finish, to avoid having an update on total or errors while accesing to the values that leads to having a wrong BLER.
-        for (int i = 0; i < thread_cnt; i++) {
-            mbsfn_processors[i]->lock();
-        }
+        mbsfn_pool.pause();
         spdlog::info("MCCH: MCS {}, BLER {}",
             rest_handler._mcch.mcs,
             ((rest_handler._mcch.errors > 0 && rest_handler._mcch.total > 0) ? (rest_handler._mcch.errors * 1.0) / (rest_handler._mcch.total * 1.0) : 0));
@@ -682,10 +942,21 @@ auto main(int argc, char **argv) -> int {
         mcch_total_global += rest_handler._mcch.total;
         rest_handler._mcch.errors = 0;
         rest_handler._mcch.total = 0;
-        // We can unlock cas and mbsfn processor at this point, every variable has been saved in the rest_handler.
-        for (int i = 0; i < thread_cnt; i++) {
-          mbsfn_processors[i]->unlock();
-        }
+        // We can release the mbsfn processors at this point, every variable has been saved in the rest_handler.
+        mbsfn_pool.resume();
+
+        spdlog::info("Frame processors: MBSFN max queue depth {}/{}, {} stalls ({} ms), CAS {} stalls ({} ms)",
+            mbsfn_pool.max_depth(), mbsfn_pool.size(), mbsfn_pool.stalls(), mbsfn_pool.stall_us() / 1000,
+            cas_pool.stalls(), cas_pool.stall_us() / 1000);
+        spdlog::info("Sync thread: {} subframes received, up to {}/{} queued, {} times full",
+            sync_stage.received(), sync_stage.max_queued(), sync_stage.depth(), sync_stage.full());
+        spdlog::info("MCH delivery: {} in order, {} skipped ({} decoded late), {} reorder overflows",
+            mch_reorder.delivered(), mch_reorder.skipped(), mch_reorder.late(), mch_reorder.overflows());
+        spdlog::info("Dropped MBSFN subframes: {} padding, {} unselected MCH, {} MCH ({} past their deadline)",
+            shedder.shed(LoadShedder::Priority::Padding) + shedder.late(LoadShedder::Priority::Padding),
+            shedder.shed(LoadShedder::Priority::UnselectedMch) + shedder.late(LoadShedder::Priority::UnselectedMch),
+            shedder.shed(LoadShedder::Priority::Mch) + shedder.late(LoadShedder::Priority::Mch),
+            pool.late_count());
       } else if (state == syncing) { // In syncing and searching states we place in every row and column NaN, this way is easier to process after, since every time measured theres always a row in the csv.
         cols.emplace_back(std::string("NOT SYNC - SYNCING...")); 
         cols.emplace_back(std::string("nan")); 
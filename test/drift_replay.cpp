@@ -0,0 +1,150 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// Replays a recording with a drifting sample clock through the drift compensation loop.
+//
+// The recording is a tone, resampled by the SDR clock error to simulate the drift. The replay goes
+// through a FractionalResampler whose ratio follows DriftCompensation, as in SdrReader. The residual
+// SFO is measured from the phase advance of the tone over half a subframe, and smoothed with an EMA
+// like the PHY's SFO tracking. The timing slip is the phase of the tone against a clock at the exact
+// sample rate, converted to samples.
+//
+// Fails if the rate correction does not converge to the injected drift (or to the limit, if the
+// drift exceeds it), or if the timing still slips by a sample after convergence.
+
+#include <cinttypes>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "DriftCompensation.h"
+#include "FractionalResampler.h"
+
+namespace {
+const double kSampleRate = 1.92e6;
+const unsigned kSubframe = 1920;
+const double kTone = kSampleRate / 8;
+const unsigned kSubframes = 6000;
+const double kSfoEma = 0.1;
+const double kConvergedPpm = 0.5;
+const double kMaxSlip = 1.0;
+
+struct Result {
+  double correction_ppm;
+  unsigned converged_tti;  // first TTI from which the correction stays within kConvergedPpm
+  double slip;             // timing slip over the second half of the replay, in samples
+};
+
+auto replay(double drift_ppm, const libconfig::Config& cfg, bool compensate) -> Result {
+  DriftCompensation drift(cfg);
+  drift.init();
+
+  // The SDR clock is drift_ppm fast, so it takes more samples than the transmitter sends
+  FractionalResampler recording(1);
+  recording.set_ratio(1.0 / (1.0 + drift_ppm * 1e-6));
+  FractionalResampler replay(1);
+  replay.set_ratio(1.0);
+
+  std::vector<cf_t> tone(kSubframe);
+  std::vector<cf_t> drifted(recording.max_output(kSubframe));
+  std::vector<cf_t> corrected(replay.max_output(drifted.size()));
+  std::vector<cf_t> subframe;
+  subframe.reserve(2 * kSubframe + corrected.size());
+
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  double sfo = 0;
+  double expected_ppm = std::min(std::max(drift_ppm, -50.0), 50.0);
+  Result result = { 0, kSubframes, 0 };
+  double phase = 0;
+  double last_phase = 0;
+  double phase_at_half = 0;
+  for (uint32_t tti = 0; tti < kSubframes; ) {
+    for (unsigned i = 0; i < kSubframe; i++) {
+      tone[i] = std::polar(1.0f, static_cast<float>(fmod(2 * M_PI * kTone / kSampleRate * (sent + i), 2 * M_PI)));
+    }
+    sent += kSubframe;
+    const void* in[] = { tone.data() };
+    void* out[] = { drifted.data() };
+    auto nof_drifted = recording.resample(in, kSubframe, out);
+    in[0] = drifted.data();
+    out[0] = corrected.data();
+    auto nof_corrected = replay.resample(in, nof_drifted, out);
+    subframe.insert(subframe.end(), corrected.begin(), corrected.begin() + nof_corrected);
+
+    while (subframe.size() >= kSubframe && tti < kSubframes) {
+      // The tone advances by a multiple of 2 pi over half a subframe, so the phase left over is the residual
+      std::complex<double> acc = 0;
+      for (unsigned i = 0; i < kSubframe / 2; i++) {
+        acc += std::complex<double>(subframe[i + kSubframe / 2]) * std::conj(std::complex<double>(subframe[i]));
+      }
+      auto residual_ppm = -std::arg(acc) / (2 * M_PI * kTone / kSampleRate * kSubframe / 2) * 1e6;
+      sfo = (1 - kSfoEma) * sfo + kSfoEma * residual_ppm * 1e-6 * kSampleRate;
+
+      // Phase of the first sample against the exact sample clock, unwrapped
+      auto reference = std::polar(1.0, -2 * M_PI * kTone / kSampleRate * static_cast<double>(received % 8));
+      auto p = std::arg(std::complex<double>(subframe[0]) * reference);
+      phase += std::remainder(p - last_phase, 2 * M_PI);
+      last_phase = p;
+      if (tti == kSubframes / 2) {
+        phase_at_half = phase;
+      }
+
+      if (compensate && drift.update(tti, static_cast<float>(sfo), kSampleRate)) {
+        replay.adjust_ratio(1.0 + drift.correction_ppm() * 1e-6);
+      }
+      if (std::abs(drift.correction_ppm() - expected_ppm) > kConvergedPpm) {
+        result.converged_tti = kSubframes;
+      } else if (result.converged_tti == kSubframes) {
+        result.converged_tti = tti;
+      }
+
+      subframe.erase(subframe.begin(), subframe.begin() + kSubframe);
+      received += kSubframe;
+      tti++;
+    }
+  }
+
+  result.correction_ppm = drift.correction_ppm();
+  result.slip = -(phase - phase_at_half) / (2 * M_PI * kTone / kSampleRate);
+  return result;
+}
+}  // namespace
+
+auto main() -> int {
+  // Default limit of 50 ppm
+  libconfig::Config cfg;
+
+  bool ok = true;
+  for (double drift_ppm : { 20.0, -35.0, 2.5, 80.0 }) {
+    auto uncompensated = replay(drift_ppm, cfg, false);
+    auto result = replay(drift_ppm, cfg, true);
+    auto limited = std::abs(drift_ppm) > 50.0;
+    auto pass = result.converged_tti < kSubframes && (limited || std::abs(result.slip) < kMaxSlip);
+    printf("drift %+6.1f ppm: correction %+7.3f ppm, converged after %u subframes, slip over %u subframes %+.2f samples "
+        "(%+.1f uncompensated)%s\n",
+        drift_ppm, result.correction_ppm, result.converged_tti, kSubframes / 2, result.slip, uncompensated.slip,
+        pass ? "" : " FAILED");
+    ok &= pass;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// Stress test for the lock-free SPSC MultichannelRingbuffer.
+//
+// A producer thread commits chunks of varying size at a fixed pace, like the SDR reader thread, into a
+// small ring that wraps around every few chunks. Channel 0 carries a running sample counter, channel 1
+// the time of the commit. The consumer reads in chunks of a different size and checks that the counter
+// is contiguous. The time from commit to the consumer
+// having the samples is reported as percentiles, which is the jitter the reader thread sees.
+//
+// Returns 1 if any sample was lost, duplicated or reordered.
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "MultichannelRingbuffer.h"
+
+namespace {
+const size_t kSample = sizeof(uint64_t);
+const size_t kRingSamples = 8192;
+const size_t kChunks = 20000;
+const size_t kMaxChunk = 1500;
+const size_t kReadSamples = 1920;
+const auto kPeriod = std::chrono::microseconds(50);
+
+auto now_ns() -> uint64_t {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void produce(MultichannelRingbuffer& ring, uint64_t total) {
+  uint64_t counter = 0;
+  size_t chunk = 0;
+  auto next = std::chrono::steady_clock::now();
+  while (counter < total) {
+    // Chunk sizes that are not a divisor of the ring size, so the wrap point moves around
+    auto samples = std::min<uint64_t>(1 + (chunk++ * 7919) % kMaxChunk, total - counter);
+    size_t done = 0;
+    while (done < samples) {
+      size_t writeable = 0;
+      auto buffers = ring.write_head(&writeable);
+      writeable = std::min(writeable / kSample, static_cast<size_t>(samples - done));
+      if (writeable == 0) {
+        std::this_thread::yield();
+        continue;
+      }
+      auto counters = static_cast<uint64_t*>(buffers[0]);
+      auto times = static_cast<uint64_t*>(buffers[1]);
+      auto t = now_ns();
+      for (size_t i = 0; i < writeable; i++) {
+        counters[i] = counter + done + i;
+        times[i] = t;
+      }
+      ring.commit(writeable * kSample);
+      done += writeable;
+    }
+    counter += samples;
+    next += kPeriod;
+    std::this_thread::sleep_until(next);
+  }
+}
+
+auto percentile(std::vector<uint64_t>& values, double p) -> double {
+  auto idx = std::min(values.size() - 1, static_cast<size_t>(p / 100.0 * values.size()));
+  std::nth_element(values.begin(), values.begin() + idx, values.end());
+  return values[idx] / 1000.0;
+}
+
+auto run(bool mirrored) -> bool {
+  MultichannelRingbuffer ring(kRingSamples * kSample, 2, mirrored);
+  uint64_t total = kChunks * (kMaxChunk / 2);
+  total -= total % kReadSamples;
+
+  std::thread producer(produce, std::ref(ring), total);
+
+  std::vector<uint64_t> counters(kReadSamples);
+  std::vector<uint64_t> times(kReadSamples);
+  std::vector<char*> dest = { reinterpret_cast<char*>(counters.data()), reinterpret_cast<char*>(times.data()) };
+  std::vector<uint64_t> latency;
+  latency.reserve(total / kReadSamples);
+
+  uint64_t expected = 0;
+  uint64_t errors = 0;
+  while (expected < total) {
+    if (!ring.wait_readable(kReadSamples * kSample, std::chrono::seconds(5))) {
+      fprintf(stderr, "Timeout waiting for samples at counter %" PRIu64 "\n", expected);
+      errors++;
+      break;
+    }
+    auto t = now_ns();
+    ring.read(dest, kReadSamples * kSample);
+
+    // The last sample of the read is the most recent one, so its commit time gives the wakeup latency
+    latency.push_back(t - std::min(t, times[kReadSamples - 1]));
+    for (size_t i = 0; i < kReadSamples; i++) {
+      if (counters[i] != expected + i) {
+        if (errors++ < 10) {
+          fprintf(stderr, "Expected sample %" PRIu64 ", got %" PRIu64 "\n", expected + i, counters[i]);
+        }
+      }
+    }
+    expected += kReadSamples;
+  }
+  producer.join();
+
+  printf("%-8s: %" PRIu64 " samples, %" PRIu64 " errors, latency p50 %.1f us, p99 %.1f us, "
+      "p99.9 %.1f us, max %.1f us\n",
+      ring.mirrored() ? "mirrored" : "regular", expected, errors,
+      percentile(latency, 50), percentile(latency, 99), percentile(latency, 99.9), percentile(latency, 100));
+  return errors == 0;
+}
+}  // namespace
+
+auto main() -> int {
+  bool ok = run(false);
+  ok &= run(true);
+  return ok ? 0 : 1;
+}
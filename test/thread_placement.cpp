@@ -0,0 +1,294 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// Test and jitter benchmark for ThreadPlacement.
+//
+// The placement checks use the CPUs this test may run on: the first one for the main thread class,
+// the last one for the PHY workers. They check that:
+// - threads end up on the CPUs of their class, and housekeeping gets the CPUs left over
+// - nothing is pinned without a cpu_affinity section
+// - invalid lists, and CPUs outside of the cpuset, pin nothing
+// - placing a thread under the same name again replaces its record
+// - an isolated CPU, which is in the cpuset but not in the inherited affinity, is used if it is
+//   listed, and not otherwise. This runs against a fake /proc and /sys tree with one CPU more than
+//   the test has; threads are only actually moved to it if the machine has that CPU.
+//
+// The benchmark runs a 1 ms periodic thread, like the main loop, next to a busy thread on every CPU.
+// It is run unpinned, then pinned with the busy threads on the housekeeping CPUs, and the wakeup
+// latency percentiles of both runs are printed. With a single CPU there is nothing to separate.
+//
+// Returns 1 if a placement check fails.
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <libconfig.h++>
+
+#include "ThreadPlacement.h"
+#include "spdlog/spdlog.h"
+
+namespace {
+const unsigned kPeriods = 1000;
+const auto kPeriod = std::chrono::milliseconds(1);
+
+using ThreadClass = ThreadPlacement::ThreadClass;
+
+bool ok = true;
+
+void check(bool condition, const std::string& what) {
+  if (!condition) {
+    fprintf(stderr, "FAILED: %s\n", what.c_str());
+    ok = false;
+  }
+}
+
+auto affinity_of(pthread_t thread) -> std::vector<unsigned> {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  pthread_getaffinity_np(thread, sizeof(set), &set);
+  std::vector<unsigned> cpus;
+  for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+auto config(const std::string& affinity) -> std::string {
+  return "modem: { cpu_affinity: { " + affinity + " }; };";
+}
+
+// Runs fn on a new thread, which starts out with the CPUs of the calling thread
+template <class Fn>
+void on_thread(Fn&& fn) {
+  std::thread thread(std::forward<Fn>(fn));
+  thread.join();
+}
+
+void test_placement(const std::vector<unsigned>& allowed) {
+  auto first = std::to_string(allowed.front());
+  auto last = std::to_string(allowed.back());
+
+  {
+    libconfig::Config cfg;
+    ThreadPlacement placement(cfg);
+    on_thread([&] {
+      placement.place(ThreadClass::Main, pthread_self(), "main");
+      check(affinity_of(pthread_self()) == allowed, "without cpu_affinity, a thread keeps all CPUs");
+    });
+    check(placement.cpus(ThreadClass::Main).empty() && placement.cpus(ThreadClass::Housekeeping).empty(),
+        "without cpu_affinity, no class is pinned");
+  }
+
+  {
+    libconfig::Config cfg;
+    cfg.readString(config("main = \"" + first + "\"; phy = \"" + last + "\";"));
+    ThreadPlacement placement(cfg);
+    on_thread([&] {
+      placement.place(ThreadClass::Main, pthread_self(), "main");
+      check(affinity_of(pthread_self()) == std::vector<unsigned>{ allowed.front() }, "main thread on CPU " + first);
+    });
+    on_thread([&] {
+      placement.place(ThreadClass::Phy, pthread_self(), "phy-0");
+      check(affinity_of(pthread_self()) == std::vector<unsigned>{ allowed.back() }, "PHY thread on CPU " + last);
+    });
+    on_thread([&] {
+      placement.place(ThreadClass::SdrReader, pthread_self(), "sdr");
+      check(!affinity_of(pthread_self()).empty(), "an unpinned class runs on the non-isolated CPUs");
+    });
+    on_thread([&] {
+      placement.place(ThreadClass::Housekeeping, pthread_self(), "rest");
+      auto cpus = affinity_of(pthread_self());
+      check(!cpus.empty(), "housekeeping gets CPUs");
+      if (allowed.size() > 2 && placement.isolated_cpus().empty()) {
+        check(std::find(cpus.begin(), cpus.end(), allowed.front()) == cpus.end() &&
+            std::find(cpus.begin(), cpus.end(), allowed.back()) == cpus.end(), "housekeeping excludes the assigned CPUs");
+      }
+    });
+
+    on_thread([&] { placement.place(ThreadClass::Phy, pthread_self(), "main"); });
+    auto placements = placement.placements();
+    check(placements.size() == 4, "placing a thread under the same name replaces it");
+    check(std::any_of(placements.begin(), placements.end(), [](const ThreadPlacement::Placement& p) {
+      return p.name == "main" && p.thread_class == ThreadClass::Phy;
+    }), "the replaced placement has the new class");
+  }
+
+  {
+    libconfig::Config cfg;
+    cfg.readString(config("main = \"2-1\"; phy = \"x\"; sdr_reader = \"" + std::to_string(CPU_SETSIZE - 1) + "\";"));
+    ThreadPlacement placement(cfg);
+    check(placement.cpus(ThreadClass::Main).empty(), "a reversed range pins nothing");
+    check(placement.cpus(ThreadClass::Phy).empty(), "an invalid list pins nothing");
+    check(allowed.back() == CPU_SETSIZE - 1 || placement.cpus(ThreadClass::SdrReader).empty(),
+        "CPUs outside of the cpuset are ignored");
+  }
+
+  printf("placement: %zu CPU(s), %s\n", allowed.size(), ok ? "all checks passed" : "FAILED");
+}
+
+void write_file(const std::string& path, const std::string& content) {
+  auto dir = path.substr(0, path.rfind('/'));
+  for (auto pos = dir.find('/', 1); ; pos = dir.find('/', pos + 1)) {
+    mkdir(dir.substr(0, pos).c_str(), 0755);
+    if (pos == std::string::npos) {
+      break;
+    }
+  }
+  std::ofstream(path) << content << "\n";
+}
+
+void test_isolated(const std::vector<unsigned>& allowed) {
+  // Started on the allowed CPUs, with the next one isolated, as with isolcpus
+  auto isolated = allowed.back() + 1;
+  auto isolated_list = std::to_string(isolated);
+  char root_template[] = "/tmp/thread_placement.XXXXXX";
+  std::string root = mkdtemp(root_template);
+  write_file(root + "/proc/self/cgroup", "0::/modem.slice");
+  write_file(root + "/sys/fs/cgroup/cpuset.cpus.effective", "0-" + isolated_list);
+  write_file(root + "/sys/devices/system/cpu/isolated", isolated_list);
+
+  bool present = false;
+  on_thread([&] {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(isolated, &set);
+    present = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+  });
+
+  {
+    libconfig::Config cfg;
+    cfg.readString(config("phy = \"" + isolated_list + "\"; main = \"" + std::to_string(allowed.front()) + "\";"));
+    ThreadPlacement placement(cfg, root);
+    check(placement.isolated_cpus() == isolated_list, "the isolated CPU is read from sysfs");
+    check(placement.cpus(ThreadClass::Phy) == isolated_list, "an isolated CPU that is listed explicitly is used");
+    on_thread([&] {
+      placement.place(ThreadClass::Housekeeping, pthread_self(), "rest");
+      auto cpus = affinity_of(pthread_self());
+      check(!cpus.empty() && std::find(cpus.begin(), cpus.end(), isolated) == cpus.end(),
+          "housekeeping doesn't get the isolated CPU");
+    });
+    if (present) {
+      on_thread([&] {
+        placement.place(ThreadClass::Phy, pthread_self(), "phy-0");
+        check(affinity_of(pthread_self()) == std::vector<unsigned>{ isolated }, "PHY thread on the isolated CPU");
+      });
+    }
+  }
+
+  {
+    libconfig::Config cfg;
+    cfg.readString(config("main = \"" + std::to_string(allowed.front()) + "\";"));
+    ThreadPlacement placement(cfg, root);
+    on_thread([&] {
+      placement.place(ThreadClass::Phy, pthread_self(), "phy-0");
+      auto cpus = affinity_of(pthread_self());
+      check(std::find(cpus.begin(), cpus.end(), isolated) == cpus.end(), "an unlisted isolated CPU is not used");
+    });
+  }
+
+  for (const auto* file : { "/proc/self/cgroup", "/sys/fs/cgroup/cpuset.cpus.effective", "/sys/devices/system/cpu/isolated" }) {
+    unlink((root + file).c_str());
+  }
+  for (const auto* dir : { "/proc/self", "/proc", "/sys/fs/cgroup", "/sys/fs", "/sys/devices/system/cpu",
+      "/sys/devices/system", "/sys/devices", "/sys", "" }) {
+    rmdir((root + dir).c_str());
+  }
+  printf("isolated: CPU %u %s, %s\n", isolated, present ? "present" : "not present, not pinned to it",
+      ok ? "all checks passed" : "FAILED");
+}
+
+auto percentile(std::vector<int64_t> values, double p) -> double {
+  auto idx = std::min(values.size() - 1, static_cast<size_t>(p / 100.0 * values.size()));
+  std::nth_element(values.begin(), values.begin() + idx, values.end());
+  return values[idx] / 1000.0;
+}
+
+void benchmark(const std::vector<unsigned>& allowed, bool pinned) {
+  libconfig::Config cfg;
+  if (pinned) {
+    // The periodic thread gets the last CPU to itself
+    auto own = std::to_string(allowed.back());
+    cfg.readString(config("main = \"" + own + "\";"));
+  }
+  ThreadPlacement placement(cfg);
+
+  std::atomic<bool> running{ true };
+  std::vector<std::thread> load;
+  for (size_t i = 0; i < allowed.size(); i++) {
+    load.emplace_back([&, i] {
+      placement.place(ThreadClass::Housekeeping, pthread_self(), "load-" + std::to_string(i));
+      volatile uint64_t spin = 0;
+      while (running.load(std::memory_order_relaxed)) {
+        spin = spin + 1;
+      }
+    });
+  }
+
+  std::vector<int64_t> latency;
+  on_thread([&] {
+    placement.place(ThreadClass::Main, pthread_self(), "periodic");
+    struct sched_param param = {};
+    param.sched_priority = 1;
+    pthread_setschedparam(pthread_self(), SCHED_RR, &param);
+
+    auto next = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < kPeriods; i++) {
+      next += kPeriod;
+      std::this_thread::sleep_until(next);
+      latency.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - next).count());
+    }
+  });
+
+  running = false;
+  for (auto& thread : load) {
+    thread.join();
+  }
+  printf("%-8s: wakeup latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", pinned ? "pinned" : "unpinned",
+      percentile(latency, 50), percentile(latency, 99), percentile(latency, 99.9), percentile(latency, 100));
+}
+}  // namespace
+
+auto main() -> int {
+  // Invalid lists are logged as errors on purpose
+  spdlog::set_level(spdlog::level::off);
+
+  auto allowed = affinity_of(pthread_self());
+  test_placement(allowed);
+  test_isolated(allowed);
+  benchmark(allowed, false);
+  benchmark(allowed, true);
+  return ok ? 0 : 1;
+}
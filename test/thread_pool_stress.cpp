@@ -0,0 +1,309 @@
+// 5G-MAG Reference Tools
+// MBMS Modem Process
+//
+// Copyright (C) 2021 Klaus Kühnhammer (Österreichische Rundfunksender GmbH & Co KG)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// 
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// Stress test and benchmark for the lock-free job ring in thread_pool.hpp.
+//
+// - Integrity: several producers post far more jobs than the 64 slot ring holds, so posting spins on
+//   a full ring and the slot sequence numbers wrap many times. Every job must run exactly once.
+// - Sleep / wake: the workers are left idle until they sleep on the futex, then woken by bursts of
+//   jobs. A lost wakeup shows up as a burst that does not complete within a second.
+// - Deadlines: jobs past their deadline are dropped if, and only if, they have a drop function.
+// - Benchmark: the cost of posting a job on the main loop and the time until a worker starts it, at a
+//   steady job rate, compared to the mutex / condition variable pool with std::packaged_task that
+//   thread_pool replaced.
+//
+// Returns 1 on a lost, duplicated or wrongly dropped job.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+#include "thread_pool.hpp"
+
+namespace {
+const size_t kWorkers = 4;
+const size_t kProducers = 4;
+const size_t kJobsPerProducer = 50000;
+const size_t kBursts = 500;
+const size_t kBenchmarkJobs = 5000;
+const auto kBenchmarkPeriod = std::chrono::microseconds(100);
+const auto kTimeout = std::chrono::seconds(1);
+
+// The pool before the job ring: a std::function queue behind a mutex, and a future per task
+class locked_pool {
+ public:
+  explicit locked_pool(size_t thread_count) {
+    for (size_t i = 0; i < thread_count; i++) {
+      _workers.emplace_back(&locked_pool::thread_loop, this);
+    }
+  }
+
+  ~locked_pool() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _notifier.notify_all();
+    for (auto& thread : _workers) {
+      thread.join();
+    }
+  }
+
+  template <class Func>
+  auto push(Func&& fn) {
+    auto task = std::make_shared<std::packaged_task<void()>>(std::forward<Func>(fn));
+    auto future = task->get_future();
+    std::unique_lock<std::mutex> lock(_mutex);
+    _tasks.emplace([task]() { (*task)(); });
+    lock.unlock();
+    _notifier.notify_one();
+    return future;
+  }
+
+ private:
+  void thread_loop() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notifier.wait(lock, [this] { return !_tasks.empty() || _stop; });
+        if (_tasks.empty()) {
+          return;
+        }
+        task = std::move(_tasks.front());
+        _tasks.pop();
+      }
+      task();
+    }
+  }
+
+  bool _stop = false;
+  std::mutex _mutex;
+  std::condition_variable _notifier;
+  std::queue<std::function<void()>> _tasks;
+  std::vector<std::thread> _workers;
+};
+
+struct Counters {
+  std::vector<std::atomic<uint32_t>> runs;
+  std::vector<int64_t> posted;
+  std::vector<int64_t> started;
+  std::atomic<uint64_t> ran{0};
+  std::atomic<uint64_t> dropped{0};
+
+  explicit Counters(size_t jobs) : runs(jobs), posted(jobs), started(jobs) {}
+};
+
+void count_job(const thread_pool::job& j) {
+  auto counters = static_cast<Counters*>(j.object);
+  counters->started[j.tti] = thread_pool::now_ns();
+  counters->runs[j.tti].fetch_add(1, std::memory_order_relaxed);
+  counters->ran.fetch_add(1, std::memory_order_release);
+}
+
+void drop_job(const thread_pool::job& j) {
+  auto counters = static_cast<Counters*>(j.object);
+  counters->dropped.fetch_add(1, std::memory_order_release);
+}
+
+auto wait_for(const std::atomic<uint64_t>& value, uint64_t target) -> bool {
+  auto deadline = std::chrono::steady_clock::now() + kTimeout;
+  while (value.load(std::memory_order_acquire) < target) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+auto percentile(std::vector<int64_t> values, double p) -> double {
+  auto idx = std::min(values.size() - 1, static_cast<size_t>(p / 100.0 * values.size()));
+  std::nth_element(values.begin(), values.begin() + idx, values.end());
+  return values[idx] / 1000.0;
+}
+
+auto make_job(Counters& counters, uint32_t idx) -> thread_pool::job {
+  return thread_pool::job{count_job, nullptr, &counters, nullptr, idx, 0, 0};
+}
+
+auto test_integrity() -> bool {
+  Counters counters(kProducers * kJobsPerProducer);
+  {
+    thread_pool pool(kWorkers);
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < kProducers; p++) {
+      producers.emplace_back([&pool, &counters, p] {
+        for (size_t i = 0; i < kJobsPerProducer; i++) {
+          pool.post(make_job(counters, p * kJobsPerProducer + i));
+        }
+      });
+    }
+    for (auto& producer : producers) {
+      producer.join();
+    }
+    wait_for(counters.ran, counters.runs.size());
+  }
+
+  uint64_t errors = 0;
+  for (size_t i = 0; i < counters.runs.size(); i++) {
+    auto runs = counters.runs[i].load();
+    if (runs != 1 && errors++ < 10) {
+      fprintf(stderr, "Job %zu ran %" PRIu32 " times\n", i, runs);
+    }
+  }
+  printf("integrity: %zu producers, %zu jobs, %" PRIu64 " errors\n", kProducers, counters.runs.size(), errors);
+  return errors == 0;
+}
+
+auto test_wakeup() -> bool {
+  Counters counters(kBursts * kWorkers * 2);
+  thread_pool pool(kWorkers);
+  std::vector<int64_t> latency;
+  uint64_t posted = 0;
+  uint64_t lost = 0;
+  for (size_t burst = 0; burst < kBursts; burst++) {
+    // Long enough for all workers to find the ring empty and go to sleep
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    auto jobs = 1 + burst % (kWorkers * 2);
+    for (size_t i = 0; i < jobs; i++) {
+      counters.posted[posted + i] = thread_pool::now_ns();
+      pool.post(make_job(counters, posted + i));
+    }
+    posted += jobs;
+    if (!wait_for(counters.ran, posted)) {
+      fprintf(stderr, "Burst %zu of %zu jobs did not complete\n", burst, jobs);
+      lost++;
+      break;
+    }
+  }
+  for (size_t i = 0; i < posted; i++) {
+    latency.push_back(counters.started[i] - counters.posted[i]);
+  }
+  printf("wakeup: %zu bursts, %" PRIu64 " jobs, %" PRIu64 " lost, post to start p50 %.1f us, p99 %.1f us, max %.1f us\n",
+      kBursts, posted, lost, percentile(latency, 50), percentile(latency, 99), percentile(latency, 100));
+  return lost == 0;
+}
+
+auto test_deadlines() -> bool {
+  const size_t jobs = 1000;
+  Counters counters(jobs);
+  uint64_t expect_dropped = 0;
+  uint64_t late = 0;
+  {
+    thread_pool pool(kWorkers);
+    auto past = thread_pool::now_ns() - 1000000;
+    for (size_t i = 0; i < jobs; i++) {
+      auto j = make_job(counters, i);
+      switch (i % 4) {
+        case 0:  // Late, and may be dropped
+          j.drop = drop_job;
+          j.deadline_ns = past;
+          expect_dropped++;
+          break;
+        case 1:  // Late, but must run
+          j.deadline_ns = past;
+          break;
+        case 2:  // No deadline
+          j.drop = drop_job;
+          break;
+        default:  // Deadline far ahead
+          j.drop = drop_job;
+          j.deadline_ns = thread_pool::now_ns() + 60000000000;
+          break;
+      }
+      pool.post(j);
+    }
+    wait_for(counters.ran, jobs - expect_dropped);
+    wait_for(counters.dropped, expect_dropped);
+    late = pool.late_count();
+  }
+
+  auto ok = counters.ran == jobs - expect_dropped && counters.dropped == expect_dropped && late == expect_dropped;
+  printf("deadlines: %" PRIu64 " ran, %" PRIu64 " dropped, %" PRIu64 " counted late, expected %" PRIu64 " dropped\n",
+      counters.ran.load(), counters.dropped.load(), late, expect_dropped);
+  return ok;
+}
+
+// Posts a job every kBenchmarkPeriod from one thread, like the main loop does per subframe
+template <class Post>
+void benchmark(const char* name, Counters& counters, Post&& post) {
+  std::vector<int64_t> post_cost;
+  auto next = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kBenchmarkJobs; i++) {
+    counters.posted[i] = thread_pool::now_ns();
+    post(static_cast<uint32_t>(i));
+    post_cost.push_back(thread_pool::now_ns() - counters.posted[i]);
+    next += kBenchmarkPeriod;
+    std::this_thread::sleep_until(next);
+  }
+  wait_for(counters.ran, kBenchmarkJobs);
+
+  std::vector<int64_t> latency;
+  for (size_t i = 0; i < kBenchmarkJobs; i++) {
+    latency.push_back(counters.started[i] - counters.posted[i]);
+  }
+  printf("%-12s: post p50 %.2f us, p99 %.2f us, max %.1f us; post to start p50 %.1f us, p99 %.1f us, max %.1f us\n",
+      name, percentile(post_cost, 50), percentile(post_cost, 99), percentile(post_cost, 100),
+      percentile(latency, 50), percentile(latency, 99), percentile(latency, 100));
+}
+
+void benchmark_pools() {
+  {
+    Counters counters(kBenchmarkJobs);
+    thread_pool pool(kWorkers);
+    benchmark("job ring", counters, [&](uint32_t i) { pool.post(make_job(counters, i)); });
+  }
+  {
+    Counters counters(kBenchmarkJobs);
+    locked_pool pool(kWorkers);
+    std::vector<std::future<void>> futures;
+    futures.reserve(kBenchmarkJobs);
+    benchmark("locked queue", counters, [&](uint32_t i) {
+      auto j = make_job(counters, i);
+      futures.push_back(pool.push([j] { count_job(j); }));
+    });
+  }
+}
+}  // namespace
+
+auto main() -> int {
+  // The pool logs every worker launch, and an error if it can't get realtime priority
+  spdlog::set_level(spdlog::level::critical);
+
+  bool ok = test_integrity();
+  ok &= test_wakeup();
+  ok &= test_deadlines();
+  benchmark_pools();
+  return ok ? 0 : 1;
+}